@@ -6,6 +6,42 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "generated_trie.h"
+
+// Depth of the fragment call stack; the generator reports the deepest nesting.
+#if ZMK_TEXT_EXPANDER_GENERATED_MAX_REF_DEPTH > 0
+#define EXPANSION_MAX_REF_DEPTH ZMK_TEXT_EXPANDER_GENERATED_MAX_REF_DEPTH
+#else
+#define EXPANSION_MAX_REF_DEPTH 1
+#endif
+
+// Times a report the endpoint turns down is sent again before the expansion is
+// stopped. With the wait doubling up to the pacing ceiling, that is about 300 ms.
+#define EXPANSION_MAX_REPORT_RETRIES 8
+
+// Steps the work handler runs back to back before yielding the workqueue.
+#define EXPANSION_MAX_INLINE_STEPS 16
+
+// Most taps pressed together in one HID report.
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_BURST_TYPING
+#ifdef CONFIG_ZMK_HID_REPORT_TYPE_HKRO
+// Leaves a slot of the report for a key the user is holding.
+#define EXPANSION_BURST_MAX_KEYS MIN(CONFIG_ZMK_TEXT_EXPANDER_BURST_MAX_KEYS, CONFIG_ZMK_HID_KEYBOARD_REPORT_SIZE - 1)
+#else
+#define EXPANSION_BURST_MAX_KEYS CONFIG_ZMK_TEXT_EXPANDER_BURST_MAX_KEYS
+#endif
+#else
+#define EXPANSION_BURST_MAX_KEYS 1
+#endif
+
+// Workqueue that runs the key processing and the expansions.
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_DEDICATED_WORK_QUEUE
+extern struct k_work_q text_expander_work_q;
+#define EXPANSION_WORK_Q (&text_expander_work_q)
+#else
+#define EXPANSION_WORK_Q (&k_sys_work_q)
+#endif
+
 // Forward declaration
 struct expansion_work;
 
@@ -14,6 +50,9 @@ struct expansion_work;
  */
 struct os_typing_driver {
     void (*start_unicode_typing)(struct expansion_work *exp_work);
+    // Key that discards a sequence stopped halfway once its keys are up, or 0 if none is needed.
+    uint32_t (*discard_unicode_key)(const struct expansion_work *exp_work);
+    uint8_t word_delete_mods; // Make Backspace delete the word before the cursor.
 };
 
 enum expansion_state {
@@ -25,57 +64,118 @@ enum expansion_state {
   EXPANSION_STATE_TYPE_CHAR_START,
   EXPANSION_STATE_TYPE_CHAR_KEY_PRESS,
   EXPANSION_STATE_TYPE_CHAR_KEY_RELEASE,
-  EXPANSION_STATE_TYPE_LITERAL_CHAR,
   EXPANSION_STATE_FINISH,
   EXPANSION_STATE_REPLAY_KEY_PRESS,
   EXPANSION_STATE_REPLAY_KEY_RELEASE,
+  EXPANSION_STATE_END, // Waits for the last report to get through before going idle.
 
   // Unicode Start
   EXPANSION_STATE_UNICODE_START,
 
   // Windows Unicode States
-  EXPANSION_STATE_WIN_UNI_PRESS_ALT,
   EXPANSION_STATE_WIN_UNI_TYPE_NUMPAD_PRESS,
   EXPANSION_STATE_WIN_UNI_TYPE_NUMPAD_RELEASE,
-  EXPANSION_STATE_WIN_UNI_RELEASE_ALT,
 
   // macOS Unicode States
-  EXPANSION_STATE_MAC_UNI_PRESS_OPTION,
   EXPANSION_STATE_MAC_UNI_TYPE_HEX_PRESS,
   EXPANSION_STATE_MAC_UNI_TYPE_HEX_RELEASE,
-  EXPANSION_STATE_MAC_UNI_RELEASE_OPTION,
 
   // Linux Unicode States
-  EXPANSION_STATE_LINUX_UNI_PRESS_CTRL_SHIFT,
   EXPANSION_STATE_LINUX_UNI_PRESS_U,
   EXPANSION_STATE_LINUX_UNI_RELEASE_U,
-  EXPANSION_STATE_LINUX_UNI_RELEASE_CTRL_SHIFT,
   EXPANSION_STATE_LINUX_UNI_TYPE_HEX_PRESS,
   EXPANSION_STATE_LINUX_UNI_TYPE_HEX_RELEASE,
   EXPANSION_STATE_LINUX_UNI_PRESS_TERMINATOR,
   EXPANSION_STATE_LINUX_UNI_RELEASE_TERMINATOR,
 };
 
+// How the letters of an expansion are cased, following how the short code was typed.
+enum expansion_case {
+  EXPANSION_CASE_AS_IS,
+  EXPANSION_CASE_CAPITALIZE, // Upper-case the first letter.
+  EXPANSION_CASE_UPPER,      // Upper-case every letter.
+};
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_WORD_DELETE
+// Follows the whole words at the end of what an expansion types, which a
+// word-delete chord removes one at a time: runs of letters and digits that
+// follow a space within the expansion, each with at most one space after it.
+struct expansion_words {
+  uint16_t count;      // Words before the last one.
+  uint16_t chars;      // Characters of those words, with their spaces.
+  uint16_t last_chars; // Characters of the last word so far, or 0 if it does not count.
+  uint8_t last_spaces; // Spaces after the last word.
+  uint8_t prev_class;  // Class of the last character typed.
+};
+#endif
+
+// What stopped an expansion before it was done.
+enum expansion_preemption {
+  EXPANSION_PREEMPT_NONE,
+  EXPANSION_PREEMPT_KEY_PRESS,
+  EXPANSION_PREEMPT_ABORT_KEY,
+  EXPANSION_PREEMPT_LAYER_CHANGE,
+  EXPANSION_PREEMPT_REPORT_FAILED, // The endpoint kept turning down a report.
+};
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_LATENESS_STATS
+// How much later than scheduled the steps of an expansion ran.
+struct expansion_lateness {
+  uint32_t steps;
+  uint32_t max_us;
+  uint64_t total_us;
+};
+#endif
+
 struct expansion_work {
   struct k_work_delayable work;
-  const char *expanded_text;
-  uint8_t backspace_count;
-  size_t text_index;
+  const uint8_t *keys;     // Next opcode of the keystroke program being typed (see TRIE_OP_*).
+  uint16_t backspace_count; // Backspaces left to send, word-delete chords included.
+  uint16_t backspaces_sent;
+  uint16_t word_deletes;    // Of the backspaces left, how many are word-delete chords, which go first.
+  uint16_t chars_typed;    // Taps and codepoints typed so far.
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_WORD_DELETE
+  struct expansion_words typed_words;
+#endif
+  const uint8_t *phrase;   // Rest of the phrase being typed, if phrase_left > 0.
+  uint8_t phrase_left;
+  const uint8_t *ref_stack[EXPANSION_MAX_REF_DEPTH]; // Where the programs that referenced the one being typed resume.
+  uint8_t ref_depth;
   int64_t start_time_ms;
+  uint32_t first_report;   // hid_report_count() when the expansion started.
+  uint32_t reports_sent;   // Reports the last finished expansion sent.
+  uint8_t report_retries;
+  bool step_now;           // The next state runs in this invocation of the work handler.
+  volatile enum expansion_preemption preemption; // Requested by the input path, acted on by the work handler.
+  int64_t preemption_ticks; // When the preemption was requested.
+  bool preempted;          // The current or last expansion was stopped before it was done.
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_LATENESS_STATS
+  int64_t due_ticks;       // When the work item was scheduled to run next.
+  struct expansion_lateness lateness; // Of the current or last expansion.
+#endif
   volatile enum expansion_state state;
   uint16_t current_keycode;
-  bool current_char_needs_shift;
-  bool shift_mod_active;
+  uint8_t held_keys[EXPANSION_BURST_MAX_KEYS]; // Taps pressed by the last report and not released yet.
+  uint8_t num_held_keys;
+  uint8_t held_mods;       // Modifiers pressed by the expansion and not released yet.
   uint16_t trigger_keycode_to_replay;
+  enum expansion_case letter_case; // Drops to EXPANSION_CASE_AS_IS once the first letter is capitalized.
 
-  size_t literal_end_index;
   uint32_t unicode_codepoint;
-  char unicode_hex_buffer[9];
-  uint8_t unicode_hex_index;
+  uint8_t unicode_digits[8]; // Digits of the codepoint for the OS input method, most significant first.
+  uint8_t unicode_num_digits;
+  uint8_t unicode_digit_index;
 };
 
 void expansion_work_handler(struct k_work *work);
-int start_expansion(struct expansion_work *work_item, const char *expanded_text, uint8_t len_to_delete, uint16_t trigger_keycode);
+// Deletes `len_to_delete` characters and types `keys`. With `by_words`, the
+// characters to delete end with what the last expansion typed, and with
+// CONFIG_ZMK_TEXT_EXPANDER_WORD_DELETE its whole words go a chord at a time.
+int start_expansion(struct expansion_work *work_item, const uint8_t *keys, uint16_t len_to_delete, bool by_words,
+                    uint16_t trigger_keycode, enum expansion_case letter_case);
 void cancel_current_expansion(struct expansion_work *work_item);
+// Stops the running expansion at its next step, from any thread. Its keys and
+// modifiers are released and it ends early, which it logs with how much it typed.
+void preempt_current_expansion(struct expansion_work *work_item, enum expansion_preemption reason);
 
 #endif /* ZMK_EXPANSION_ENGINE_H */
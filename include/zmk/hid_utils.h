@@ -8,6 +8,22 @@
 uint32_t char_to_keycode(char c, bool *needs_shift);
 int send_and_flush_key_action(uint32_t keycode, bool pressed);
 
+// A report transaction stages key and modifier changes and sends them as one
+// keyboard report on commit. Changes that leave the report as it was are
+// dropped, and a commit with nothing to send sends nothing. Beginning a
+// transaction keeps the changes of a report the endpoint turned down, so they
+// go out with the next commit instead of being lost.
+void hid_report_begin(void);
+void hid_report_stage_key(uint32_t keycode, bool pressed);
+void hid_report_stage_mods(zmk_mod_flags_t mods, bool pressed);
+int hid_report_commit(void);
+
+// True if the last commit failed; committing again resends its changes.
+bool hid_report_pending(void);
+
+// Reports sent by hid_report_commit() since boot.
+uint32_t hid_report_count(void);
+
 static inline int send_key_action(uint32_t keycode, bool pressed) {
     return pressed ? zmk_hid_keyboard_press(keycode) : zmk_hid_keyboard_release(keycode);
 }
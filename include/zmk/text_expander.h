@@ -5,6 +5,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zmk/events/keycode_state_changed.h>
 
 #include <zmk/trie.h>
 #include <zmk/expansion_engine.h>
@@ -16,32 +18,64 @@
 #define MAX_SHORT_LEN 16
 #endif
 
+// Undo is compiled in when any text expander instance lists undo-keycodes.
+#define TEXT_EXPANDER_NODE_HAS_UNDO(node_id) DT_NODE_HAS_PROP(node_id, undo_keycodes) ||
+#define TEXT_EXPANDER_HAS_UNDO \
+    (DT_FOREACH_STATUS_OKAY(zmk_behavior_text_expander, TEXT_EXPANDER_NODE_HAS_UNDO) 0)
+
 #define TYPING_DELAY CONFIG_ZMK_TEXT_EXPANDER_TYPING_DELAY
 #define KEY_EVENT_QUEUE_SIZE CONFIG_ZMK_TEXT_EXPANDER_EVENT_QUEUE_SIZE
 
+// Keyboard usages whose events can be held back during an expansion.
+#define CAPTURE_KEYCODES 256
+
 enum expansion_context {
     EXPAND_FROM_AUTO_TRIGGER,
     EXPAND_FROM_MANUAL_TRIGGER,
+    EXPAND_EAGERLY, // The typed characters can only complete one short code.
 };
 
 struct text_expander_key_event {
     uint16_t keycode;
     bool pressed;
+#ifndef CONFIG_ZMK_TEXT_EXPANDER_CASE_IGNORE
+    bool shifted; // Shift was held, or added by the binding, when the key was pressed.
+#endif
+    trie_instance_mask_t trigger_instance; // Set for a press of this dictionary's trigger key instead of a keycode.
+    bool captured; // `event` is held back from the host until this is processed.
+    struct zmk_keycode_state_changed_event event;
 };
 
 struct text_expander_data {
   const struct trie_node *root;
-  char current_short[MAX_SHORT_LEN];
+  char current_short[MAX_SHORT_LEN]; // In the case it was typed in; the trie holds it in lower case.
   uint8_t current_short_len;
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_STREAMING_MATCH
+  trie_node_offset_t stream_state; // Aho-Corasick state; current_short holds its path.
+  // The last MAX_SHORT_LEN characters typed and the state after each, newest at
+  // stream_head, so Backspace can step back to the state before a character.
+  char stream_chars[MAX_SHORT_LEN];
+  trie_node_offset_t stream_states[MAX_SHORT_LEN];
+  uint8_t stream_head;
+  uint8_t stream_len;
+#else
+  struct trie_cursor cursor;
+#endif
   struct k_mutex mutex;
   struct expansion_work expansion_work_item;
   struct k_msgq key_event_msgq;
   char key_event_msgq_buffer[KEY_EVENT_QUEUE_SIZE * sizeof(struct text_expander_key_event)];
   const struct os_typing_driver *os_driver;
+#ifndef CONFIG_ZMK_TEXT_EXPANDER_CASE_IGNORE
+  uint8_t held_shift_keys; // Bit 0: left Shift, bit 1: right Shift.
+#endif
+  ATOMIC_DEFINE(captured_keys, CAPTURE_KEYCODES); // Keys whose press is held back, so their release is too.
+  uint8_t num_captured_keys;
 
-#if DT_INST_NODE_HAS_PROP(0, undo_keycodes)
+#if TEXT_EXPANDER_HAS_UNDO
   char last_short_code[MAX_SHORT_LEN];
-  const char *last_expanded_text;
+  uint8_t undo_keys[MAX_SHORT_LEN]; // last_short_code as a keystroke program, built when undo retypes it.
+  trie_typed_len_t last_typed_len;  // Characters the last expansion typed.
   uint16_t last_trigger_keycode;
   bool just_expanded;
 #endif
@@ -49,4 +83,15 @@ struct text_expander_data {
 
 extern struct text_expander_data expander_data;
 
+// Goes on with the key events that arrived during an expansion. Called by the
+// engine when one ends.
+void text_expander_resume(void);
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_DICTIONARY_PARTITION
+// Switches to the dictionary image written with trie_image_begin() and
+// trie_image_write(), cancelling any expansion in progress. Must not be called
+// from EXPANSION_WORK_Q, which runs the expansions.
+int text_expander_commit_dictionary(void);
+#endif
+
 #endif /* ZMK_TEXT_EXPANDER_H */
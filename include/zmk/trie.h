@@ -2,47 +2,242 @@
 #define ZMK_TRIE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-// Sentinel value for a null/invalid index.
-#define NULL_INDEX UINT16_MAX
+#include <zephyr/toolchain.h>
+#include <zephyr/sys/util.h>
 
-// An entry in the hash table. Represents one child of a trie node.
+#include "generated_trie.h"
+
+// Maps a character to its slot in a node's child table. The generator picks a
+// per-node seed so that every child lands in its own slot (a perfect hash).
+#define TRIE_CHILD_SLOT(c, seed, mask) ((((uint16_t)(uint8_t)(c) * (seed)) >> 5) & (mask))
+
+// The index types (trie_node_offset_t etc.), their null sentinels and
+// TRIE_NODE_ALIGN are emitted into generated_trie.h, sized by the generator to
+// fit the dictionary.
+
+// Bits of trie_node.flags.
+#define TRIE_NODE_FLAG_TERMINAL BIT(0)         // The node completes a short code.
+#define TRIE_NODE_FLAG_PRESERVE_TRIGGER BIT(1) // The trigger key should be replayed after expanding.
+#define TRIE_NODE_FLAG_HAS_CHILDREN BIT(2)     // The node has a child table.
+#define TRIE_NODE_FLAG_UNIQUE_COMPLETION BIT(3) // Exactly one short code starts with this node's path.
+#define TRIE_NODE_FLAG_VARIANTS BIT(4)          // Instances define the short code differently; see trie_variant.
+#define TRIE_NODE_FLAG_COMPLETION BIT(5)        // The expanded text starts with the short code.
+
+// A slot in a node's inline child table. Unused slots hold TRIE_NODE_OFFSET_NULL.
 struct trie_hash_entry {
-    char key;                   // The character for this branch (e.g., 'a', '-', etc.)
-    uint16_t child_node_index;  // Index to the child trie_node in the main nodes array.
-    uint16_t next_entry_index;  // Index to the next entry in this bucket's chain (for collisions).
+    char key;                             // The character for this branch (e.g., 'a', '-', etc.)
+    trie_node_offset_t child_node_offset; // Offset of the child node in the packed trie.
 };
 
-// Represents the hash table for a single trie node's children.
-struct trie_hash_table {
-    uint16_t buckets_start_index; // Index into the global hash_buckets array.
-    uint8_t num_buckets;          // Number of buckets in this specific hash table.
+// A slot of the double-array backend. The child of node n for character c is in
+// slot n->da_base + (c - da_first_char) if that slot's check equals n's offset.
+struct trie_da_slot {
+    trie_node_offset_t check;             // Offset of the parent node that owns this slot, or TRIE_NODE_OFFSET_NULL if free.
+    trie_node_offset_t child_node_offset; // Offset of the child node in the packed trie.
 };
 
-// Represents a node in the static, read-only trie.
+// A node header in the packed trie. Nodes are stored depth-first in one byte
+// array, addressed by offset in units of TRIE_NODE_ALIGN, with the root at 0. With the hash
+// backend, a node with children is directly followed by its mask + 1 child
+// slots: the root's are indexed by character, the others by TRIE_CHILD_SLOT.
+// Chains of single-child nodes are path-compressed: the edge into a node is its
+// branch key followed by its label. In streaming mode edges are never
+// compressed and every node carries its Aho-Corasick links.
 struct trie_node {
-    uint16_t hash_table_index;      // Index to the hash table for this node's children.
-    uint16_t expanded_text_offset;  // Offset to the expanded text in the string pool.
-    bool is_terminal;               // Flag indicating if this node represents a complete short code.
-    bool preserve_trigger;          // Flag indicating if the trigger key should be replayed.
+    trie_string_offset_t expanded_text_offset; // Offset to the keystroke program in the string pool, or of the first variant.
+    trie_string_offset_t label_offset;         // Offset to the rest of the incoming edge in the string pool.
+#if ZMK_TEXT_EXPANDER_GENERATED_NUM_INSTANCES > 1
+    trie_instance_mask_t instance_mask;        // Instances whose dictionaries define this short code.
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_TRIE_BACKEND_DOUBLE_ARRAY
+    trie_slot_index_t da_base;                 // First double-array slot of this node's children.
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_STREAMING_MATCH
+    trie_node_offset_t fail_offset;            // Node of the longest proper suffix of this path that is also in the trie.
+    trie_node_offset_t match_offset;           // Nearest terminal on the failure chain, this node included, or TRIE_NODE_OFFSET_NULL.
+    uint8_t depth;                             // Length of the path from the root to this node.
+#endif
+    trie_typed_len_t typed_len;                // Characters the expansion leaves typed, for undo.
+    uint8_t label_len;                         // Number of edge characters after the branch key.
+    uint8_t flags;                             // TRIE_NODE_FLAG_* bits.
+#ifndef CONFIG_ZMK_TEXT_EXPANDER_TRIE_BACKEND_DOUBLE_ARRAY
+    uint8_t mask;                              // Number of inline child slots minus one.
+    uint8_t seed;                              // Per-node multiplier that makes TRIE_CHILD_SLOT collision-free.
+#endif
+} __aligned(TRIE_NODE_ALIGN);
+
+// The generator compiles every expanded text into a keystroke program in the
+// string pool, ending with TRIE_OP_END. A byte below 0x80 taps one key: the
+// HID usage in its low six bits, with Shift held if TRIE_KEY_SHIFT is set.
+// Commands and codepoints are resolved at build time, so the engine only
+// decodes bytes. Must match OP_* and KEY_* in gen_trie.py.
+#define TRIE_OP_END 0x00
+#define TRIE_OP_UNICODE 0x80    // Types the codepoint in the next three bytes, little-endian.
+#define TRIE_OP_OS_WINDOWS 0x81 // Switches the Unicode input method.
+#define TRIE_OP_OS_MACOS 0x82
+#define TRIE_OP_OS_LINUX 0x83
+#define TRIE_OP_REF 0x84        // Types the fragment whose index is in the next two bytes, little-endian.
+
+#define TRIE_OP_UNICODE_LEN 4
+#define TRIE_OP_REF_LEN 3
+
+#define TRIE_KEY_SHIFT BIT(6)
+#define TRIE_KEY_USAGE_MASK 0x3F
+#define TRIE_OP_IS_KEY(op) ((op) < 0x80)
+
+// Programs are compressed with a static phrase dictionary: the two bytes
+// (TRIE_PHRASE_TOKEN_LEAD | n >> 7, 0x80 | (n & 0x7F)) stand for phrase n. No
+// opcode starts with a lead byte, and phrases only hold key taps and
+// codepoints, so commands are never inside one.
+#define TRIE_PHRASE_TOKEN_LEAD 0xF8
+#define TRIE_PHRASE_TOKEN_LEN 2
+
+// A phrase: part of a program in the string pool, without TRIE_OP_END.
+struct trie_phrase {
+    trie_string_offset_t offset; // Offset of the phrase in the string pool.
+    uint8_t len;                 // Length of the phrase in bytes.
+};
+
+// One definition of a short code that instances define differently. A node
+// with TRIE_NODE_FLAG_VARIANTS points at a run of these, the last one marked
+// with TRIE_VARIANT_FLAG_LAST; each instance is in the mask of exactly one.
+struct trie_variant {
+    trie_string_offset_t text_offset;   // Offset to the keystroke program in the string pool.
+    trie_instance_mask_t instance_mask; // Instances using this definition.
+    trie_typed_len_t typed_len;         // Characters the expansion leaves typed, for undo.
+    uint8_t flags;                      // TRIE_NODE_FLAG_PRESERVE_TRIGGER, _COMPLETION and TRIE_VARIANT_FLAG_LAST.
+};
+
+#define TRIE_VARIANT_FLAG_LAST BIT(7)
+
+// The expansion of a terminal for the active instances.
+struct trie_expansion {
+    const uint8_t *keys;        // Keystroke program.
+    trie_typed_len_t typed_len; // Characters it leaves typed.
+    bool preserve_trigger;      // The trigger key should be replayed after it.
+    // The program starts with one key tap per short code character, so a
+    // completion starts typing that many bytes in.
+    bool completion;
+};
+
+// Deepest path a cursor can track; matches the longest generated short code.
+#if ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN > 0
+#define TRIE_CURSOR_MAX_DEPTH ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN
+#else
+#define TRIE_CURSOR_MAX_DEPTH 1
+#endif
+
+// Incremental position in the trie, advanced one character per keystroke.
+struct trie_cursor {
+    trie_node_offset_t path[TRIE_CURSOR_MAX_DEPTH + 1]; // Node offsets along the matched path; path[0] is the root.
+    uint8_t depth;                                      // Index in `path` of the node currently being matched.
+    uint8_t label_pos;                                  // Characters of that node's edge label matched so far.
+    uint8_t miss_depth;                                 // Number of characters typed past the last matching node.
+};
+
+// The tables every lookup reads. They point at the arrays compiled into the
+// firmware, or at a dictionary image read in place from flash (trie_image.h).
+struct trie_tables {
+    const uint8_t *trie;                   // Packed nodes, aligned to TRIE_NODE_ALIGN.
+    trie_node_offset_t trie_size;          // Size of the packed trie in TRIE_NODE_ALIGN units; 0 if empty.
+    uint8_t root_first_char;               // Character of the root's first child slot.
+    uint8_t da_first_char;
+    uint8_t da_alphabet_size;
+    trie_slot_index_t da_num_slots;
+    const struct trie_da_slot *da_slots;
+    const char *string_pool;
+    size_t string_pool_size;               // In bytes, including the final NUL.
+    uint16_t num_phrases;
+    const struct trie_phrase *phrases;
+    uint16_t num_fragments;
+    const trie_string_offset_t *fragments; // Pool offsets of the fragments' keystroke programs.
+    trie_string_offset_t num_variants;
+    const struct trie_variant *variants;
 };
 
-// Extern declarations for the data arrays generated by the Python script.
-extern const uint16_t zmk_text_expander_trie_num_nodes;
-extern const struct trie_node zmk_text_expander_trie_nodes[];
-extern const struct trie_hash_table zmk_text_expander_hash_tables[];
-extern const struct trie_hash_entry zmk_text_expander_hash_entries[];
-extern const uint16_t zmk_text_expander_hash_buckets[];
-extern const char zmk_text_expander_string_pool[];
+// The tables generated by the Python script and compiled into the firmware.
+extern const struct trie_tables zmk_text_expander_compiled_tables;
 
-// Function to get a string from the pool using its offset.
-const char *zmk_text_expander_get_string(uint16_t offset);
+// Switches every lookup to `tables`, or back to the compiled-in tables if NULL.
+// Node pointers and offsets from the previous tables become invalid.
+void trie_set_tables(const struct trie_tables *tables);
 
-// Searches for a key and returns the node if it's a terminal.
+// Selects the instances whose short codes the lookups match; a terminal that no
+// selected instance defines is treated as a plain prefix. This is one store, and
+// cursors and streaming states stay valid across it since all instances share
+// one trie. All instances are selected initially.
+void trie_set_active_instances(trie_instance_mask_t mask);
+
+trie_instance_mask_t trie_get_active_instances(void);
+
+// Resolves the expansion of a terminal for the active instances. Returns
+// false if none of them defines it or its program offset is invalid.
+bool trie_get_expansion(const struct trie_node *node, struct trie_expansion *expansion);
+
+// Returns the string at `offset` in the string pool, or NULL if it is out of bounds.
+const char *trie_get_string(trie_string_offset_t offset);
+
+// Returns true if `keys` starts with a phrase token.
+static inline bool trie_is_phrase_token(const uint8_t *keys) {
+    return keys[0] >= TRIE_PHRASE_TOKEN_LEAD;
+}
+
+// Resolves the phrase token at `token`. Returns the phrase and sets *len, or
+// returns NULL if the token is invalid.
+const uint8_t *trie_get_phrase(const uint8_t *token, uint8_t *len);
+
+// Returns the keystroke program of fragment `index`, or NULL if it is out of bounds.
+const uint8_t *trie_get_fragment(uint32_t index);
+
+// Returns the root node, or NULL if the trie is empty.
+const struct trie_node *trie_get_root(void);
+
+// Searches for a key and returns the node if it's a terminal of an active instance.
 const struct trie_node *trie_search(const char *key);
 
-// Gets a node for a given key prefix, terminal or not.
+// Gets a node for a given key prefix, terminal or not. A prefix that ends inside a
+// compressed edge returns the node at the end of that edge.
 const struct trie_node *trie_get_node_for_key(const char *key);
 
+// Returns the only terminal at or below `node` if its flags mark it as a unique
+// completion and an active instance defines it, otherwise NULL. Such a subtree
+// is a single path, stored as consecutive nodes in depth-first order, so this
+// never searches a child table. Uniqueness counts the short codes of all
+// instances, so an inactive one can keep an active one from completing early.
+const struct trie_node *trie_unique_completion(const struct trie_node *node);
+
+// Moves the cursor back to the root node.
+void trie_cursor_reset(struct trie_cursor *cursor);
+
+// Follows the child for `c`. Returns false once the typed characters leave the trie.
+bool trie_cursor_advance(struct trie_cursor *cursor, char c);
+
+// Undoes the most recent advance (e.g., on backspace).
+void trie_cursor_retreat(struct trie_cursor *cursor);
+
+// Returns the node under the cursor, or NULL if the typed characters are not a valid prefix.
+// Inside a compressed edge this is the node the edge leads to.
+const struct trie_node *trie_cursor_node(const struct trie_cursor *cursor);
+
+// Returns the node under the cursor if it completes a short code of an active instance, otherwise NULL.
+const struct trie_node *trie_cursor_terminal(const struct trie_cursor *cursor);
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_STREAMING_MATCH
+// Streaming match state: the offset of the node for the longest suffix of the
+// typed stream that is a path in the trie. The root (0) is the empty suffix.
+
+// Feeds one character to the Aho-Corasick automaton and returns the new state.
+// Amortized O(1) per character: failure links only ever shorten the match.
+trie_node_offset_t trie_stream_advance(trie_node_offset_t state, char c);
+
+// Returns the node for a state, or NULL if the trie is empty.
+const struct trie_node *trie_stream_node(trie_node_offset_t state);
+
+// Returns the longest short code of an active instance ending at the end of the stream, or NULL.
+const struct trie_node *trie_stream_match(trie_node_offset_t state);
+#endif
+
 #endif /* ZMK_TRIE_H */
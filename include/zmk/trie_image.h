@@ -0,0 +1,82 @@
+#ifndef ZMK_TRIE_IMAGE_H
+#define ZMK_TRIE_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zephyr/sys/util.h>
+
+/*
+ * A dictionary image is the trie tables written by `gen_trie.py --image`, read
+ * in place from the `text_expander_partition` flash partition. The partition
+ * is split into two slots so a new image can be written while the current one
+ * stays in use; the valid image with the higher dictionary version wins.
+ */
+
+#define TRIE_IMAGE_MAGIC 0x4458545A // "ZTXD", little-endian.
+#define TRIE_IMAGE_FORMAT_VERSION 3
+#define TRIE_IMAGE_SECTION_ALIGN 8
+
+// Bits of trie_image_header.layout_flags. Must match IMAGE_FLAG_* in gen_trie.py.
+#define TRIE_IMAGE_FLAG_DOUBLE_ARRAY BIT(0)
+#define TRIE_IMAGE_FLAG_STREAMING BIT(1)
+
+// Sections of an image, in the order they are stored.
+enum trie_image_section_id {
+    TRIE_IMAGE_SECTION_TRIE,
+    TRIE_IMAGE_SECTION_DA_SLOTS,
+    TRIE_IMAGE_SECTION_STRING_POOL,
+    TRIE_IMAGE_SECTION_PHRASES,
+    TRIE_IMAGE_SECTION_FRAGMENTS,
+    TRIE_IMAGE_SECTION_VARIANTS,
+    TRIE_IMAGE_NUM_SECTIONS,
+};
+
+struct trie_image_section {
+    uint32_t offset; // From the start of the image; a multiple of TRIE_IMAGE_SECTION_ALIGN.
+    uint32_t size;   // In bytes.
+};
+
+// Must match IMAGE_HEADER_FIELDS in gen_trie.py. All fields are little-endian.
+struct trie_image_header {
+    uint32_t magic;
+    uint16_t format_version;
+    uint16_t header_size;
+    uint32_t image_size;         // Header and sections, in bytes.
+    uint32_t dictionary_version; // Set with CONFIG_ZMK_TEXT_EXPANDER_DICTIONARY_VERSION.
+    uint8_t node_offset_size;    // sizeof() of the index types the tables were packed with.
+    uint8_t string_offset_size;
+    uint8_t slot_index_size;
+    uint8_t node_align;
+    uint8_t layout_flags;        // TRIE_IMAGE_FLAG_*
+    uint8_t max_short_len;       // Longest short code in the image.
+    uint8_t max_ref_depth;       // Deepest fragment nesting in the image.
+    uint8_t root_first_char;
+    uint8_t da_first_char;
+    uint8_t da_alphabet_size;
+    uint8_t num_instances;       // Text expander instances whose bits the image uses.
+    uint8_t typed_len_size;      // sizeof(trie_typed_len_t) the tables were packed with.
+    struct trie_image_section sections[TRIE_IMAGE_NUM_SECTIONS];
+    uint32_t crc32; // CRC-32 (IEEE) of the header up to this field, then of the sections.
+};
+
+// Switches the lookups to the newest valid image in the partition, if there is
+// one, or to the compiled-in tables otherwise. Called at startup.
+int trie_image_load(void);
+
+// Starts writing a new image of `image_size` bytes by erasing the slot that is
+// not in use.
+int trie_image_begin(size_t image_size);
+
+// Writes part of the new image. `offset` and `len` must be multiples of the
+// flash write block size; pad the last chunk with 0xFF.
+int trie_image_write(size_t offset, const void *data, size_t len);
+
+// Checks the new image and switches the lookups to it, then erases the old
+// one. Call text_expander_commit_dictionary() instead, which pauses the
+// expander while the tables change.
+int trie_image_commit(void);
+
+// Version of the image in use, or 0 for the compiled-in tables.
+uint32_t trie_image_active_version(void);
+
+#endif /* ZMK_TRIE_IMAGE_H */
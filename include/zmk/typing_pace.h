@@ -0,0 +1,68 @@
+#ifndef ZMK_TYPING_PACE_H
+#define ZMK_TYPING_PACE_H
+
+#include <stdint.h>
+#include <zephyr/sys/util.h>
+
+/*
+ * Pacing sets how long the engine waits between the HID reports of an
+ * expansion. With CONFIG_ZMK_TEXT_EXPANDER_ADAPTIVE_PACING it is learned per
+ * endpoint from whether the endpoint accepts the reports; otherwise it is half
+ * of CONFIG_ZMK_TEXT_EXPANDER_TYPING_DELAY. The timing profile can make the
+ * wait after particular kinds of report longer.
+ */
+
+// Kinds of report the timing profile has a delay for.
+enum typing_phase {
+    TYPING_PHASE_KEY_PRESS,     // Presses typed keys; the wait is how long they are held.
+    TYPING_PHASE_KEY_RELEASE,   // Releases typed keys; the wait is the gap to the next press.
+    TYPING_PHASE_MODIFIER,      // Presses or releases the modifiers of a Unicode input method.
+    TYPING_PHASE_UNICODE_DIGIT, // Presses or releases a digit of a Unicode input method.
+    TYPING_PHASE_GAP,           // Starts an expansion, or ends its backspaces before its text.
+};
+
+// Shortest wait before a report the endpoint turned down goes out again, so a
+// zero pace still backs off.
+#define TYPING_PACE_MIN_RETRY_US 1000
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_ADAPTIVE_PACING
+// Switches to the pace of the endpoint the reports go to. Called when an expansion starts.
+void typing_pace_start(void);
+
+// Delay between two reports, in microseconds.
+uint32_t typing_pace_delay_us(void);
+
+// Speeds up after a report the endpoint accepted (`err` is 0) and backs off after one it did not.
+void typing_pace_update(int err);
+
+// Delay before the `retry`th attempt at a report the endpoint turned down, in
+// microseconds. The pace has already backed off after each attempt.
+static inline uint32_t typing_pace_retry_us(uint8_t retry) {
+    return MAX(typing_pace_delay_us(), TYPING_PACE_MIN_RETRY_US);
+}
+#else
+static inline void typing_pace_start(void) {}
+static inline uint32_t typing_pace_delay_us(void) { return CONFIG_ZMK_TEXT_EXPANDER_TYPING_DELAY * 1000 / 2; }
+static inline void typing_pace_update(int err) {}
+
+// The fixed pace doubled for each earlier attempt, up to CONFIG_ZMK_TEXT_EXPANDER_PACING_MAX_US.
+static inline uint32_t typing_pace_retry_us(uint8_t retry) {
+    uint32_t delay_us = MAX(typing_pace_delay_us(), TYPING_PACE_MIN_RETRY_US);
+    return MAX(delay_us, MIN((uint64_t)delay_us << retry, CONFIG_ZMK_TEXT_EXPANDER_PACING_MAX_US));
+}
+#endif
+
+// Delay after a report of `phase`, in microseconds: the profile's delay for the
+// phase, shorter or longer than the pace, or the pace if the profile sets none.
+static inline uint32_t typing_pace_phase_us(enum typing_phase phase) {
+    static const uint32_t profile_us[] = {
+        [TYPING_PHASE_KEY_PRESS] = CONFIG_ZMK_TEXT_EXPANDER_TIMING_KEY_PRESS_US,
+        [TYPING_PHASE_KEY_RELEASE] = CONFIG_ZMK_TEXT_EXPANDER_TIMING_KEY_RELEASE_US,
+        [TYPING_PHASE_MODIFIER] = CONFIG_ZMK_TEXT_EXPANDER_TIMING_MODIFIER_US,
+        [TYPING_PHASE_UNICODE_DIGIT] = CONFIG_ZMK_TEXT_EXPANDER_TIMING_UNICODE_DIGIT_US,
+        [TYPING_PHASE_GAP] = CONFIG_ZMK_TEXT_EXPANDER_TIMING_GAP_US,
+    };
+    return profile_us[phase] > 0 ? profile_us[phase] : typing_pace_delay_us();
+}
+
+#endif /* ZMK_TYPING_PACE_H */
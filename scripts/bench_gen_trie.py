@@ -0,0 +1,127 @@
+"""
+Host benchmark for the short code lookup. Lays one dictionary out both as the
+current packed trie and as the original chained-hash layout (separate node,
+table, bucket and entry arrays with 16-bit indices, no path compression), then
+walks every short code and near miss through both and reports the memory reads
+and cache lines each lookup needs. Run it with
+
+    python3 scripts/bench_gen_trie.py [--count N] [dictionary.csv|.json|.jsonl|.yaml]
+
+The counts come from byte-accurate Python mirrors of both lookups, not from a
+firmware build. They predict the relative cost on a target, but they are not
+cycle counts; time trie_get_node_for_key() on the target for those.
+"""
+import argparse
+import sys
+import time
+from pathlib import Path
+
+sys.path.insert(0, str(Path(__file__).resolve().parent))
+from test_gen_trie import pack_backends, sample_dictionary  # noqa: E402 (also stubs dtlib if needed)
+
+import gen_trie  # noqa: E402
+
+# Sizes of the original structs in trie.h.
+CHAINED_NODE_SIZE = 6  # hash_table_index, expanded_text_offset, is_terminal, preserve_trigger
+CHAINED_TABLE_SIZE = 4 # buckets_start_index, num_buckets
+CHAINED_BUCKET_SIZE = 2
+CHAINED_ENTRY_SIZE = 6 # key, child_node_index, next_entry_index
+
+def lay_out_chained(expansions):
+    """The original chained-hash layout of `expansions`, with the nodes in breadth-first order."""
+    nodes = gen_trie.order_nodes_breadth_first(gen_trie.build_trie_from_expansions(expansions))
+    node_map = {id(py_node): index for index, py_node in enumerate(nodes)}
+    tables, buckets, entries = {}, [], []
+    for index, py_node in enumerate(nodes):
+        if not py_node.children:
+            continue
+        num_buckets, chains = gen_trie.chained_buckets(py_node)
+        tables[index] = (len(tables), len(buckets), num_buckets)
+        for bucket in range(num_buckets):
+            head = gen_trie.NULL_INDEX
+            for char in reversed(chains.get(bucket, [])):
+                entries.append((char, node_map[id(py_node.children[char])], head))
+                head = len(entries) - 1
+            buckets.append(head)
+    return {"nodes": nodes, "tables": tables, "buckets": buckets, "entries": entries}
+
+def chained_search(layout, key, touches):
+    """Python mirror of the original trie_get_node_for_key() loop. Returns the terminal node index or None."""
+    node_index = 0
+    for char in key:
+        touches.append(("nodes", node_index * CHAINED_NODE_SIZE, CHAINED_NODE_SIZE))
+        if node_index not in layout["tables"]:
+            return None
+        table_index, buckets_start, num_buckets = layout["tables"][node_index]
+        touches.append(("tables", table_index * CHAINED_TABLE_SIZE, CHAINED_TABLE_SIZE))
+        bucket = buckets_start + ord(char) % num_buckets
+        touches.append(("buckets", bucket * CHAINED_BUCKET_SIZE, CHAINED_BUCKET_SIZE))
+        entry_index = layout["buckets"][bucket]
+        while entry_index != gen_trie.NULL_INDEX:
+            touches.append(("entries", entry_index * CHAINED_ENTRY_SIZE, CHAINED_ENTRY_SIZE))
+            entry_char, child_index, entry_index = layout["entries"][entry_index]
+            if entry_char == char:
+                node_index = child_index
+                break
+        else:
+            return None
+    touches.append(("nodes", node_index * CHAINED_NODE_SIZE, CHAINED_NODE_SIZE))
+    return node_index if layout["nodes"][node_index].is_terminal else None
+
+def measure(lookup, keys):
+    """Mean and worst reads and cache lines per lookup over `keys`, and the host time per lookup."""
+    reads, lines = [], []
+    start = time.perf_counter()
+    for key in keys:
+        touches = []
+        lookup(key, touches)
+        reads.append(len(touches))
+        lines.append(gen_trie.cache_lines(touches))
+    elapsed = time.perf_counter() - start
+    return {"reads": sum(reads) / len(keys), "worst_reads": max(reads), "lines": sum(lines) / len(keys),
+            "worst_lines": max(lines), "us": elapsed * 1e6 / len(keys)}
+
+def load_dictionary(path):
+    """The short codes of a dictionary file, in the form lay_out_trie() takes."""
+    expansions = {}
+    for _, entry in gen_trie.read_dictionary_entries(path):
+        if "short-code" in entry:
+            expansions[str(entry["short-code"])] = {"text": str(entry.get("expanded-text", "")),
+                                                    "preserve_trigger": True}
+    return expansions
+
+def main():
+    parser = argparse.ArgumentParser(description="Compares the lookup cost of the packed and the chained trie layouts.")
+    parser.add_argument("dictionary", nargs="?", help="Dictionary file; a random one is generated if omitted.")
+    parser.add_argument("--count", type=int, default=5000, help="Short codes in the generated dictionary.")
+    parser.add_argument("--seed", type=int, default=0, help="Seed of the generated dictionary.")
+    args = parser.parse_args()
+
+    expansions = load_dictionary(args.dictionary) if args.dictionary else sample_dictionary(args.seed, args.count)
+    if not expansions:
+        print("Error: The dictionary has no short codes.", file=sys.stderr)
+        sys.exit(1)
+    alphabet = sorted({c for short_code in expansions for c in short_code})
+    keys = gen_trie.backend_probes(sorted(expansions), alphabet)
+
+    chained = lay_out_chained(expansions)
+    results = {"chained (original)": measure(lambda key, touches: chained_search(chained, key, touches), keys)}
+    for backend, layout in pack_backends(expansions).items():
+        results[f"packed {backend}"] = measure(
+            lambda key, touches, layout=layout: gen_trie.packed_search(layout["packed"], layout["nodes"], key, touches),
+            keys)
+        for key in keys:
+            found = gen_trie.packed_search(layout["packed"], layout["nodes"], key)
+            if (found is None) != (chained_search(chained, key, []) is None):
+                print(f"Error: The {backend} layout and the chained layout disagree on '{key}'.", file=sys.stderr)
+                sys.exit(1)
+
+    print(f"{len(expansions)} short codes, {len(keys)} lookups (short codes, prefixes and near misses).")
+    print(f"{'layout':<22}{'reads':>8}{'worst':>7}{'lines':>8}{'worst':>7}{'host us':>10}")
+    for name, result in results.items():
+        print(f"{name:<22}{result['reads']:>8.2f}{result['worst_reads']:>7}{result['lines']:>8.2f}"
+              f"{result['worst_lines']:>7}{result['us']:>10.2f}")
+    print(f"Cache lines are {gen_trie.CACHE_LINE_SIZE} bytes. Host time is the Python mirror, not firmware cycles.")
+
+if __name__ == "__main__":
+    main()
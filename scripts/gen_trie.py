@@ -1,6 +1,12 @@
+import argparse
+import csv
+import hashlib
+import json
 import sys
 from pathlib import Path
 import re
+import struct
+import zlib
 
 try:
     from devicetree import dtlib
@@ -9,16 +15,113 @@ except ImportError:
     print("       This may be an issue with the PYTHONPATH environment for the build command.", file=sys.stderr)
     sys.exit(1)
 
-# Sentinel value for a null/invalid index in the generated C code. Should match UINT16_MAX.
-NULL_INDEX = (2**16 - 1)
+# Marks a missing index while building the tables. It is emitted as the null
+# sentinel of the index type chosen for that table (e.g. TRIE_NODE_OFFSET_NULL).
+NULL_INDEX = None
+
+# Unsigned C types available for indices, narrowest first. The maximum value of
+# each type is reserved as its null sentinel.
+INDEX_TYPES = [(1, "uint8_t", "UINT8_MAX"), (2, "uint16_t", "UINT16_MAX"), (4, "uint32_t", "UINT32_MAX")]
+INDEX_TYPES_BY_SIZE = {size: (c_type, c_max) for size, c_type, c_max in INDEX_TYPES}
+
+# Bits of trie_node.flags. Must match TRIE_NODE_FLAG_* in trie.h.
+FLAG_TERMINAL = 1 << 0
+FLAG_PRESERVE_TRIGGER = 1 << 1
+FLAG_HAS_CHILDREN = 1 << 2
+FLAG_UNIQUE_COMPLETION = 1 << 3
+FLAG_VARIANTS = 1 << 4
+FLAG_COMPLETION = 1 << 5
+
+# Marks the last variant of a short code in trie_variant.flags. Must match
+# TRIE_VARIANT_FLAG_LAST in trie.h.
+VARIANT_FLAG_LAST = 1 << 7
+
+# Every text expander behavior instance is a dictionary; they share one trie in
+# which each terminal carries a bit mask of the instances that define it.
+MAX_INSTANCES = 32
+
+# Line size assumed by the lookup locality report.
+CACHE_LINE_SIZE = 32
+
+# Expanded texts are compiled into keystroke programs. A byte below 0x80 taps
+# the HID usage in its low six bits, with Shift held if KEY_SHIFT is set; the
+# other opcodes are below PHRASE_TOKEN_LEAD. Must match TRIE_OP_* and
+# TRIE_KEY_* in trie.h.
+OP_END = 0x00
+OP_UNICODE = 0x80 # Followed by the codepoint in three little-endian bytes.
+OP_OS_WINDOWS = 0x81
+OP_OS_MACOS = 0x82
+OP_OS_LINUX = 0x83
+OP_REF = 0x84     # Followed by the fragment index in two little-endian bytes.
+KEY_SHIFT = 0x40
+OS_COMMANDS = {"cmd:win": OP_OS_WINDOWS, "cmd:mac": OP_OS_MACOS, "cmd:linux": OP_OS_LINUX}
+
+# The key taps of the characters a program can type, as char_to_keycode() in
+# hid_utils.c maps them for a US layout.
+KEY_TAPS = {"\n": 0x28, "\b": 0x2A, "\t": 0x2B, " ": 0x2C}
+KEY_TAPS.update({chr(ord("a") + i): 0x04 + i for i in range(26)})
+KEY_TAPS.update({chr(ord("A") + i): KEY_SHIFT | 0x04 + i for i in range(26)})
+for usage, (plain, shifted) in zip(list(range(0x1E, 0x28)) + list(range(0x2D, 0x32)) + list(range(0x33, 0x39)),
+                                   ["1!", "2@", "3#", "4$", "5%", "6^", "7&", "8*", "9(", "0)", "-_", "=+", "[{",
+                                    "]}", "\\|", ";:", "'\"", "`~", ",<", ".>", "/?"]):
+    KEY_TAPS[plain], KEY_TAPS[shifted] = usage, KEY_SHIFT | usage
+
+# Programs are compressed with a static phrase dictionary. A use of phrase n is
+# the two bytes (PHRASE_TOKEN_LEAD | n >> 7, 0x80 | (n & 0x7F)), which no
+# opcode starts with. Must match TRIE_PHRASE_TOKEN_* in trie.h.
+PHRASE_TOKEN_LEAD = 0xF8
+PHRASE_TOKEN_LEN = 2
+MAX_PHRASES = (0x100 - PHRASE_TOKEN_LEAD) << 7
+MIN_PHRASE_LEN, MAX_PHRASE_LEN = 3, 32
+MAX_PHRASE_CANDIDATES = 4096
+PHRASE_MARKER_BASE = 0xF0000
+
+# Short codes sampled for the lookup locality reports and the streaming check.
+SHORT_CODE_SAMPLE = 4096
+
+# Labels and phrases of one length that make indexing the string pool for that
+# length cheaper than searching it for each of them.
+POOL_INDEX_MIN_STRINGS = 1024
+
+# Share of all profiled uses whose lookups make up the hot working set reported
+# for a usage profile.
+PROFILE_HOT_SHARE = 0.9
+
+# The longest short code the uint8_t cursor and label fields can represent.
+MAX_SUPPORTED_SHORT_LEN = 254
+
+# The most characters one expansion may type. Undo deletes them plus the
+# trigger key with a uint16_t count, so typed lengths are at most 2 bytes wide.
+MAX_SUPPORTED_TYPED_LEN = 0xFFFF - 1
+MAX_TYPED_SIZE = 2
+
+# External dictionary files, by extension, and the CSV columns assumed when a
+# file has no header row. Keys are the child node property names.
+DICTIONARY_FORMATS = {".csv", ".json", ".jsonl", ".yaml", ".yml"}
+DICTIONARY_ENTRY_KEYS = {"short-code", "expanded-text", "fragment-name", "preserve-trigger"}
+DICTIONARY_CSV_COLUMNS = ["short-code", "expanded-text", "preserve-trigger"]
+# Conflicting definitions listed one by one; the rest are only counted.
+MAX_REPORTED_CONFLICTS = 10
+
+# {{ref:name}} in an expanded text or fragment types the fragment `name`. The
+# generator rewrites the name to the fragment's index in
+# zmk_text_expander_fragments[], which compiles to an OP_REF.
+FRAGMENT_REF_PATTERN = re.compile(r"\{\{ref:([^{}]*)\}\}")
 
 class TrieNode:
     """Represents a node in the trie during the Python build process."""
+    __slots__ = ("children", "is_terminal", "expanded_text", "preserve_trigger", "label", "short_code", "instances",
+                 "variants")
+
     def __init__(self):
         self.children = {}
         self.is_terminal = False
         self.expanded_text = None
         self.preserve_trigger = True # This will be set properly during the build
+        self.label = "" # Characters after the branch key on a path-compressed edge
+        self.short_code = None # The short code this node completes, if terminal
+        self.instances = 0 # Bit mask of the instances that define the short code
+        self.variants = None # Per-instance definitions, if instances define it differently
 
 def parse_unicode_commands(text):
     """
@@ -49,45 +152,266 @@ def build_trie_from_expansions(expansions):
                 node.children[char] = TrieNode()
             node = node.children[char]
         node.is_terminal = True
+        node.short_code = short_code
         node.expanded_text = expansion_data['text']
         node.preserve_trigger = expansion_data['preserve_trigger']
+        node.instances = expansion_data.get('instances', 1)
+        node.variants = expansion_data.get('variants')
     return root
 
-def parse_dts_for_expansions(dts_path_str):
-    """Parses the given DTS file to find and extract text expansion definitions."""
-    expansions = {}
+def compress_trie(node):
+    """
+    Collapses chains of single-child, non-terminal nodes into one edge. The
+    branch key stays in the parent's child table; the rest of the chain becomes
+    the label of the node at the end of the edge.
+    """
+    for char, child in list(node.children.items()):
+        label = []
+        while not child.is_terminal and len(child.children) == 1:
+            (next_char, next_child), = child.children.items()
+            label.append(next_char)
+            child = next_child
+        child.label = "".join(label)
+        node.children[char] = child
+        compress_trie(child)
+
+def build_failure_links(c_trie_nodes, node_map):
+    """
+    Turns the uncompressed trie into an Aho-Corasick automaton. A node's failure
+    link is the node of the longest proper suffix of its path that is also a path
+    in the trie; its match link is the nearest terminal on that chain, itself
+    included. Returns (depth, fail index, match index) for every node.
+    """
+    root = c_trie_nodes[0]
+    links = {id(root): (0, root, None)}
+    queue = [root]
+    for py_node in queue:
+        depth, fail, _ = links[id(py_node)]
+        for char, child in sorted(py_node.children.items()):
+            child_fail = root
+            if py_node is not root:
+                state = fail
+                while state is not root and char not in state.children:
+                    state = links[id(state)][1]
+                child_fail = state.children.get(char, root)
+            match = child if child.is_terminal else links[id(child_fail)][2]
+            links[id(child)] = (depth + 1, child_fail, match)
+            queue.append(child)
+    return [(depth, node_map[id(fail)], NULL_INDEX if match is None else node_map[id(match)])
+            for depth, fail, match in (links[id(py_node)] for py_node in c_trie_nodes)]
+
+def count_terminals(node, counts):
+    """Counts the terminals in every subtree, keyed by id(node)."""
+    counts[id(node)] = int(node.is_terminal) + sum(count_terminals(child, counts) for child in node.children.values())
+    return counts[id(node)]
+
+def count_nodes(node):
+    """Counts the nodes of a trie, including the characters folded into edge labels."""
+    return 1 + len(node.label) + sum(count_nodes(child) for child in node.children.values())
+
+def parse_flag(value, where):
+    """Reads an optional boolean given as a JSON/YAML bool or a CSV cell. Returns None if unset."""
+    if value is None or isinstance(value, bool):
+        return value
+    text = str(value).strip().lower()
+    if text in ("", "default"):
+        return None
+    if text in ("true", "yes", "y", "1"):
+        return True
+    if text in ("false", "no", "n", "0"):
+        return False
+    print(f"Warning: Ignoring the preserve-trigger value '{value}' at {where}; expected true or false.", file=sys.stderr)
+    return None
+
+def read_dictionary_entries(path):
+    """
+    Yields (where, entry) for every definition in an external dictionary file.
+    An entry is a dict keyed by the child node property names: `short-code`
+    and/or `fragment-name`, `expanded-text` and optionally `preserve-trigger`.
+
+    CSV rows are `short-code,expanded-text[,preserve-trigger]`, or follow a
+    header row naming the columns; blank lines and # comments are skipped.
+    JSON and YAML files hold either a list of entries or a mapping from short
+    code to expanded text (or to an entry). CSV and JSON Lines (.jsonl) files
+    are read one row at a time, so they never have to fit in memory at once.
+    """
+    suffix = Path(path).suffix.lower()
+    if suffix not in DICTIONARY_FORMATS:
+        print(f"Error: The dictionary file '{path}' has an unknown format; "
+              f"use one of {', '.join(sorted(DICTIONARY_FORMATS))}.", file=sys.stderr)
+        sys.exit(1)
+    try:
+        with open(path, newline="", encoding="utf-8-sig") as f:
+            if suffix == ".csv":
+                reader, columns = csv.reader(f), None
+                for row in reader:
+                    if not any(cell.strip() for cell in row) or row[0].lstrip().startswith("#"):
+                        continue
+                    if columns is None:
+                        columns = DICTIONARY_CSV_COLUMNS
+                        if row[0].strip() in DICTIONARY_ENTRY_KEYS:
+                            columns = [cell.strip() for cell in row]
+                            continue
+                    yield f"{path}:{reader.line_num}", {key: cell for key, cell in zip(columns, row) if cell != ""}
+                return
+            if suffix == ".jsonl":
+                for line_number, line in enumerate(f, 1):
+                    if line.strip():
+                        yield f"{path}:{line_number}", json.loads(line)
+                return
+            if suffix == ".json":
+                document = json.load(f)
+            else:
+                try:
+                    import yaml
+                except ImportError:
+                    print(f"Error: Reading the YAML dictionary '{path}' needs the PyYAML package.", file=sys.stderr)
+                    sys.exit(1)
+                document = yaml.safe_load(f)
+    except Exception as e:
+        print(f"Error: Cannot read the dictionary file '{path}': {e}", file=sys.stderr)
+        sys.exit(1)
+
+    if isinstance(document, dict):
+        for short_code, value in document.items():
+            entry = dict(value) if isinstance(value, dict) else {"expanded-text": value}
+            yield f"{path}: '{short_code}'", dict(entry, **{"short-code": str(short_code)})
+    elif isinstance(document, list):
+        for number, entry in enumerate(document, 1):
+            yield f"{path}: entry {number}", entry
+    elif document is not None:
+        print(f"Error: The dictionary file '{path}' must hold a list or a mapping of entries.", file=sys.stderr)
+        sys.exit(1)
+
+def merge_instances(instance_expansions):
+    """
+    Merges the expansions of every instance into one table. A short code gets
+    the bit mask of the instances that define it. When instances define it
+    differently, it also gets a list of variants, one per distinct definition,
+    each with the mask of the instances that share it; the first is the one
+    reported and hashed for the short code.
+    """
+    variants_of = {}
+    for instance, expansions in enumerate(instance_expansions):
+        for short_code, data in expansions.items():
+            variants = variants_of.setdefault(short_code, [])
+            for variant in variants:
+                if variant["text"] == data["text"] and variant["preserve_trigger"] == data["preserve_trigger"]:
+                    variant["instances"] |= 1 << instance
+                    break
+            else:
+                variants.append(dict(data, instances=1 << instance))
+
+    merged = {}
+    for short_code, variants in variants_of.items():
+        merged[short_code] = dict(variants[0], instances=0)
+        for variant in variants:
+            merged[short_code]["instances"] |= variant["instances"]
+        if len(variants) > 1:
+            merged[short_code]["variants"] = variants
+    return merged
+
+def parse_dts_for_expansions(dts_path_str, config_dir=None):
+    """
+    Parses the given DTS file to find and extract text expansion definitions.
+    Every enabled text expander node is a separate dictionary (instance),
+    numbered in path order. Dictionary files listed in `dictionary-files` are
+    read first, relative to `config_dir`; child nodes come after them, so a
+    definition in the keymap overrides one from a shared file. Returns the
+    merged expansions, the named fragments they may reference, the dictionary
+    files that were read and the paths of the instances.
+    """
+    instance_expansions = []
+    instance_paths = []
+    fragments = {}
+    dictionary_files = []
+    sources = {}
+    conflicts = []
+
+    def define(kind, table, name, value, where):
+        table_sources = sources.setdefault(id(table), {})
+        if name in table and table[name] != value:
+            conflicts.append((kind, name, table_sources[name], where))
+        table[name] = value
+        table_sources[name] = where
+
+    def add_entry(expansions, entry, where, global_preserve_default):
+        if not isinstance(entry, dict) or not isinstance(entry.get("expanded-text"), str):
+            print(f"Warning: Skipping the definition at {where}, which has no expanded-text.", file=sys.stderr)
+            return False
+        if entry.get("fragment-name"):
+            define("fragment", fragments, str(entry["fragment-name"]),
+                   parse_unicode_commands(entry["expanded-text"]), where)
+
+        short_code = entry.get("short-code")
+        if not short_code:
+            if not entry.get("fragment-name"):
+                print(f"Warning: Skipping the definition at {where}, which has neither a short-code nor a fragment-name.",
+                      file=sys.stderr)
+            return bool(entry.get("fragment-name"))
+        short_code = str(short_code)
+        if ' ' in short_code:
+            print(f"Warning: The short code '{short_code}' contains a space, which is a reset character and cannot be used. Skipping this expansion.", file=sys.stderr)
+            return False
+        if not short_code.isascii():
+            print(f"Warning: The short code '{short_code}' contains non-ASCII characters, which cannot be typed as a short code. Skipping this expansion.", file=sys.stderr)
+            return False
+        if short_code != short_code.lower():
+            # Typed letters are matched in lower case, so an upper-case short code could never match.
+            print(f"Warning: The short code '{short_code}' contains upper-case letters; it is matched as '{short_code.lower()}'.", file=sys.stderr)
+            short_code = short_code.lower()
+
+        # Logic for per-expansion override
+        final_preserve_setting = parse_flag(entry.get("preserve-trigger"), where)
+        if final_preserve_setting is None:
+            final_preserve_setting = global_preserve_default
+
+        # Pre-process the text to handle {{u:XXXX}} commands
+        define("short code", expansions, short_code, {
+            "text": parse_unicode_commands(entry["expanded-text"]),
+            "preserve_trigger": final_preserve_setting
+        }, where)
+        return True
+
     try:
         dt = dtlib.DT(dts_path_str)
 
         def process_expander_node(expander_node):
+            expansions = {}
             # Determine the global default for preserving triggers
             global_preserve_default = "disable-preserve-trigger" not in expander_node.props
 
-            for child in expander_node.nodes.values():
-                if "short-code" in child.props and "expanded-text" in child.props:
-                    short_code = child.props["short-code"].to_string()
-                    if ' ' in short_code:
-                        print(f"Warning: The short code '{short_code}' contains a space, which is a reset character and cannot be used. Skipping this expansion.", file=sys.stderr)
-                        continue
-
-                    expanded_text = child.props["expanded-text"].to_string()
-
-                    # Logic for per-expansion override
-                    if "preserve-trigger" in child.props:
-                        final_preserve_setting = True
-                    elif "disable-preserve-trigger" in child.props:
-                        final_preserve_setting = False
-                    else:
-                        final_preserve_setting = global_preserve_default
+            file_entries, file_names = 0, []
+            if "dictionary-files" in expander_node.props:
+                file_names = expander_node.props["dictionary-files"].to_strings()
+                for name in file_names:
+                    path = Path(config_dir or ".", name) if not Path(name).is_absolute() else Path(name)
+                    dictionary_files.append(str(path.resolve()))
+                    for where, entry in read_dictionary_entries(path):
+                        file_entries += add_entry(expansions, entry, where, global_preserve_default)
 
-                    # --- NEW --- Pre-process the text to handle {{u:XXXX}} commands
-                    processed_text = parse_unicode_commands(expanded_text)
+            dts_entries = 0
+            for child in expander_node.nodes.values():
+                if "expanded-text" not in child.props:
+                    continue
+                entry = {"expanded-text": child.props["expanded-text"].to_string()}
+                for name in ("short-code", "fragment-name"):
+                    if name in child.props:
+                        entry[name] = child.props[name].to_string()
+                if "preserve-trigger" in child.props:
+                    entry["preserve-trigger"] = True
+                elif "disable-preserve-trigger" in child.props:
+                    entry["preserve-trigger"] = False
+                if "short-code" in entry or "fragment-name" in entry:
+                    dts_entries += add_entry(expansions, entry, f"node '{child.name}'", global_preserve_default)
 
-                    expansions[short_code] = {
-                        "text": processed_text,
-                        "preserve_trigger": final_preserve_setting
-                    }
+            if file_names:
+                print(f"Text expander dictionary {expander_node.path}: {file_entries} definitions from "
+                      f"{len(file_names)} dictionary files and {dts_entries} from the devicetree; "
+                      f"{len(conflicts)} conflicting definitions.")
+            return expansions
 
+        expander_nodes = []
         for node in dt.node_iter():
             if "compatible" not in node.props:
                 continue
@@ -99,13 +423,93 @@ def parse_dts_for_expansions(dts_path_str):
             elif compatible_prop.type == dtlib.Type.STRINGS:
                 compat_strings.extend(compatible_prop.to_strings())
 
-            if "zmk,behavior-text-expander" in compat_strings:
-                process_expander_node(node)
+            status = node.props["status"].to_string() if "status" in node.props else "okay"
+            if "zmk,behavior-text-expander" in compat_strings and status in ("okay", "ok"):
+                expander_nodes.append(node)
+
+        # The firmware finds the bit of each instance by its path, so the
+        # numbering only has to be stable, not match the devicetree instance numbers.
+        for expander_node in sorted(expander_nodes, key=lambda node: node.path):
+            instance_paths.append(expander_node.path)
+            instance_expansions.append(process_expander_node(expander_node))
 
     except Exception as e:
         print(f"Error parsing DTS file with dtlib: {e}", file=sys.stderr)
 
-    return expansions
+    for kind, name, earlier, later in conflicts[:MAX_REPORTED_CONFLICTS]:
+        print(f"Warning: The {kind} '{name}' from {later} overrides a different definition from {earlier}.",
+              file=sys.stderr)
+    if len(conflicts) > MAX_REPORTED_CONFLICTS:
+        print(f"Warning: {len(conflicts) - MAX_REPORTED_CONFLICTS} more conflicting definitions were overridden.",
+              file=sys.stderr)
+
+    if len(instance_paths) > MAX_INSTANCES:
+        print(f"Error: There are {len(instance_paths)} text expander instances; at most {MAX_INSTANCES} are supported.",
+              file=sys.stderr)
+        sys.exit(1)
+    expansions = merge_instances(instance_expansions)
+    if len(instance_paths) > 1:
+        shared = [data for data in expansions.values() if data["instances"] & (data["instances"] - 1)]
+        differing = sum("variants" in data for data in expansions.values())
+        print(f"Text expander instances: {len(instance_paths)} dictionaries share one trie of {len(expansions)} "
+              f"short codes; {len(shared)} are in more than one dictionary, {differing} of them with different texts.")
+    return expansions, fragments, dictionary_files, instance_paths
+
+def resolve_fragment_refs(expansions, fragments):
+    """
+    Rewrites every {{ref:name}} in the expanded texts and fragments to {{ref:N}},
+    numbering the fragments in the order they are first referenced. Returns the
+    rewritten expansions, the referenced fragment texts in table order and the
+    deepest chain of nested references, which sizes the engine's call stack.
+    Exits on an unknown fragment or a reference cycle.
+    """
+    numbers, order, refs_of = {}, [], {}
+
+    def rewrite(text, referrer):
+        def number_of(match):
+            name = match.group(1).strip()
+            if name not in fragments:
+                print(f"Error: {referrer} references the unknown fragment '{name}'.", file=sys.stderr)
+                sys.exit(1)
+            if name not in numbers:
+                numbers[name] = len(order)
+                order.append(name)
+            return f"{{{{ref:{numbers[name]}}}}}"
+        return FRAGMENT_REF_PATTERN.sub(number_of, text)
+
+    def resolve(short_code, data):
+        referrer = f"The expansion '{short_code}'"
+        resolved = dict(data, text=rewrite(data["text"], referrer))
+        if "variants" in data:
+            resolved["variants"] = [dict(variant, text=rewrite(variant["text"], referrer))
+                                    for variant in data["variants"]]
+        return resolved
+
+    resolved = {short_code: resolve(short_code, data) for short_code, data in expansions.items()}
+    texts = []
+    # Referenced fragments may reference more, so `order` grows while this runs.
+    for name in order:
+        texts.append(rewrite(fragments[name], f"The fragment '{name}'"))
+        refs_of[name] = [order[int(n)] for n in FRAGMENT_REF_PATTERN.findall(texts[-1])]
+
+    unused = sorted(set(fragments) - set(numbers))
+    if unused:
+        print(f"Warning: Leaving out fragments that are never referenced: {', '.join(unused)}.", file=sys.stderr)
+
+    depths, visiting = {}, []
+    def depth_of(name):
+        if name in visiting:
+            cycle = visiting[visiting.index(name):] + [name]
+            print(f"Error: The fragments {' -> '.join(cycle)} reference each other in a cycle.", file=sys.stderr)
+            sys.exit(1)
+        if name not in depths:
+            visiting.append(name)
+            depths[name] = 1 + max((depth_of(ref) for ref in refs_of[name]), default=0)
+            visiting.pop()
+        return depths[name]
+
+    max_depth = max((depth_of(name) for name in order), default=0)
+    return resolved, texts, max_depth
 
 def get_next_power_of_2(n):
     """Calculates the next power of 2 for a given number, useful for bucket sizing."""
@@ -116,6 +520,227 @@ def get_next_power_of_2(n):
         p <<= 1
     return p
 
+# Largest seed that fits in trie_hash_table.seed.
+MAX_HASH_SEED = 255
+
+def child_slot(char_code, seed, mask):
+    """Python mirror of TRIE_CHILD_SLOT() in trie.h."""
+    return ((char_code * seed) >> 5) & mask
+
+def find_perfect_hash(keys):
+    """
+    Finds the smallest power-of-two table and a seed that give every key its own
+    slot, so a lookup is always exactly one probe. Seed 32 maps each character to
+    its low bits, so a 128-slot table always succeeds for ASCII keys.
+    """
+    codes = tuple(sorted(ord(k) for k in keys))
+    if codes not in PERFECT_HASHES:
+        PERFECT_HASHES[codes] = search_perfect_hash(codes)
+    return PERFECT_HASHES[codes]
+
+# Many nodes share a child key set, so each set is searched once.
+PERFECT_HASHES = {}
+
+def search_perfect_hash(codes):
+    size = get_next_power_of_2(len(codes))
+    while True:
+        mask = size - 1
+        for seed in range(1, MAX_HASH_SEED + 1):
+            # child_slot(), inlined: this loop dominates the table build.
+            if len({((c * seed) >> 5) & mask for c in codes}) == len(codes):
+                return seed, mask
+        size <<= 1
+
+def pick_index_type(name, largest_value, min_size=1):
+    """
+    Picks the narrowest index type, at least `min_size` bytes wide, that can hold
+    `largest_value` while keeping its maximum free as the null sentinel. Exits
+    instead of letting an index wrap.
+    """
+    for size, c_type, c_max in INDEX_TYPES:
+        if size >= min_size and largest_value < (1 << (8 * size)) - 1:
+            return {"size": size, "c_type": c_type, "c_max": c_max}
+    print(f"Error: The text expander {name} needs index {largest_value}, which does not fit in 32 bits. "
+          f"Reduce the number or size of expansions.", file=sys.stderr)
+    sys.exit(1)
+
+def round_up(value, alignment):
+    return (value + alignment - 1) // alignment * alignment
+
+def c_struct_layout(fields, alignment=1):
+    """
+    Returns the field offsets and sizeof() of a C struct with naturally aligned
+    fields in declaration order. `alignment` mirrors an __aligned() attribute.
+    Layouts are cached, since the packers and checks ask for them per field.
+    """
+    key = (tuple(fields), alignment)
+    if key not in STRUCT_LAYOUTS:
+        STRUCT_LAYOUTS[key] = compute_struct_layout(fields, alignment)
+    return STRUCT_LAYOUTS[key]
+
+STRUCT_LAYOUTS = {}
+
+def compute_struct_layout(fields, alignment):
+    offsets, offset = {}, 0
+    for name, size in fields:
+        offset = round_up(offset, size)
+        offsets[name] = offset
+        offset += size
+    alignment = max([alignment] + [size for _, size in fields])
+    return offsets, round_up(offset, alignment)
+
+def pack_struct(fields, values, alignment=1):
+    """Serializes one C struct instance as little-endian bytes."""
+    key = (tuple(fields), alignment)
+    if key not in STRUCT_PACKERS:
+        offsets, size = c_struct_layout(fields, alignment)
+        layout, end = "<", 0
+        for name, field_size in fields:
+            layout += "x" * (offsets[name] - end) + STRUCT_CODES[field_size]
+            end = offsets[name] + field_size
+        STRUCT_PACKERS[key] = (struct.Struct(layout + "x" * (size - end)), [name for name, _ in fields])
+    packer, names = STRUCT_PACKERS[key]
+    return packer.pack(*[values[name] for name in names])
+
+STRUCT_CODES = {1: "B", 2: "H", 4: "I"}
+STRUCT_PACKERS = {}
+
+def field_spans(fields):
+    """Maps each field of a struct to its (offset, size), for unpack_field()."""
+    offsets, _ = c_struct_layout(fields)
+    return {name: (offsets[name], size) for name, size in fields}
+
+def unpack_field(data, offset, spans, name):
+    """Reads one field of a struct serialized by pack_struct() at `offset`."""
+    start, size = spans[name]
+    return int.from_bytes(data[offset + start:offset + start + size], "little")
+
+def null_of(size):
+    """The null sentinel of an index type of `size` bytes."""
+    return (1 << (8 * size)) - 1
+
+def node_fields(backend, string_size, slot_size, node_size=1, streaming=False, mask_size=0, typed_size=1):
+    """
+    Fields of struct trie_node in trie.h, in declaration order. Nodes only carry
+    an instance mask of `mask_size` bytes when there are several instances.
+    """
+    fields = [("expanded_text_offset", string_size), ("label_offset", string_size)]
+    if mask_size:
+        fields.append(("instance_mask", mask_size))
+    if backend == "double-array":
+        fields.append(("da_base", slot_size))
+    if streaming:
+        fields += [("fail_offset", node_size), ("match_offset", node_size), ("depth", 1)]
+    fields += [("typed_len", typed_size), ("label_len", 1), ("flags", 1)]
+    if backend == "hash":
+        fields += [("mask", 1), ("seed", 1)]
+    return fields
+
+def variant_fields(string_size, mask_size, typed_size=1):
+    """Fields of struct trie_variant in trie.h."""
+    return [("text_offset", string_size), ("instance_mask", mask_size), ("typed_len", typed_size), ("flags", 1)]
+
+def instance_mask_size(num_instances):
+    """Size of trie_instance_mask_t: the narrowest type with a bit per instance."""
+    return next(size for size, _, _ in INDEX_TYPES if num_instances <= 8 * size)
+
+def entry_fields(node_size):
+    """Fields of struct trie_hash_entry in trie.h."""
+    return [("key", 1), ("child_node_offset", node_size)]
+
+def da_slot_fields(node_size):
+    """Fields of struct trie_da_slot in trie.h."""
+    return [("check", node_size), ("child_node_offset", node_size)]
+
+def subtree_weights(node, counts, weights):
+    """Sums the profiled uses of every subtree, keyed by id(node)."""
+    weights[id(node)] = counts.get(node.short_code, 0) + sum(subtree_weights(child, counts, weights)
+                                                             for child in node.children.values())
+    return weights[id(node)]
+
+def order_nodes_depth_first(root, counts=None):
+    """
+    Lists the nodes in depth-first preorder with children sorted by character, so
+    a node's first child directly follows it and a lookup path stays close together.
+    With usage `counts`, the most used child comes first instead, so the hottest
+    paths are laid out contiguously.
+    """
+    weights = {}
+    if counts:
+        subtree_weights(root, counts, weights)
+    nodes, stack = [], [root]
+    while stack:
+        py_node = stack.pop()
+        nodes.append(py_node)
+        stack.extend(child for _, child in sorted(py_node.children.items(), reverse=True,
+                                                  key=lambda item: (-weights.get(id(item[1]), 0), item[0])))
+    return nodes
+
+def order_nodes_breadth_first(root):
+    """Lists the nodes level by level, the order of the earlier split-array layout."""
+    nodes, head = [root], 0
+    while head < len(nodes):
+        nodes.extend(child for _, child in sorted(nodes[head].children.items()))
+        head += 1
+    return nodes
+
+def build_child_tables(c_trie_nodes, node_map):
+    """
+    Builds the inline child table of every node with children. The root has the
+    highest fanout, so it gets a dense table indexed directly by character; every
+    other node gets a perfect-hash table.
+    """
+    root = c_trie_nodes[0]
+    root_first_char = min(ord(c) for c in root.children) if root.children else 0
+    tables = []
+    for py_node in c_trie_nodes:
+        if not py_node.children:
+            tables.append(None)
+            continue
+        if py_node is root:
+            seed, slot_of = 0, lambda code: code - root_first_char
+            mask = max(ord(c) for c in root.children) - root_first_char
+        else:
+            seed, mask = find_perfect_hash(py_node.children.keys())
+            slot_of = lambda code, seed=seed, mask=mask: child_slot(code, seed, mask)
+        slots = [("\0", NULL_INDEX)] * (mask + 1)
+        for char, child_py_node in sorted(py_node.children.items()):
+            slots[slot_of(ord(char))] = (char, node_map[id(child_py_node)])
+        tables.append({"seed": seed, "mask": mask, "slots": slots})
+    return {"root_first_char": root_first_char, "tables": tables}
+
+def chained_buckets(py_node):
+    """
+    The child chains of `py_node` in the old chained-hash layout: buckets by
+    character code modulo the next power of two, each chain newest first.
+    """
+    num_buckets = get_next_power_of_2(len(py_node.children)) if len(py_node.children) > 1 else 1
+    chains = {}
+    for char in sorted(py_node.children):
+        chains.setdefault(ord(char) % num_buckets, []).insert(0, char)
+    return num_buckets, chains
+
+def report_lookup_cost(nodes, node_map, root_table_size):
+    """Prints the per-transition probe counts of the emitted layout next to the old chained layout."""
+    transitions, chained_probes, chained_worst, perfect_probes = 0, 0, 0, 0
+    for py_node in nodes:
+        if not py_node.children:
+            continue
+        _, chains = chained_buckets(py_node)
+        for chain in chains.values():
+            for position in range(1, len(chain) + 1):
+                chained_probes += position
+                chained_worst = max(chained_worst, position)
+        transitions += len(py_node.children)
+        perfect_probes += len(py_node.children)
+
+    if transitions == 0:
+        return
+    print(f"Text expander trie: {len(nodes)} nodes, {transitions} transitions, "
+          f"root table {root_table_size} slots. Average probes per transition: "
+          f"{perfect_probes / transitions:.2f} (chained layout: {chained_probes / transitions:.2f}, "
+          f"worst {chained_worst}).")
+
 def escape_for_c_string(text):
     """
     Properly escape a Python string for use as a C string literal,
@@ -125,7 +750,7 @@ def escape_for_c_string(text):
     if text is None:
         return ""
     # Encode the entire Python Unicode string into a sequence of UTF-8 bytes.
-    utf8_bytes = text.encode('utf-8')
+    utf8_bytes = text.encode('utf-8') if isinstance(text, str) else text
 
     result = []
     for byte in utf8_bytes:
@@ -150,115 +775,1136 @@ def escape_for_c_string(text):
 
     return "".join(result)
 
-def generate_static_trie_c_code(expansions):
-    """Generates the C source file content for the static trie and hash tables."""
-    if not expansions:
-        return """
+def split_text_spans(text, raw_prefix_len):
+    """
+    Splits an expanded text into (compressible, text) spans, separating
+    {{...}} commands and {{{...}}} literals from the plain text. Those, and the
+    completion prefix a completion skips, are never phrase-compressed.
+    """
+    spans, plain, i = [], [], raw_prefix_len
+    if raw_prefix_len:
+        spans.append((False, text[:raw_prefix_len]))
+    while i < len(text):
+        # Plain text up to the next "{{" is copied in one step.
+        start = text.find("{{", i)
+        if start < 0:
+            start = len(text)
+        if start > i:
+            plain.append(text[i:start])
+            i = start
+            continue
+        end = -1
+        if text.startswith("{{{", i):
+            end = text.find("}}}", i + 3)
+            end = end + 3 if end >= 0 else -1
+        if end < 0:
+            end = text.find("}}", i + 2)
+            end = end + 2 if end >= 0 else -1
+        if end < 0:
+            plain.append(text[i])
+            i += 1
+            continue
+        if plain:
+            spans.append((True, "".join(plain)))
+            plain = []
+        spans.append((False, text[i:end]))
+        i = end
+    if plain:
+        spans.append((True, "".join(plain)))
+    return spans
+
+def parse_span(span):
+    """
+    Returns the characters a span from split_text_spans() types and the command
+    it runs; one of them is None. A {{{literal}}} types its contents as they are.
+    """
+    if len(span) >= 6 and span.startswith("{{{") and span.endswith("}}}"):
+        return span[3:-3], None
+    if span.startswith("{{") and span.endswith("}}"):
+        return None, span[2:-2]
+    return span, None
+
+def compile_chars(chars):
+    """
+    Compiles characters into key taps. Characters outside ASCII are typed by
+    codepoint; ASCII characters without a key are left out.
+    """
+    program = bytearray()
+    for char in chars:
+        if char in KEY_TAPS:
+            program.append(KEY_TAPS[char])
+        elif ord(char) >= 0x80:
+            program.append(OP_UNICODE)
+            program += ord(char).to_bytes(3, "little")
+    return bytes(program)
+
+def compile_span(span):
+    """Compiles a span that is not phrase-compressed. Unknown commands are left out."""
+    chars, command = parse_span(span)
+    if command is None:
+        return compile_chars(chars)
+    if command in OS_COMMANDS:
+        return bytes([OS_COMMANDS[command]])
+    ref = FRAGMENT_REF_PATTERN.fullmatch(span)
+    if ref and ref.group(1).isdigit():
+        return bytes([OP_REF]) + int(ref.group(1)).to_bytes(2, "little")
+    return b""
+
+def report_untypeable(texts):
+    """Warns about the commands and characters in the split `texts` that compile to nothing."""
+    commands, chars = set(), set()
+    for spans in texts:
+        for compressible, span in spans:
+            text, command = (span, None) if compressible else parse_span(span)
+            if command is not None and not compile_span(span):
+                commands.add(span)
+            chars.update(char for char in text or "" if char not in KEY_TAPS and ord(char) < 0x80)
+    if commands or chars:
+        left_out = sorted(commands) + [repr(char) for char in sorted(chars)]
+        print(f"Warning: Leaving out what the expander cannot type: {', '.join(left_out)}.", file=sys.stderr)
+
+def is_completion(short_code, text):
+    """
+    True if `text` starts with its short code, which a completion does not
+    retype. Every short code character is then a one-byte tap at the start of
+    the program, so typing resumes that many bytes in.
+    """
+    return text.startswith(short_code) and all(len(compile_chars(char)) == 1 for char in short_code)
+
+def typed_lengths(texts, fragment_texts):
+    """
+    Counts the characters typing each of `texts` leaves behind, which undo
+    deletes: one per character typed, less one per backspace, with referenced
+    fragments counted in full. Returns them by text.
+    """
+    fragment_lengths = {}
+    def length_of(text):
+        length = 0
+        for compressible, span in split_text_spans(text, 0):
+            chars, command = (span, None) if compressible else parse_span(span)
+            ref = FRAGMENT_REF_PATTERN.fullmatch(span) if command is not None else None
+            if ref and ref.group(1).isdigit():
+                length += fragment_length(int(ref.group(1)))
+            elif chars:
+                typed = [char for char in chars if char in KEY_TAPS or ord(char) >= 0x80]
+                length = max(0, length + len(typed) - 2 * typed.count("\b"))
+        return length
+    # resolve_fragment_refs() rejects cycles, so this recursion ends.
+    def fragment_length(number):
+        if number not in fragment_lengths:
+            fragment_lengths[number] = length_of(fragment_texts[number])
+        return fragment_lengths[number]
+    return {text: length_of(text) for text in texts}
+
+def phrase_token(number):
+    """The two pool bytes that stand for phrase `number`. Mirrors trie_get_phrase() in trie.c."""
+    return bytes([PHRASE_TOKEN_LEAD | (number >> 7), 0x80 | (number & 0x7F)])
+
+def compress_texts(texts, phrase_entry_size):
+    """
+    Compiles expanded texts into keystroke programs, compressed with a static
+    phrase dictionary. Phrases are picked greedily by the bytes they save; each
+    use becomes a two-byte token. `texts` is a list of span lists from
+    split_text_spans(). Returns the programs (without OP_END) and the compiled
+    phrases.
+    """
+    pieces = [span for spans in texts for compressible, span in spans if compressible]
+    # Markers in a private use plane stand for chosen phrases while searching.
+    if any(max(piece) >= chr(PHRASE_MARKER_BASE) for piece in pieces):
+        pieces = []
+
+    # Candidates start at word boundaries, which keeps counting fast on long texts.
+    # Repeated pieces are counted once, weighted by how often they occur.
+    piece_uses, counts = {}, {}
+    for piece in pieces:
+        piece_uses[piece] = piece_uses.get(piece, 0) + 1
+    for piece, uses in piece_uses.items():
+        for start in range(len(piece)):
+            if start > 0 and piece[start - 1].isalnum():
+                continue
+            for end in range(start + MIN_PHRASE_LEN, min(len(piece), start + MAX_PHRASE_LEN) + 1):
+                counts[piece[start:end]] = counts.get(piece[start:end], 0) + uses
+
+    def gain(phrase, uses):
+        size = len(compile_chars(phrase))
+        return uses * (size - PHRASE_TOKEN_LEN) - size - phrase_entry_size
+
+    candidates = sorted((phrase for phrase, uses in counts.items() if uses > 1 and gain(phrase, uses) > 0),
+                        key=lambda phrase: (-gain(phrase, counts[phrase]), phrase))[:MAX_PHRASE_CANDIDATES]
+
+    # Counting against one joined string keeps the search in C; NUL separates the pieces.
+    joined, phrases = "\0".join(pieces), []
+    for phrase in candidates:
+        if len(phrases) == MAX_PHRASES:
+            break
+        if gain(phrase, joined.count(phrase)) > 0:
+            joined = joined.replace(phrase, chr(PHRASE_MARKER_BASE + len(phrases)))
+            phrases.append(phrase)
+    compressed_pieces = iter(joined.split("\0") if pieces else [])
+
+    def encode(piece):
+        return b"".join(phrase_token(ord(c) - PHRASE_MARKER_BASE) if ord(c) >= PHRASE_MARKER_BASE
+                        else compile_chars(c) for c in piece)
+
+    encoded = [b"".join(encode(next(compressed_pieces)) if compressible else compile_span(span)
+                        for compressible, span in spans) for spans in texts]
+    return encoded, [compile_chars(phrase) for phrase in phrases]
+
+def build_string_pool(texts, labels, phrases, weights=None):
+    """
+    Lays out the string pool. Identical texts share one copy, a text that is the
+    tail of another points into it, and labels and phrases reuse any matching
+    bytes already in the pool. With usage `weights` per text, the most used
+    texts are placed first. Returns the pool, the offsets of the texts, labels
+    and phrases, and the bytes saved by each step.
+    """
+    unique = sorted(set(texts), key=lambda text: text[::-1], reverse=True)
+    pool, text_offsets, saved = bytearray(), {}, {"dedupe": 0, "tail": 0, "reuse": 0}
+    hosts, host_weights, tails = [], {}, []
+    for text in unique:
+        # Reversed, a tail is a prefix, so it sorts right after the longer text.
+        if hosts and hosts[-1].endswith(text):
+            tails.append((text, hosts[-1]))
+            saved["tail"] += len(text)
+        else:
+            hosts.append(text)
+        host = hosts[-1]
+        host_weights[host] = host_weights.get(host, 0) + (weights or {}).get(text, 0)
+    if weights:
+        hosts.sort(key=lambda host: -host_weights[host])
+    for host in hosts:
+        text_offsets[host] = len(pool)
+        pool += host
+    for text, host in tails:
+        text_offsets[text] = text_offsets[host] + len(host) - len(text)
+    saved["dedupe"] = sum(len(text) for text in texts) - sum(len(text) for text in unique)
+
+    # Raw strings go longest first. When many share a length, an index of the
+    # first offset of every pool substring of that length replaces a scan of
+    # the whole pool per string; it is extended as strings are appended.
+    raws = sorted(set(labels) | set(phrases), key=lambda raw: (-len(raw), raw))
+    raws_of_len = {}
+    for raw in raws:
+        raws_of_len[len(raw)] = raws_of_len.get(len(raw), 0) + 1
+    raw_offsets, index, index_len = {}, None, 0
+    for raw in raws:
+        if len(raw) != index_len:
+            index, index_len = None, len(raw)
+            if raws_of_len[index_len] >= POOL_INDEX_MIN_STRINGS:
+                data = bytes(pool)
+                index = {data[k:k + index_len]: k for k in range(len(data) - index_len, -1, -1)}
+        offset = pool.find(raw) if index is None else index.get(raw, -1)
+        if offset < 0:
+            offset = len(pool)
+            pool += raw
+            if index is not None:
+                start = max(0, offset - index_len + 1)
+                tail = bytes(pool[start:])
+                for k in range(len(tail) - index_len + 1):
+                    index.setdefault(tail[k:k + index_len], start + k)
+        else:
+            saved["reuse"] += len(raw)
+        raw_offsets[raw] = offset
+    return bytes(pool), text_offsets, raw_offsets, saved
+
+def build_double_array(c_trie_nodes, node_map):
+    """
+    Builds a double-array (BASE/CHECK) transition table. The child of node n for
+    character c lives in slot base[n] + (c - first_char) when that slot's check
+    equals n, so every transition is exactly two array reads.
+    """
+    codes = {ord(c) for py_node in c_trie_nodes for c in py_node.children}
+    first_char = min(codes) if codes else 0
+    alphabet_size = (max(codes) - first_char + 1) if codes else 0
+
+    base = [0] * len(c_trie_nodes)
+    slots = []  # [check, child_node_index]
+    used = bytearray()  # 1 for every slot in use; bytearray.find() skips runs of them in C.
+    first_free = 0
+    for node_index, py_node in enumerate(c_trie_nodes):
+        if not py_node.children:
+            continue
+        child_codes = sorted(ord(c) - first_char for c in py_node.children)
+        # First-fit placement, starting at the lowest slot that could still be
+        # free. Only candidates whose first child lands on a free slot are tried.
+        free = max(first_free, child_codes[0])
+        while True:
+            found = used.find(0, free)
+            free = found if found >= 0 else max(free, len(used))
+            candidate = free - child_codes[0]
+            if all(candidate + code >= len(used) or not used[candidate + code] for code in child_codes[1:]):
+                break
+            free += 1
+        base[node_index] = candidate
+        needed = candidate + child_codes[-1] + 1
+        if needed > len(slots):
+            slots.extend([[NULL_INDEX, NULL_INDEX] for _ in range(needed - len(slots))])
+            used.extend(bytes(needed - len(used)))
+        for char, child_py_node in py_node.children.items():
+            slots[candidate + ord(char) - first_char] = [node_index, node_map[id(child_py_node)]]
+            used[candidate + ord(char) - first_char] = 1
+        first_free = used.find(0, first_free)
+        first_free = first_free if first_free >= 0 else len(used)
+
+    return {"first_char": first_char, "alphabet_size": alphabet_size, "base": base, "slots": slots}
+
+def pack_trie(c_trie_nodes, node_records, child_tables, da_layout, backend, string_size, slot_size, streaming=False,
+              min_node_size=1, mask_size=0, typed_size=1):
+    """
+    Serializes the nodes, in order, into one byte array. A hash-backend node is
+    followed by its inline child table; double-array nodes carry their base and
+    share the separate slot array. With `streaming`, every node also carries its
+    failure and match links; with a `mask_size`, its instance mask. Typed
+    lengths take `typed_size` bytes. Node offsets count in units of the node
+    alignment, which keeps them narrow; picks the narrowest node offset type, at
+    least `min_node_size` bytes wide, that can address the result and returns
+    the packed layout.
+    """
+    for node_size, _, _ in [index_type for index_type in INDEX_TYPES if index_type[0] >= min_node_size]:
+        fields = node_fields(backend, string_size, slot_size, node_size, streaming, mask_size, typed_size)
+        alignment = max([size for _, size in fields] + ([node_size] if backend == "hash" else []))
+        _, header_size = c_struct_layout(fields, alignment)
+        _, entry_size = c_struct_layout(entry_fields(node_size))
+
+        offsets, offset = [], 0
+        for node_index in range(len(c_trie_nodes)):
+            offsets.append(offset // alignment)
+            offset += header_size
+            if backend == "hash" and child_tables["tables"][node_index]:
+                offset += len(child_tables["tables"][node_index]["slots"]) * entry_size
+            offset = round_up(offset, alignment)
+        if offset // alignment < null_of(node_size):
+            break
+    else:
+        pick_index_type("trie size", offset // alignment, min_node_size)
+
+    null_node = null_of(node_size)
+    data = bytearray()
+    for node_index, record in enumerate(node_records):
+        values = dict(record)
+        table = child_tables["tables"][node_index]
+        if streaming:
+            values["fail_offset"] = offsets[record["fail_index"]]
+            values["match_offset"] = null_node if record["match_index"] is NULL_INDEX else offsets[record["match_index"]]
+        if backend == "double-array":
+            values["da_base"] = da_layout["base"][node_index]
+        else:
+            values["mask"] = table["mask"] if table else 0
+            values["seed"] = table["seed"] if table else 0
+        data += pack_struct(fields, values, alignment)
+        if backend == "hash" and table:
+            for key, child_index in table["slots"]:
+                child_offset = null_node if child_index is NULL_INDEX else offsets[child_index]
+                data += pack_struct(entry_fields(node_size), {"key": ord(key), "child_node_offset": child_offset})
+        data += bytes(round_up(len(data), alignment) - len(data))
+
+    da_slots = []
+    if backend == "double-array":
+        for check, child_index in da_layout["slots"]:
+            da_slots.append((null_node if check is NULL_INDEX else offsets[check],
+                             null_node if child_index is NULL_INDEX else offsets[child_index]))
+
+    return {"backend": backend, "data": bytes(data), "offsets": offsets, "fields": fields,
+            "node_size": node_size, "string_size": string_size, "slot_size": slot_size, "typed_size": typed_size,
+            "alignment": alignment, "header_size": header_size, "entry_size": entry_size, "streaming": streaming,
+            "node_spans": field_spans(fields), "entry_spans": field_spans(entry_fields(node_size)),
+            "root_first_char": child_tables["root_first_char"], "da_first_char": da_layout["first_char"],
+            "da_alphabet_size": da_layout["alphabet_size"], "da_slots": da_slots,
+            "index_of": {offset: node_index for node_index, offset in enumerate(offsets)}}
+
+def packed_child_offset(packed, node_offset, char, touches):
+    """
+    Python mirror of get_child_offset() in trie.c, reading the packed bytes.
+    Appends every (region, offset, size) it reads to `touches`.
+    """
+    data, fields, null_node = packed["data"], packed["node_spans"], null_of(packed["node_size"])
+    node_byte = node_offset * packed["alignment"]
+    touches.append(("trie", node_byte, packed["header_size"]))
+    if not unpack_field(data, node_byte, fields, "flags") & FLAG_HAS_CHILDREN:
+        return null_node
+
+    if packed["backend"] == "double-array":
+        code = (ord(char) - packed["da_first_char"]) & 0xFF
+        if code >= packed["da_alphabet_size"]:
+            return null_node
+        slot = unpack_field(data, node_byte, fields, "da_base") + code
+        if slot >= len(packed["da_slots"]):
+            return null_node
+        _, slot_size = c_struct_layout(da_slot_fields(packed["node_size"]))
+        touches.append(("slots", slot * slot_size, slot_size))
+        check, child_offset = packed["da_slots"][slot]
+        return child_offset if check == node_offset else null_node
+
+    mask = unpack_field(data, node_byte, fields, "mask")
+    if node_offset == 0:
+        slot = (ord(char) - packed["root_first_char"]) & 0xFF
+        if slot > mask:
+            return null_node
+    else:
+        slot = child_slot(ord(char), unpack_field(data, node_byte, fields, "seed"), mask)
+    entry_offset = node_byte + packed["header_size"] + slot * packed["entry_size"]
+    touches.append(("trie", entry_offset, packed["entry_size"]))
+    entry = packed["entry_spans"]
+    if unpack_field(data, entry_offset, entry, "key") != ord(char):
+        return null_node
+    return unpack_field(data, entry_offset, entry, "child_node_offset")
+
+def packed_search(packed, c_trie_nodes, key, touches=None):
+    """Walks the packed trie like trie_search() and returns the terminal node index or None."""
+    touches = [] if touches is None else touches
+    index_of = packed["index_of"]
+    node_offset, i = 0, 0
+    while i < len(key):
+        node_offset = packed_child_offset(packed, node_offset, key[i], touches)
+        if node_offset not in index_of:
+            return None
+        label = c_trie_nodes[index_of[node_offset]].label
+        if key[i + 1:i + 1 + len(label)] != label:
+            return None
+        i += 1 + len(label)
+    node_index = index_of[node_offset]
+    return node_index if c_trie_nodes[node_index].is_terminal else None
+
+def verify_packed_trie(c_trie_nodes, node_map, packed):
+    """
+    Checks that the packed tables follow every transition to the right node,
+    reject a near miss at every node and flag the same terminals as the trie.
+    Checking each node once keeps this linear in the trie size. Exits on any
+    mismatch.
+    """
+    alphabet = sorted({c for py_node in c_trie_nodes for c in py_node.children})
+    offsets, fields = packed["offsets"], packed["node_spans"]
+    null_node = null_of(packed["node_size"])
+    for node_index, py_node in enumerate(c_trie_nodes):
+        node_byte = offsets[node_index] * packed["alignment"]
+        if bool(unpack_field(packed["data"], node_byte, fields, "flags") & FLAG_TERMINAL) != py_node.is_terminal:
+            print(f"Error: The packed {packed['backend']} trie disagrees with the trie on node {node_index}.",
+                  file=sys.stderr)
+            sys.exit(1)
+        expected = {char: offsets[node_map[id(child)]] for char, child in py_node.children.items()}
+        misses = [c for c in alphabet[:len(py_node.children) + 1] if c not in py_node.children][:1]
+        expected.update((c, null_node) for c in misses)
+        for char, child_offset in expected.items():
+            if packed_child_offset(packed, offsets[node_index], char, []) != child_offset:
+                print(f"Error: The packed {packed['backend']} trie disagrees with the trie on '{char}' "
+                      f"after node {node_index}.", file=sys.stderr)
+                sys.exit(1)
+
+def backend_probes(short_codes, alphabet):
+    """
+    Keys the backends are compared on: each of `short_codes`, its proper
+    prefixes, and near misses that extend it or change its last character to
+    one of the first characters of `alphabet`.
+    """
+    probes = set()
+    for short_code in short_codes:
+        probes.update(short_code[:end] for end in range(1, len(short_code) + 1))
+        for c in alphabet[:4]:
+            probes.add(short_code + c)
+            probes.add(short_code[:-1] + c)
+    return sorted(probes)
+
+def verify_backends(expansions, c_trie_nodes, packed, other_packed):
+    """
+    Checks that the emitted backend and the other one resolve sampled short
+    codes, their prefixes and near misses to the same node, so a bug in either
+    backend shows even when it is not the one selected. Exits on any mismatch.
+    """
+    alphabet = sorted({c for short_code in expansions for c in short_code})
+    for key in backend_probes(sample_short_codes(expansions), alphabet):
+        result = packed_search(packed, c_trie_nodes, key)
+        other_result = packed_search(other_packed, c_trie_nodes, key)
+        if result != other_result or (result is not None) != (key in expansions):
+            print(f"Error: trie backends disagree on '{key}' ({packed['backend']}: {result}, "
+                  f"{other_packed['backend']}: {other_result}, expected match: {key in expansions}).", file=sys.stderr)
+            sys.exit(1)
+
+def packed_stream_match(packed, c_trie_nodes, stream):
+    """
+    Python mirror of trie_stream_advance() and trie_stream_match() in trie.c.
+    Feeds `stream` through the packed automaton and returns the index of the
+    terminal node it ends on, or None.
+    """
+    fields, index_of, state = packed["node_spans"], packed["index_of"], 0
+    for char in stream:
+        while True:
+            child = packed_child_offset(packed, state, char, [])
+            if child in index_of or state == 0:
+                state = child if child in index_of else 0
+                break
+            state = unpack_field(packed["data"], state * packed["alignment"], fields, "fail_offset")
+    match = unpack_field(packed["data"], state * packed["alignment"], fields, "match_offset")
+    return index_of.get(match)
+
+def verify_streaming(expansions, c_trie_nodes, packed):
+    """
+    Checks that the streaming automaton finds the longest short code ending a
+    stream when sampled codes are typed after the start of other codes. Exits
+    on any mismatch.
+    """
+    short_codes = sample_short_codes(expansions)
+    for i, short_code in enumerate(short_codes):
+        for other in short_codes[i - 2:i + 1]:
+            stream = other[:len(other) // 2 + 1] + short_code
+            expected = max((stream[k:] for k in range(len(stream)) if stream[k:] in expansions), key=len)
+            found = packed_stream_match(packed, c_trie_nodes, stream)
+            if found is None or c_trie_nodes[found].short_code != expected:
+                print(f"Error: streaming match of '{stream}' found "
+                      f"{c_trie_nodes[found].short_code if found is not None else None}, expected '{expected}'.",
+                      file=sys.stderr)
+                sys.exit(1)
+
+def cache_lines(touches):
+    """Counts the distinct cache lines covered by a list of (region, offset, size) reads."""
+    return len({(region, line) for region, offset, size in touches
+                for line in range(offset // CACHE_LINE_SIZE, (offset + size - 1) // CACHE_LINE_SIZE + 1)})
+
+def sample_short_codes(expansions):
+    """
+    An evenly spread, deterministic sample of at most SHORT_CODE_SAMPLE short
+    codes, so per-code reports and checks stay cheap on large dictionaries.
+    """
+    short_codes = sorted(expansions)
+    return short_codes[::-(-len(short_codes) // SHORT_CODE_SAMPLE)]
+
+def split_layout_cost(expansions, c_trie_nodes, node_map, child_tables, da_layout, backend, string_size, slot_size):
+    """
+    Estimates the table bytes and cache lines per lookup of the earlier layout:
+    breadth-first node order with nodes, hash tables, hash entries, the root
+    table and the double-array base in separate arrays.
+    """
+    bfs_index = {id(py_node): i for i, py_node in enumerate(order_nodes_breadth_first(c_trie_nodes[0]))}
+    tables = child_tables["tables"]
+    table_nodes = sorted((i for i in range(1, len(c_trie_nodes)) if tables[i]), key=lambda i: bfs_index[id(c_trie_nodes[i])])
+    table_index = {node_index: t for t, node_index in enumerate(table_nodes)}
+    entry_start, num_entries = {}, 0
+    for node_index in table_nodes:
+        entry_start[node_index] = num_entries
+        num_entries += len(tables[node_index]["slots"])
+
+    node = pick_index_type("node count", len(c_trie_nodes))["size"]
+    table = pick_index_type("hash table count", len(table_nodes))["size"]
+    entry = pick_index_type("hash entry count", num_entries)["size"]
+    _, node_bytes = c_struct_layout([("e", string_size), ("l", string_size), ("t", table), ("n", 1), ("a", 1), ("b", 1)])
+    _, table_bytes = c_struct_layout([("s", entry), ("m", 1), ("d", 1)])
+    _, entry_bytes = c_struct_layout(entry_fields(node))
+    _, da_slot_bytes = c_struct_layout(da_slot_fields(node))
+    root_slots = len(tables[0]["slots"])
+
+    if backend == "double-array":
+        total = len(c_trie_nodes) * (node_bytes + slot_size) + len(da_layout["slots"]) * da_slot_bytes
+    else:
+        total = len(c_trie_nodes) * node_bytes + len(table_nodes) * table_bytes + num_entries * entry_bytes + root_slots * node
+
+    lines, sample = 0, sample_short_codes(expansions)
+    for short_code in sample:
+        touches, node_index, i = [], 0, 0
+        while i < len(short_code):
+            char = short_code[i]
+            if backend == "double-array":
+                slot = da_layout["base"][node_index] + ord(char) - da_layout["first_char"]
+                touches.append(("base", bfs_index[id(c_trie_nodes[node_index])] * slot_size, slot_size))
+                touches.append(("slots", slot * da_slot_bytes, da_slot_bytes))
+            elif node_index == 0:
+                touches.append(("root", (ord(char) - child_tables["root_first_char"]) * node, node))
+            else:
+                t = tables[node_index]
+                touches.append(("tables", table_index[node_index] * table_bytes, table_bytes))
+                slot = entry_start[node_index] + child_slot(ord(char), t["seed"], t["mask"])
+                touches.append(("entries", slot * entry_bytes, entry_bytes))
+            node_index = node_map[id(c_trie_nodes[node_index].children[char])]
+            touches.append(("nodes", bfs_index[id(c_trie_nodes[node_index])] * node_bytes, node_bytes))
+            i += 1 + len(c_trie_nodes[node_index].label)
+        lines += cache_lines(touches)
+    return total, lines / len(sample)
+
+def report_layout(expansions, c_trie_nodes, packed, split_bytes, split_lines):
+    """Prints the packed table size and lookup locality next to the earlier split-array layout."""
+    lines, sample = 0, sample_short_codes(expansions)
+    for short_code in sample:
+        touches = []
+        packed_search(packed, c_trie_nodes, short_code, touches)
+        lines += cache_lines(touches)
+    _, da_slot_bytes = c_struct_layout(da_slot_fields(packed["node_size"]))
+    packed_bytes = len(packed["data"]) + len(packed["da_slots"]) * da_slot_bytes
+    print(f"Text expander trie: packed {packed['backend']} layout takes {packed_bytes} bytes "
+          f"(split arrays: {split_bytes}); a lookup touches {lines / len(sample):.2f} "
+          f"{CACHE_LINE_SIZE}-byte lines on average (split arrays: {split_lines:.2f}).")
+
+def report_string_pool(texts, labels, encoded_texts, phrases, string_pool, savings):
+    """
+    Prints the string pool size before and after compiling the texts to
+    keystroke programs with phrases, deduplication and tail merging.
+    """
+    raw_texts = sum(len(text.encode("utf-8")) + 1 for text in texts)
+    raw_bytes = raw_texts + sum(len(label) for label in labels)
+    compile_savings = raw_texts - sum(len(text) for text in encoded_texts) - sum(len(phrase) for phrase in phrases)
+    print(f"Text expander string pool: {raw_bytes} bytes stored in {len(string_pool)} "
+          f"({raw_bytes / max(len(string_pool), 1):.2f}:1). Compiling with {len(phrases)} phrases saved "
+          f"{compile_savings} bytes, deduplication {savings['dedupe']}, tail merging {savings['tail']}, "
+          f"reused labels and phrases {savings['reuse']}.")
+
+def report_fragments(terminals, fragment_texts):
+    """Prints how many bytes storing fragments once saves over typing them out in every text."""
+    inlined = {}
+    def inlined_len(text):
+        length = len(FRAGMENT_REF_PATTERN.sub("", text).encode("utf-8"))
+        return length + sum(inlined_len_of(int(n)) for n in FRAGMENT_REF_PATTERN.findall(text))
+    def inlined_len_of(number):
+        if number not in inlined:
+            inlined[number] = inlined_len(fragment_texts[number])
+        return inlined[number]
+
+    texts = [py_node.expanded_text for py_node in terminals] + fragment_texts
+    uses = sum(len(FRAGMENT_REF_PATTERN.findall(text)) for text in texts)
+    stored = sum(len(text.encode("utf-8")) + 1 for text in texts)
+    expanded = sum(inlined_len(py_node.expanded_text) + 1 for py_node in terminals)
+    print(f"Text expander fragments: {len(fragment_texts)} fragments referenced {uses} times; "
+          f"texts take {stored} bytes before compression ({expanded} with fragments inlined).")
+
+def report_path_compression(uncompressed_nodes, nodes, label_bytes, packed_bytes, folded_node_bytes):
+    """Prints the node count and table size with and without path compression."""
+    # Every folded character was a node with a one-slot child table of its own.
+    uncompressed_bytes = packed_bytes + (uncompressed_nodes - len(nodes)) * folded_node_bytes - label_bytes
+    print(f"Text expander trie: path compression folded {uncompressed_nodes} nodes into {len(nodes)} "
+          f"({label_bytes} label bytes); tables take {packed_bytes} bytes ({uncompressed_bytes} without compression).")
+
+def lay_out_trie(root, expansions, encoded_text_of, encoded_fragments, labels, phrases, backend, streaming, profile=None,
+                 min_index_size=1, encoded_variants_of=None, mask_size=0, typed_len_of=None):
+    """
+    Orders the nodes, lays out the string pool and packs the nodes for
+    `backend`. With a usage `profile`, the hottest paths and texts come first.
+    No index type is narrower than `min_index_size` bytes. With several
+    instances, terminals carry a `mask_size`-byte instance mask, and a short
+    code the instances define differently points at its run of variants, whose
+    texts are in `encoded_variants_of`. Terminals carry the typed length of
+    their texts from `typed_len_of`. Returns the layout.
+    """
+    typed_len_of = typed_len_of or {}
+    encoded_variants_of = encoded_variants_of or {}
+    c_trie_nodes = order_nodes_depth_first(root, profile)
+    node_map = {id(py_node): node_index for node_index, py_node in enumerate(c_trie_nodes)}
+    terminals = [py_node for py_node in c_trie_nodes if py_node.is_terminal]
+
+    text_weights = None
+    if profile:
+        text_weights = {}
+        for py_node in terminals:
+            uses = profile.get(py_node.short_code, 0)
+            text_weights[encoded_text_of[py_node.short_code]] = text_weights.get(encoded_text_of[py_node.short_code], 0) + uses
+            for text in encoded_variants_of.get(py_node.short_code, [])[1:]:
+                text_weights[text] = text_weights.get(text, 0) + uses
+            for number in FRAGMENT_REF_PATTERN.findall(py_node.expanded_text):
+                fragment = encoded_fragments[int(number)]
+                text_weights[fragment] = text_weights.get(fragment, 0) + uses
+    texts = [encoded_text_of[py_node.short_code] for py_node in terminals]
+    texts += [text for py_node in terminals for text in encoded_variants_of.get(py_node.short_code, [])[1:]]
+    texts += encoded_fragments
+    string_pool, text_offsets, raw_offsets, pool_savings = build_string_pool(texts, labels, phrases, text_weights)
+
+    terminal_counts = {}
+    count_terminals(root, terminal_counts)
+    node_records, variant_records = [], []
+    for py_node in c_trie_nodes:
+        expanded_text_offset = NULL_INDEX
+        flags = FLAG_HAS_CHILDREN if py_node.children else 0
+        if py_node.variants:
+            # The node's variants are consecutive; its text offset indexes the first.
+            expanded_text_offset = len(variant_records)
+            flags |= FLAG_VARIANTS
+            for variant, text in zip(py_node.variants, encoded_variants_of[py_node.short_code]):
+                variant_records.append({"text_offset": text_offsets[text], "instance_mask": variant["instances"],
+                                        "typed_len": typed_len_of.get(variant["text"], 0),
+                                        "flags": (FLAG_PRESERVE_TRIGGER if variant["preserve_trigger"] else 0) |
+                                                 (FLAG_COMPLETION if is_completion(py_node.short_code, variant["text"]) else 0)})
+            variant_records[-1]["flags"] |= VARIANT_FLAG_LAST
+        elif py_node.is_terminal:
+            expanded_text_offset = text_offsets[encoded_text_of[py_node.short_code]]
+        label_offset = raw_offsets[py_node.label.encode("utf-8")] if py_node.label else 0
+
+        if py_node.is_terminal:
+            flags |= FLAG_TERMINAL
+            if is_completion(py_node.short_code, py_node.expanded_text):
+                flags |= FLAG_COMPLETION
+        if py_node.preserve_trigger:
+            flags |= FLAG_PRESERVE_TRIGGER
+        if terminal_counts[id(py_node)] == 1:
+            flags |= FLAG_UNIQUE_COMPLETION
+        node_records.append({"expanded_text_offset": expanded_text_offset, "label_offset": label_offset,
+                             "instance_mask": py_node.instances if py_node.is_terminal else 0,
+                             "typed_len": typed_len_of.get(py_node.expanded_text, 0) if py_node.is_terminal else 0,
+                             "label_len": len(py_node.label), "flags": flags})
+    if streaming:
+        for record, (depth, fail_index, match_index) in zip(node_records, build_failure_links(c_trie_nodes, node_map)):
+            record.update(depth=depth, fail_index=fail_index, match_index=match_index)
+
+    child_tables = build_child_tables(c_trie_nodes, node_map)
+    da_layout = build_double_array(c_trie_nodes, node_map)
+    # Text offsets also index the variants table.
+    string_size = pick_index_type("string pool size", max(len(string_pool), len(variant_records)), min_index_size)["size"]
+    slot_size = pick_index_type("double-array slot count", len(da_layout["slots"]), min_index_size)["size"]
+    typed_size = pick_index_type("typed length", max(typed_len_of.values(), default=0),
+                                 min(min_index_size, MAX_TYPED_SIZE))["size"]
+    for record in node_records:
+        if record["expanded_text_offset"] is NULL_INDEX:
+            record["expanded_text_offset"] = null_of(string_size)
+
+    packed = pack_trie(c_trie_nodes, node_records, child_tables, da_layout, backend, string_size, slot_size, streaming,
+                       min_index_size, mask_size, typed_size)
+    return {"nodes": c_trie_nodes, "node_map": node_map, "string_pool": string_pool, "text_offsets": text_offsets,
+            "variants": variant_records, "node_records": node_records, "typed_size": typed_size,
+            "raw_offsets": raw_offsets, "pool_savings": pool_savings, "child_tables": child_tables,
+            "da_layout": da_layout, "string_size": string_size, "slot_size": slot_size, "packed": packed}
+
+def load_profile(path, expansions):
+    """
+    Reads a usage profile: a CSV file with one `short-code,count` row per short
+    code. Blank lines, # comments and a header row are skipped. Returns the
+    counts of the short codes that exist.
+    """
+    counts = {}
+    try:
+        with open(path, newline="", encoding="utf-8") as f:
+            for row in csv.reader(f):
+                if len(row) < 2 or row[0].lstrip().startswith("#") or not row[1].strip().isdigit():
+                    continue
+                counts[row[0].strip()] = counts.get(row[0].strip(), 0) + int(row[1])
+    except OSError as e:
+        print(f"Error: Cannot read the usage profile '{path}': {e}", file=sys.stderr)
+        sys.exit(1)
+    unknown = sorted(set(counts) - set(expansions))
+    if unknown:
+        print(f"Warning: Ignoring {len(unknown)} profiled short codes that are not defined, e.g. '{unknown[0]}'.",
+              file=sys.stderr)
+    return {short_code: count for short_code, count in counts.items() if short_code in expansions and count > 0}
+
+def profile_cost(profile, layout, encoded_text_of):
+    """
+    Returns the cache lines a lookup and its expanded text touch, averaged over
+    the profiled uses, and the distinct lines touched by the hottest short codes
+    that together make up PROFILE_HOT_SHARE of all uses.
+    """
+    packed = layout["packed"]
+    total, expected, covered, hot_touches = sum(profile.values()), 0, 0, []
+    for short_code, count in sorted(profile.items(), key=lambda item: (-item[1], item[0])):
+        touches = []
+        packed_search(packed, layout["nodes"], short_code, touches)
+        text = encoded_text_of[short_code]
+        touches.append(("pool", layout["text_offsets"][text], len(text)))
+        expected += count * cache_lines(touches)
+        if covered < PROFILE_HOT_SHARE * total:
+            hot_touches += touches
+            covered += count
+    return expected / total, cache_lines(hot_touches)
+
+def report_profile(profile, expansions, layout, plain, encoded_text_of):
+    """Prints the profiled lookup cost of the profile-guided layout next to the plain one."""
+    guided_lines, guided_hot = profile_cost(profile, layout, encoded_text_of)
+    plain_lines, plain_hot = profile_cost(profile, plain, encoded_text_of)
+    print(f"Text expander profile: {len(profile)} of {len(expansions)} short codes used {sum(profile.values())} times. "
+          f"An expansion touches {guided_lines:.2f} {CACHE_LINE_SIZE}-byte lines on average (unprofiled layout: "
+          f"{plain_lines:.2f}); the short codes behind {PROFILE_HOT_SHARE:.0%} of uses span {guided_hot} lines "
+          f"(unprofiled layout: {plain_hot}).")
+
+def generate_empty_tables(backend, streaming, limits, image_version, instance_paths):
+    """Returns the C code and trie types for a dictionary with no expansions, and its image if asked for."""
+    mask_size = instance_mask_size(len(instance_paths))
+    packed = pack_trie([], [], {"tables": [], "root_first_char": 0},
+                       {"base": [], "slots": [], "first_char": 0, "alphabet_size": 0}, backend, limits["index_size"], limits["index_size"],
+                       streaming, limits["index_size"], mask_size if len(instance_paths) > 1 else 0,
+                       min(limits["index_size"], MAX_TYPED_SIZE))
+    trie_types = {"node": packed["node_size"], "string": packed["string_size"], "slot": packed["slot_size"],
+                  "typed": packed["typed_size"],
+                  "alignment": packed["alignment"], "short_len": limits["short_len"],
+                  "ref_depth": limits["ref_depth"], "instances": instance_paths, "mask": mask_size, "image": None}
+    if image_version is not None:
+        sections = {name: b"" for name in IMAGE_SECTIONS}
+        sections["string_pool"] = b"\0"
+        trie_types["image"] = build_image(sections, trie_types, backend, streaming, image_version, {
+            "max_short_len": 0, "max_ref_depth": 0, "root_first_char": 0, "da_first_char": 0, "da_alphabet_size": 0})
+    return EMPTY_TRIE_C_CODE, trie_types
+
+EMPTY_TRIE_C_CODE = """
 #include <zmk/trie.h>
 #include <stddef.h>
-const uint16_t zmk_text_expander_trie_num_nodes = 0;
-const struct trie_node zmk_text_expander_trie_nodes[] = {};
-const struct trie_hash_table zmk_text_expander_hash_tables[] = {};
-const struct trie_hash_entry zmk_text_expander_hash_entries[] = {};
-const uint16_t zmk_text_expander_hash_buckets[] = {};
-const char zmk_text_expander_string_pool[] = "";
-const char *zmk_text_expander_get_string(uint16_t offset) { return NULL; }
+static const char zmk_text_expander_string_pool[] = "";
+const struct trie_tables zmk_text_expander_compiled_tables = {
+    .trie_size = 0,
+    .string_pool = zmk_text_expander_string_pool,
+    .string_pool_size = sizeof(zmk_text_expander_string_pool),
+};
 """
-    root = build_trie_from_expansions(expansions)
 
-    string_pool_builder = []
-    c_trie_nodes, c_hash_tables, c_hash_buckets, c_hash_entries = [], [], [], []
-    node_q, node_map = [root], {id(root): 0}
+# Typedef and null sentinel macro emitted for each index type.
+INDEX_TYPE_NAMES = {
+    "node": ("trie_node_offset_t", "TRIE_NODE_OFFSET_NULL"),
+    "string": ("trie_string_offset_t", "TRIE_STRING_OFFSET_NULL"),
+    "slot": ("trie_slot_index_t", "TRIE_SLOT_INDEX_NULL"),
+}
 
-    # First pass to discover all nodes and assign indices
-    head = 0
-    while head < len(node_q):
-        py_node = node_q[head]
-        head += 1
-        for child in sorted(py_node.children.values(), key=id): # Sort for determinism
-            if id(child) not in node_map:
-                node_map[id(child)] = len(node_map)
-                node_q.append(child)
+def generate_header(trie_types):
+    """
+    Generates generated_trie.h: the short code limit, the index types sized to
+    this dictionary, the fragment nesting depth, the instances and the typed
+    length type.
+    """
+    lines = [
+        "",
+        "#pragma once",
+        "// Automatically generated file. Do not edit.",
+        "#include <stdint.h>",
+        "",
+        f"#define ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN {trie_types['short_len']}",
+        "",
+        "// Index types sized to this dictionary. The maximum of each type is its null sentinel.",
+    ]
+    for kind, (type_name, null_name) in INDEX_TYPE_NAMES.items():
+        lines.append(f"typedef {INDEX_TYPES_BY_SIZE[trie_types[kind]][0]} {type_name};")
+        lines.append(f"#define {null_name} {INDEX_TYPES_BY_SIZE[trie_types[kind]][1]}")
+    lines += [
+        "",
+        "// Alignment of every node in the packed trie.",
+        f"#define TRIE_NODE_ALIGN {trie_types['alignment']}",
+        "",
+        "// Deepest chain of nested {{ref:...}} fragments; sizes the engine's call stack.",
+        f"#define ZMK_TEXT_EXPANDER_GENERATED_MAX_REF_DEPTH {trie_types['ref_depth']}",
+        "",
+        "// Text expander instances sharing the trie, by devicetree path. Instance i is",
+        "// bit i of a trie_instance_mask_t. Each path is followed by a comma, so the",
+        "// list can start an initializer that ends with a sentinel.",
+        f"#define ZMK_TEXT_EXPANDER_GENERATED_NUM_INSTANCES {len(trie_types['instances'])}",
+        "#define ZMK_TEXT_EXPANDER_GENERATED_INSTANCE_PATHS " +
+        "".join(f'"{escape_for_c_string(path)}", ' for path in trie_types["instances"]).rstrip(),
+        f"typedef {INDEX_TYPES_BY_SIZE[trie_types['mask']][0]} trie_instance_mask_t;",
+        "",
+        "// Wide enough for the number of characters the longest expansion types.",
+        f"typedef {INDEX_TYPES_BY_SIZE[trie_types['typed']][0]} trie_typed_len_t;",
+    ]
+    return "\n".join(lines) + "\n"
 
-    c_trie_nodes = [None] * len(node_q)
-    for py_node in node_q:
-        c_trie_nodes[node_map[id(py_node)]] = py_node
+HEX_BYTES = [f"0x{byte:02x}" for byte in range(0x100)]
 
+# First line of generated_trie.c, recording the dictionary hash it was
+# generated from. The header does not carry it, so the sources that include
+# the header only rebuild when the index types change.
+DICTIONARY_HASH_PREFIX = "// Dictionary hash: "
 
-    # Second pass to build C structures
-    for py_node in c_trie_nodes:
-        hash_table_index = NULL_INDEX
-        if py_node.children:
-            hash_table_index = len(c_hash_tables)
-            num_children = len(py_node.children)
-            num_buckets = get_next_power_of_2(num_children) if num_children > 1 else 1
-            buckets_start_index = len(c_hash_buckets)
-            buckets = [NULL_INDEX] * num_buckets
-            c_hash_tables.append({"buckets_start_index": buckets_start_index, "num_buckets": num_buckets})
-
-            for char, child_py_node in sorted(py_node.children.items()): # Sort for determinism
-                hash_val = ord(char) % num_buckets
-                child_node_index = node_map[id(child_py_node)]
-                new_entry_index = len(c_hash_entries)
-                next_entry_index = buckets[hash_val]
-                c_hash_entries.append({"key": char, "child_node_index": child_node_index, "next_entry_index": next_entry_index})
-                buckets[hash_val] = new_entry_index
-            c_hash_buckets.extend(buckets)
+def dictionary_hash(expansions, fragments, backend, streaming, profile, options=None, instance_paths=None):
+    """
+    Hashes everything the generated files depend on: this script, the parsed
+    expansions and fragments in definition order, the instance paths and the
+    options. Changes elsewhere in the devicetree leave it unchanged.
+    """
+    digest = hashlib.sha256(Path(__file__).read_bytes())
+    inputs = [list(expansions.items()), list(fragments.items()), backend, streaming, sorted((profile or {}).items()),
+              options or {}, instance_paths or []]
+    digest.update(json.dumps(inputs, sort_keys=True).encode("utf-8"))
+    return digest.hexdigest()
 
-        expanded_text_offset = NULL_INDEX
-        if py_node.is_terminal:
-            current_pool_str = "".join(string_pool_builder)
-            expanded_text_offset = len(current_pool_str.encode('utf-8'))
-            string_pool_builder.append(py_node.expanded_text + '\0')
-
-        py_node.c_struct_data = {
-            "hash_table_index": hash_table_index,
-            "expanded_text_offset": expanded_text_offset,
-            "is_terminal": 1 if py_node.is_terminal else 0,
-            "preserve_trigger": 1 if py_node.preserve_trigger else 0,
-        }
+def is_up_to_date(output_c_path, output_h_path, digest, image_path=None):
+    """True when all outputs exist and the C file was generated from `digest`."""
+    try:
+        with open(output_c_path, encoding="utf-8") as f:
+            first_line = f.readline()
+    except (OSError, UnicodeDecodeError):
+        return False
+    return (Path(output_h_path).is_file() and (not image_path or Path(image_path).is_file()) and
+            first_line == f"{DICTIONARY_HASH_PREFIX}{digest}\n")
+
+def write_if_changed(path, content):
+    """Writes `content` unless the file already holds it, so its timestamp only moves on a change."""
+    try:
+        if Path(path).read_bytes() == (content if isinstance(content, bytes) else content.encode("utf-8")):
+            return
+    except OSError:
+        pass
+    if isinstance(content, bytes):
+        Path(path).write_bytes(content)
+        return
+    with open(path, 'w', encoding='utf-8') as f:
+        f.write(content)
+
+# The narrowest index width, shortest short code limit and shallowest fragment
+# depth the generated types allow for. A firmware that reads dictionary images
+# raises them, so an image for a bigger dictionary still fits its types.
+DEFAULT_LIMITS = {"index_size": 1, "short_len": 0, "ref_depth": 0}
+
+# Dictionary image read in place from flash (CONFIG_ZMK_TEXT_EXPANDER_DICTIONARY_PARTITION).
+# The header must match struct trie_image_header in trie_image.h; every field is
+# little-endian. Sections follow the header in this order, each aligned to
+# IMAGE_SECTION_ALIGN bytes, and the CRC-32 covers the header up to the crc32
+# field and then everything from the end of the header to the end of the image.
+IMAGE_MAGIC = int.from_bytes(b"ZTXD", "little")
+IMAGE_FORMAT_VERSION = 3
+IMAGE_SECTION_ALIGN = 8
+IMAGE_SECTIONS = ["trie", "da_slots", "string_pool", "phrases", "fragments", "variants"]
+IMAGE_FLAG_DOUBLE_ARRAY = 1 << 0
+IMAGE_FLAG_STREAMING = 1 << 1
+IMAGE_HEADER_FIELDS = [
+    ("magic", 4), ("format_version", 2), ("header_size", 2), ("image_size", 4), ("dictionary_version", 4),
+    ("node_offset_size", 1), ("string_offset_size", 1), ("slot_index_size", 1), ("node_align", 1),
+    ("layout_flags", 1), ("max_short_len", 1), ("max_ref_depth", 1), ("root_first_char", 1),
+    ("da_first_char", 1), ("da_alphabet_size", 1), ("num_instances", 1), ("typed_len_size", 1),
+] + [(f"{name}_{field}", 4) for name in IMAGE_SECTIONS for field in ("offset", "size")] + [("crc32", 4)]
+
+def build_image(sections, trie_types, backend, streaming, version, values):
+    """
+    Assembles a dictionary image from the packed `sections`, the index types
+    they were packed with and the remaining header `values`.
+    """
+    offsets, header_size = c_struct_layout(IMAGE_HEADER_FIELDS)
+    values = dict(values, magic=IMAGE_MAGIC, format_version=IMAGE_FORMAT_VERSION, header_size=header_size,
+                  dictionary_version=version, node_offset_size=trie_types["node"],
+                  string_offset_size=trie_types["string"], slot_index_size=trie_types["slot"],
+                  node_align=trie_types["alignment"], num_instances=len(trie_types["instances"]),
+                  typed_len_size=trie_types["typed"], crc32=0,
+                  layout_flags=(IMAGE_FLAG_DOUBLE_ARRAY if backend == "double-array" else 0) |
+                               (IMAGE_FLAG_STREAMING if streaming else 0))
+    body = bytearray()
+    for name in IMAGE_SECTIONS:
+        body += bytes(round_up(header_size + len(body), IMAGE_SECTION_ALIGN) - header_size - len(body))
+        values[f"{name}_offset"] = header_size + len(body)
+        values[f"{name}_size"] = len(sections[name])
+        body += sections[name]
+    values["image_size"] = header_size + len(body)
+    header = pack_struct(IMAGE_HEADER_FIELDS, values)
+    values["crc32"] = zlib.crc32(body, zlib.crc32(header[:offsets["crc32"]]))
+    return pack_struct(IMAGE_HEADER_FIELDS, values) + bytes(body)
+
+def format_bytes(data):
+    return ", ".join([HEX_BYTES[byte] for byte in data])
+
+def generate_static_trie_c_code(expansions, backend="hash", fragments=None, streaming=False, profile=None,
+                                limits=None, image_version=None, instance_paths=None):
+    """
+    Generates the C source file content for the packed trie and its lookup tables.
+    With `streaming`, the trie is left uncompressed and gets Aho-Corasick failure
+    links so short codes can be matched anywhere in the typed stream. A usage
+    `profile` (counts per short code) lays the hottest paths and texts out
+    first. `limits` sets the narrowest index width, short code limit and
+    fragment depth the firmware is built for, so later dictionary images fit it.
+    `instance_paths` names the instances whose bits the expansions carry.
+    Returns the C code and the index types, alignment, short code limit,
+    fragment nesting depth and instances it was generated for, plus the
+    dictionary image when an `image_version` is given.
+    """
+    limits = dict(DEFAULT_LIMITS, **(limits or {}))
+    instance_paths = instance_paths if instance_paths is not None else ["/"]
+    mask_size = instance_mask_size(len(instance_paths))
+    node_mask_size = mask_size if len(instance_paths) > 1 else 0
+    if not expansions:
+        return generate_empty_tables(backend, streaming, limits, image_version, instance_paths)
 
-    c_parts = ["#include <zmk/trie.h>\n#include <stddef.h> // For NULL\n\n"]
-    c_parts.append(f"const uint16_t zmk_text_expander_trie_num_nodes = {len(c_trie_nodes)};\n\n")
+    too_long = [short_code for short_code in expansions if len(short_code) > MAX_SUPPORTED_SHORT_LEN]
+    if too_long:
+        print(f"Error: The short code '{too_long[0]}' is longer than {MAX_SUPPORTED_SHORT_LEN} characters.", file=sys.stderr)
+        sys.exit(1)
+    expansions, fragment_texts, max_ref_depth = resolve_fragment_refs(expansions, fragments or {})
+    root = build_trie_from_expansions(expansions)
+    uncompressed_nodes = count_nodes(root)
+    # Streaming match needs a state for every character, so edges stay uncompressed.
+    if not streaming:
+        compress_trie(root)
+
+    # Text encoding does not depend on the layout, so it is done once, in plain order.
+    plain_nodes = order_nodes_depth_first(root)
+    terminals = [py_node for py_node in plain_nodes if py_node.is_terminal]
+    # Texts of short codes that instances define differently follow the terminals' own.
+    variant_texts = [(py_node.short_code, variant["text"]) for py_node in terminals for variant in (py_node.variants or [])[1:]]
+    terminal_texts = [(py_node.short_code, py_node.expanded_text) for py_node in terminals] + variant_texts
+    text_spans = [split_text_spans(text, len(short_code) if is_completion(short_code, text) else 0)
+                  for short_code, text in terminal_texts]
+    text_spans += [split_text_spans(text, 0) for text in fragment_texts]
+    report_untypeable(text_spans)
+    typed_len_of = typed_lengths([text for _, text in terminal_texts], fragment_texts)
+    too_long = [short_code for short_code, text in terminal_texts if typed_len_of[text] > MAX_SUPPORTED_TYPED_LEN]
+    if too_long:
+        print(f"Error: The expansion of '{too_long[0]}' types more than {MAX_SUPPORTED_TYPED_LEN} characters.",
+              file=sys.stderr)
+        sys.exit(1)
+    # Phrase table entries are estimated with 16-bit pool offsets.
+    encoded_texts, phrases = compress_texts(text_spans, c_struct_layout([("offset", 2), ("len", 1)])[1])
+    encoded_texts = [text + bytes([OP_END]) for text in encoded_texts]
+    encoded_text_of = {py_node.short_code: text for py_node, text in zip(terminals, encoded_texts)}
+    encoded_variants_of = {py_node.short_code: [encoded_text_of[py_node.short_code]]
+                           for py_node in terminals if py_node.variants}
+    for (short_code, _), text in zip(variant_texts, encoded_texts[len(terminals):]):
+        encoded_variants_of[short_code].append(text)
+    encoded_fragments = encoded_texts[len(terminals) + len(variant_texts):]
+    labels = [py_node.label.encode("utf-8") for py_node in plain_nodes if py_node.label]
+
+    layout = lay_out_trie(root, expansions, encoded_text_of, encoded_fragments, labels, phrases, backend, streaming, profile,
+                          limits["index_size"], encoded_variants_of, node_mask_size, typed_len_of)
+    c_trie_nodes, node_map = layout["nodes"], layout["node_map"]
+    string_pool, text_offsets, raw_offsets = layout["string_pool"], layout["text_offsets"], layout["raw_offsets"]
+    child_tables, da_layout = layout["child_tables"], layout["da_layout"]
+    string_size, slot_size = layout["string_size"], layout["slot_size"]
+    pool_bytes = len(string_pool)
+    report_string_pool([py_node.expanded_text for py_node in terminals] + [text for _, text in variant_texts] +
+                       fragment_texts, labels, encoded_texts,
+                       phrases, string_pool, layout["pool_savings"])
+    if fragment_texts:
+        report_fragments(terminals, fragment_texts)
+
+    packed = layout["packed"]
+    verify_packed_trie(c_trie_nodes, node_map, packed)
+    # Both backends share the node order and records, so the other one only needs packing.
+    other_packed = pack_trie(c_trie_nodes, layout["node_records"], child_tables, da_layout,
+                             "double-array" if backend == "hash" else "hash", string_size, slot_size, streaming,
+                             limits["index_size"], node_mask_size, layout["typed_size"])
+    verify_backends(expansions, c_trie_nodes, packed, other_packed)
+    if profile:
+        plain = lay_out_trie(root, expansions, encoded_text_of, encoded_fragments, labels, phrases, backend, streaming,
+                             None, limits["index_size"], encoded_variants_of, node_mask_size, typed_len_of)
+        report_profile(profile, expansions, layout, plain, encoded_text_of)
+    if streaming:
+        verify_streaming(expansions, c_trie_nodes, packed)
+        link_bytes = len(c_trie_nodes) * (2 * packed["node_size"] + 1)
+        print(f"Text expander trie: streaming match uses {len(c_trie_nodes)} uncompressed nodes; "
+              f"failure and match links take about {link_bytes} bytes.")
+
+    label_bytes = sum(len(n.label) for n in c_trie_nodes)
+    _, da_slot_size = c_struct_layout(da_slot_fields(packed["node_size"]))
+    folded_node_bytes = packed["header_size"] + (da_slot_size if backend == "double-array" else packed["entry_size"])
+    report_lookup_cost(c_trie_nodes, node_map, len(child_tables["tables"][0]["slots"]))
+    if not streaming:
+        report_path_compression(uncompressed_nodes, c_trie_nodes, label_bytes,
+                                len(packed["data"]) + len(packed["da_slots"]) * da_slot_size + pool_bytes,
+                                folded_node_bytes)
+    split_bytes, split_lines = split_layout_cost(expansions, c_trie_nodes, node_map, child_tables, da_layout,
+                                                 backend, string_size, slot_size)
+    report_layout(expansions, c_trie_nodes, packed, split_bytes, split_lines)
+    print("Text expander trie: index widths " + ", ".join(
+        f"{kind} {INDEX_TYPES_BY_SIZE[size][0]}" for kind, size in
+        (("node offset", packed["node_size"]), ("string", string_size), ("slot", slot_size),
+         ("typed length", packed["typed_size"]))) + ".")
+
+    entry_type = "struct trie_da_slot" if backend == "double-array" else "struct trie_hash_entry"
+    entry_size = da_slot_size if backend == "double-array" else packed["entry_size"]
+    c_parts = ["#include <zephyr/toolchain.h>\n#include <zmk/trie.h>\n#include <stddef.h> // For NULL\n\n"]
+    c_parts.append("BUILD_ASSERT(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, \"The packed trie is little-endian.\");\n")
+    c_parts.append(f"BUILD_ASSERT(sizeof(struct trie_node) == {packed['header_size']}, \"trie_node does not match the generated layout.\");\n")
+    c_parts.append(f"BUILD_ASSERT(offsetof(struct trie_node, flags) == {c_struct_layout(packed['fields'])[0]['flags']}, \"trie_node does not match the generated layout.\");\n")
+    c_parts.append(f"BUILD_ASSERT(sizeof({entry_type}) == {entry_size}, \"Child entries do not match the generated layout.\");\n")
+    fields_of_variant = variant_fields(string_size, mask_size, packed["typed_size"])
+    c_parts.append(f"BUILD_ASSERT(sizeof(struct trie_variant) == {c_struct_layout(fields_of_variant)[1]}, \"trie_variant does not match the generated layout.\");\n\n")
 
-    string_pool = "".join(string_pool_builder)
     escaped_string_pool = escape_for_c_string(string_pool)
-    c_parts.append(f'const char zmk_text_expander_string_pool[] = "{escaped_string_pool}";\n\n')
+    c_parts.append(f'static const char zmk_text_expander_string_pool[] = "{escaped_string_pool}";\n\n')
 
-    c_parts.append("const struct trie_node zmk_text_expander_trie_nodes[] = {\n")
-    for py_node in c_trie_nodes:
-        d = py_node.c_struct_data
-        c_parts.append(f"    {{ .hash_table_index = {d['hash_table_index']}, .expanded_text_offset = {d['expanded_text_offset']}, .is_terminal = {d['is_terminal']}, .preserve_trigger = {d['preserve_trigger']} }},\n")
+    c_parts.append("static const struct trie_phrase zmk_text_expander_phrases[] = {\n")
+    for phrase in phrases:
+        c_parts.append(f"    {{ .offset = {raw_offsets[phrase]}, .len = {len(phrase)} }},\n")
     c_parts.append("};\n\n")
 
-    c_parts.append("const struct trie_hash_table zmk_text_expander_hash_tables[] = {\n")
-    for ht in c_hash_tables:
-        c_parts.append(f"    {{ .buckets_start_index = {ht['buckets_start_index']}, .num_buckets = {ht['num_buckets']} }},\n")
+    c_parts.append("static const trie_string_offset_t zmk_text_expander_fragments[] = {\n")
+    for text in encoded_fragments:
+        c_parts.append(f"    {text_offsets[text]},\n")
     c_parts.append("};\n\n")
 
-    c_parts.append("const uint16_t zmk_text_expander_hash_buckets[] = {\n    " + ", ".join(map(str, c_hash_buckets)) + "\n};\n\n")
-
-    c_parts.append("const struct trie_hash_entry zmk_text_expander_hash_entries[] = {\n")
-    for entry in c_hash_entries:
-        escaped_key = entry['key'].replace('\\', '\\\\').replace("'", "\\'")
-        c_parts.append(f"    {{ .key = '{escaped_key}', .child_node_index = {entry['child_node_index']}, .next_entry_index = {entry['next_entry_index']} }},\n")
+    # One line per node: its header, then its inline child table and padding.
+    c_parts.append("static const uint8_t zmk_text_expander_trie[] __aligned(TRIE_NODE_ALIGN) = {\n")
+    offsets = [offset * packed["alignment"] for offset in packed["offsets"]] + [len(packed["data"])]
+    for node_index in range(len(c_trie_nodes)):
+        c_parts.append(f"    {format_bytes(packed['data'][offsets[node_index]:offsets[node_index + 1]])},\n")
     c_parts.append("};\n\n")
 
-    c_parts.append("const char *zmk_text_expander_get_string(uint16_t offset) {\n")
-    c_parts.append("    if (offset >= sizeof(zmk_text_expander_string_pool)) return NULL;\n")
-    c_parts.append("    return &zmk_text_expander_string_pool[offset];\n}\n")
+    if backend == "double-array":
+        c_parts.append("static const struct trie_da_slot zmk_text_expander_da_slots[] = {\n")
+        format_offset = lambda offset: "TRIE_NODE_OFFSET_NULL" if offset == null_of(packed["node_size"]) else str(offset)
+        for check, child_node_offset in packed["da_slots"]:
+            c_parts.append(f"    {{ .check = {format_offset(check)}, .child_node_offset = {format_offset(child_node_offset)} }},\n")
+        c_parts.append("};\n\n")
+
+    if layout["variants"]:
+        c_parts.append("static const struct trie_variant zmk_text_expander_variants[] = {\n")
+        for variant in layout["variants"]:
+            c_parts.append(f"    {{ .text_offset = {variant['text_offset']}, .instance_mask = 0x{variant['instance_mask']:x}, "
+                           f".typed_len = {variant['typed_len']}, .flags = 0x{variant['flags']:02x} }},\n")
+        c_parts.append("};\n\n")
+
+    c_parts.append("const struct trie_tables zmk_text_expander_compiled_tables = {\n")
+    c_parts.append("    .trie = zmk_text_expander_trie,\n")
+    c_parts.append(f"    .trie_size = {len(packed['data']) // packed['alignment']},\n")
+    if backend == "double-array":
+        c_parts.append(f"    .da_first_char = {da_layout['first_char']},\n")
+        c_parts.append(f"    .da_alphabet_size = {da_layout['alphabet_size']},\n")
+        c_parts.append(f"    .da_num_slots = {len(da_layout['slots'])},\n")
+        c_parts.append("    .da_slots = zmk_text_expander_da_slots,\n")
+    else:
+        c_parts.append(f"    .root_first_char = {child_tables['root_first_char']},\n")
+    c_parts.append("    .string_pool = zmk_text_expander_string_pool,\n")
+    c_parts.append("    .string_pool_size = sizeof(zmk_text_expander_string_pool),\n")
+    c_parts.append(f"    .num_phrases = {len(phrases)},\n")
+    c_parts.append("    .phrases = zmk_text_expander_phrases,\n")
+    c_parts.append(f"    .num_fragments = {len(fragment_texts)},\n")
+    c_parts.append("    .fragments = zmk_text_expander_fragments,\n")
+    if layout["variants"]:
+        c_parts.append(f"    .num_variants = {len(layout['variants'])},\n")
+        c_parts.append("    .variants = zmk_text_expander_variants,\n")
+    c_parts.append("};\n")
 
-    return "".join(c_parts)
+    longest_short_len = len(max(expansions.keys(), key=len))
+    trie_types = {"node": packed["node_size"], "string": string_size, "slot": slot_size, "typed": packed["typed_size"],
+                  "alignment": packed["alignment"], "short_len": max(longest_short_len, limits["short_len"]),
+                  "ref_depth": max(max_ref_depth, limits["ref_depth"]), "instances": instance_paths, "mask": mask_size,
+                  "image": None}
+    if image_version is not None:
+        phrase_fields = [("offset", string_size), ("len", 1)]
+        sections = {
+            "trie": packed["data"],
+            "da_slots": b"".join(pack_struct(da_slot_fields(packed["node_size"]),
+                                             {"check": check, "child_node_offset": child_node_offset})
+                                 for check, child_node_offset in packed["da_slots"]),
+            "string_pool": bytes(string_pool) + b"\0",
+            "phrases": b"".join(pack_struct(phrase_fields, {"offset": raw_offsets[phrase], "len": len(phrase)})
+                                for phrase in phrases),
+            "fragments": b"".join(pack_struct([("offset", string_size)], {"offset": text_offsets[text]})
+                                  for text in encoded_fragments),
+            "variants": b"".join(pack_struct(fields_of_variant, variant) for variant in layout["variants"]),
+        }
+        trie_types["image"] = build_image(sections, trie_types, backend, streaming, image_version, {
+            "max_short_len": longest_short_len, "max_ref_depth": max_ref_depth,
+            "root_first_char": child_tables["root_first_char"] if backend == "hash" else 0,
+            "da_first_char": da_layout["first_char"] if backend == "double-array" else 0,
+            "da_alphabet_size": da_layout["alphabet_size"] if backend == "double-array" else 0})
+    return "".join(c_parts), trie_types
 
 if __name__ == "__main__":
-    if len(sys.argv) < 4:
-        print("Usage: python gen_trie.py <build_dir> <output_c_file> <output_h_file>")
-        sys.exit(1)
+    parser = argparse.ArgumentParser(description="Generates the static trie for the ZMK Text Expander.")
+    parser.add_argument("build_dir")
+    parser.add_argument("output_c_file")
+    parser.add_argument("output_h_file")
+    parser.add_argument("--backend", choices=["hash", "double-array"], default="hash",
+                        help="Lookup table layout to emit (CONFIG_ZMK_TEXT_EXPANDER_TRIE_BACKEND_*).")
+    parser.add_argument("--streaming", action="store_true",
+                        help="Add Aho-Corasick failure links (CONFIG_ZMK_TEXT_EXPANDER_STREAMING_MATCH).")
+    parser.add_argument("--profile",
+                        help="CSV of short-code,count usage to lay out the tables by (CONFIG_ZMK_TEXT_EXPANDER_USAGE_PROFILE).")
+    parser.add_argument("--stamp",
+                        help="File to touch once the outputs are up to date, for the build system to track.")
+    parser.add_argument("--config-dir",
+                        help="Directory that relative dictionary-files paths are resolved against (the zmk-config directory).")
+    parser.add_argument("--depfile",
+                        help="Make-style dependency file to write, listing the dictionary files that were read.")
+    parser.add_argument("--image",
+                        help="Also write the tables as a dictionary image for a flash partition "
+                             "(CONFIG_ZMK_TEXT_EXPANDER_DICTIONARY_PARTITION).")
+    parser.add_argument("--image-version", type=int, default=1,
+                        help="Version stored in the dictionary image; the newer of two valid images is used.")
+    parser.add_argument("--min-index-size", type=int, choices=[1, 2, 4], default=DEFAULT_LIMITS["index_size"],
+                        help="Narrowest index type, in bytes (CONFIG_ZMK_TEXT_EXPANDER_DICTIONARY_INDEX_SIZE).")
+    parser.add_argument("--min-short-len", type=int, default=DEFAULT_LIMITS["short_len"],
+                        help="Short code limit to build for (CONFIG_ZMK_TEXT_EXPANDER_DICTIONARY_MAX_SHORT_LEN).")
+    parser.add_argument("--min-ref-depth", type=int, default=DEFAULT_LIMITS["ref_depth"],
+                        help="Fragment nesting depth to build for (CONFIG_ZMK_TEXT_EXPANDER_DICTIONARY_MAX_REF_DEPTH).")
+    args = parser.parse_args()
 
-    build_dir, output_c_path, output_h_path = sys.argv[1], sys.argv[2], sys.argv[3]
+    build_dir, output_c_path, output_h_path = args.build_dir, args.output_c_file, args.output_h_file
 
     build_path = Path(build_dir)
-    dts_files = list(build_path.rglob('zephyr.dts'))
+    # The build passes the directory zephyr.dts is written to; search below it otherwise.
+    dts_files = [build_path / 'zephyr.dts'] if (build_path / 'zephyr.dts').is_file() else sorted(build_path.rglob('zephyr.dts'))
 
     if not dts_files:
         print(f"Error: Processed devicetree source (zephyr.dts) not found in '{build_dir}'", file=sys.stderr)
@@ -267,17 +1913,32 @@ if __name__ == "__main__":
         sys.exit(1)
 
     dts_path = dts_files[0]
-    expansions = parse_dts_for_expansions(str(dts_path))
+    expansions, fragments, dictionary_files, instance_paths = parse_dts_for_expansions(str(dts_path), args.config_dir)
 
-    c_code = generate_static_trie_c_code(expansions)
-    with open(output_c_path, 'w', encoding='utf-8') as f:
-        f.write(c_code)
+    if not 0 <= args.min_short_len <= MAX_SUPPORTED_SHORT_LEN or not 0 <= args.min_ref_depth <= 0xFF:
+        print(f"Error: --min-short-len must be at most {MAX_SUPPORTED_SHORT_LEN} and --min-ref-depth at most 255.",
+              file=sys.stderr)
+        sys.exit(1)
+    limits = {"index_size": args.min_index_size, "short_len": args.min_short_len, "ref_depth": args.min_ref_depth}
+    image_version = args.image_version if args.image else None
+    profile = load_profile(args.profile, expansions) if args.profile else None
+    digest = dictionary_hash(expansions, fragments, args.backend, args.streaming, profile,
+                             {"limits": limits, "image_version": image_version}, instance_paths)
+    if is_up_to_date(output_c_path, output_h_path, digest, args.image):
+        print("Text expander trie: expansions unchanged, keeping the generated tables.")
+    else:
+        c_code, trie_types = generate_static_trie_c_code(expansions, args.backend, fragments, args.streaming, profile,
+                                                         limits, image_version, instance_paths)
+        write_if_changed(output_c_path, f"{DICTIONARY_HASH_PREFIX}{digest}\n" + c_code)
+        write_if_changed(output_h_path, generate_header(trie_types))
+        if args.image:
+            write_if_changed(args.image, trie_types["image"])
+            print(f"Text expander dictionary image: {len(trie_types['image'])} bytes, "
+                  f"version {image_version}, written to {args.image}.")
 
-    longest_short_len = len(max(expansions.keys(), key=len)) if expansions else 0
-    h_file_content = f"""
-#pragma once
-// Automatically generated file. Do not edit.
-#define ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN {longest_short_len}
-"""
-    with open(output_h_path, 'w', encoding='utf-8') as f:
-        f.write(h_file_content)
+    if args.depfile:
+        escape = lambda path: path.replace(" ", "\\ ")
+        write_if_changed(args.depfile, f"{escape(args.stamp or output_c_path)}: "
+                                       f"{' '.join(escape(path) for path in dictionary_files)}\n")
+    if args.stamp:
+        Path(args.stamp).touch()
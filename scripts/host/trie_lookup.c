@@ -0,0 +1,54 @@
+// Host driver for src/trie.c, built by test_gen_trie.py against generated tables.
+// Reads one key per line and prints, for each, what the firmware lookups find:
+//
+//     <trie_search> <trie_get_node_for_key> <trie_cursor_terminal>
+//
+// A terminal is printed as its keystroke program in hex with phrases expanded,
+// a node that is not one as "1", and no node as "-".
+#include <stdio.h>
+#include <string.h>
+#include <zmk/trie.h>
+
+static void print_terminal(const struct trie_node *node) {
+    struct trie_expansion expansion;
+    if (!node || !trie_get_expansion(node, &expansion)) {
+        fputs("-", stdout);
+        return;
+    }
+    const uint8_t *keys = expansion.keys;
+    while (*keys != TRIE_OP_END) {
+        if (trie_is_phrase_token(keys)) {
+            uint8_t len;
+            const uint8_t *phrase = trie_get_phrase(keys, &len);
+            if (!phrase) {
+                fputs("?", stdout);
+                return;
+            }
+            for (uint8_t i = 0; i < len; i++) {
+                printf("%02x", phrase[i]);
+            }
+            keys += TRIE_PHRASE_TOKEN_LEN;
+        } else {
+            printf("%02x", *keys++);
+        }
+    }
+}
+
+int main(void) {
+    char key[256];
+    while (fgets(key, sizeof(key), stdin)) {
+        key[strcspn(key, "\n")] = '\0';
+        print_terminal(trie_search(key));
+        fputs(trie_get_node_for_key(key) ? " 1 " : " - ", stdout);
+
+        struct trie_cursor cursor;
+        trie_cursor_reset(&cursor);
+        bool on_path = true;
+        for (const char *c = key; *c && on_path; c++) {
+            on_path = trie_cursor_advance(&cursor, *c);
+        }
+        print_terminal(on_path ? trie_cursor_terminal(&cursor) : NULL);
+        putchar('\n');
+    }
+    return 0;
+}
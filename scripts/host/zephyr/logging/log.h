@@ -0,0 +1,11 @@
+// Host stand-in for the Zephyr header, for building src/trie.c in test_gen_trie.py.
+// Warnings and errors go to stderr, where the test reports them.
+#pragma once
+
+#include <stdio.h>
+
+#define LOG_MODULE_REGISTER(...)
+#define LOG_DBG(...) do { } while (0)
+#define LOG_INF(...) do { } while (0)
+#define LOG_WRN(...) do { fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); } while (0)
+#define LOG_ERR(...) do { fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); } while (0)
@@ -0,0 +1,5 @@
+// Host stand-in for the Zephyr header, for building src/trie.c in test_gen_trie.py.
+#pragma once
+
+#define BUILD_ASSERT(cond, ...) _Static_assert(cond, "" __VA_ARGS__)
+#define __aligned(x) __attribute__((aligned(x)))
@@ -0,0 +1,148 @@
+"""
+Host tests for gen_trie.py. Run them with
+
+    python3 -m unittest discover -s scripts
+
+They do not read a devicetree, so dtlib is only needed if it is installed;
+with ZEPHYR_BASE set, Zephyr's copy is used. HostBuildTest also compiles
+src/trie.c against the generated tables with the host C compiler (CC, or cc),
+using the stand-in Zephyr headers in host/; it is skipped without one.
+"""
+import contextlib
+import io
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import types
+import unittest
+from pathlib import Path
+
+sys.path.insert(0, str(Path(__file__).resolve().parent))
+if os.environ.get("ZEPHYR_BASE"):
+    sys.path.insert(0, os.path.join(os.environ["ZEPHYR_BASE"], "scripts", "dts", "python-devicetree", "src"))
+try:
+    from devicetree import dtlib  # noqa: F401
+except ImportError:
+    devicetree = types.ModuleType("devicetree")
+    devicetree.dtlib = None
+    sys.modules["devicetree"] = devicetree
+
+import gen_trie
+
+SCRIPTS_DIR = Path(__file__).resolve().parent
+REPO_DIR = SCRIPTS_DIR.parent
+HOST_CC = shutil.which(os.environ.get("CC", "cc"))
+
+BACKENDS = ("hash", "double-array")
+
+def sample_dictionary(seed, count):
+    """Random short codes with many shared prefixes, codes that prefix others and a wide root."""
+    rng = random.Random(seed)
+    alphabet = "abcdefghijklmnopqrstuvwxyz0123456789"
+    short_codes = set(alphabet[:20])
+    while len(short_codes) < count:
+        base = rng.choice(sorted(short_codes)) if rng.random() < 0.6 else ""
+        short_codes.add(base + "".join(rng.choice(alphabet[:rng.randint(3, len(alphabet))])
+                                       for _ in range(rng.randint(1, 4))))
+    return {short_code: {"text": f"<{short_code}>", "preserve_trigger": True} for short_code in short_codes}
+
+def pack_backends(expansions, streaming=False):
+    """Lays the trie out once per backend. Returns the layouts by backend."""
+    layouts = {}
+    for backend in BACKENDS:
+        root = gen_trie.build_trie_from_expansions(expansions)
+        if not streaming:
+            gen_trie.compress_trie(root)
+        nodes = gen_trie.order_nodes_depth_first(root)
+        labels = [py_node.label.encode("utf-8") for py_node in nodes if py_node.label]
+        encoded_text_of = {short_code: entry["text"].encode("utf-8") + bytes([gen_trie.OP_END])
+                           for short_code, entry in expansions.items()}
+        layouts[backend] = gen_trie.lay_out_trie(root, expansions, encoded_text_of, [], labels, [], backend, streaming)
+    return layouts
+
+def search(layout, key):
+    """The short code `key` resolves to in the packed layout, or None."""
+    node_index = gen_trie.packed_search(layout["packed"], layout["nodes"], key)
+    return None if node_index is None else layout["nodes"][node_index].short_code
+
+class BackendTest(unittest.TestCase):
+    def assert_backends_agree(self, expansions, streaming=False):
+        layouts = pack_backends(expansions, streaming)
+        alphabet = sorted({c for short_code in expansions for c in short_code})
+        probes = gen_trie.backend_probes(sorted(expansions), alphabet)
+        self.assertGreater(len(probes), len(expansions))
+        for key in probes:
+            results = {backend: search(layouts[backend], key) for backend in BACKENDS}
+            expected = key if key in expansions else None
+            self.assertEqual(results, {backend: expected for backend in BACKENDS}, f"key '{key}'")
+
+    def test_small_dictionary(self):
+        self.assert_backends_agree({short_code: {"text": short_code.upper(), "preserve_trigger": False}
+                                    for short_code in ["a", "ab", "abc", "abd", "b", "brb", "btw", "zz9"]})
+
+    def test_random_dictionaries(self):
+        for seed in range(4):
+            with self.subTest(seed=seed):
+                self.assert_backends_agree(sample_dictionary(seed, 600))
+
+    def test_streaming_layout(self):
+        self.assert_backends_agree(sample_dictionary(7, 300), streaming=True)
+
+def build_host_lookup(expansions, backend, build_dir):
+    """Compiles src/trie.c and host/trie_lookup.c against tables generated for `backend`. Returns the program."""
+    parsed = {short_code: dict(entry, text=gen_trie.parse_unicode_commands(entry["text"]))
+              for short_code, entry in expansions.items()}
+    with contextlib.redirect_stdout(io.StringIO()):
+        c_code, trie_types = gen_trie.generate_static_trie_c_code(gen_trie.merge_instances([parsed]), backend)
+    build_dir = Path(build_dir)
+    (build_dir / "generated_trie.c").write_text(c_code, encoding="utf-8")
+    (build_dir / "generated_trie.h").write_text(gen_trie.generate_header(trie_types), encoding="utf-8")
+    program = build_dir / "trie_lookup"
+    defines = ["-DCONFIG_ZMK_TEXT_EXPANDER_TRIE_BACKEND_DOUBLE_ARRAY"] if backend == "double-array" else []
+    subprocess.run([HOST_CC, "-std=gnu11", "-O1", "-Wall", "-Werror", *defines, f"-I{build_dir}",
+                    f"-I{SCRIPTS_DIR / 'host'}", f"-I{REPO_DIR / 'include'}", str(REPO_DIR / "src" / "trie.c"),
+                    str(build_dir / "generated_trie.c"), str(SCRIPTS_DIR / "host" / "trie_lookup.c"), "-o", str(program)],
+                   check=True, capture_output=True, text=True)
+    return program
+
+def decode_program(hex_program):
+    """The text a keystroke program printed by trie_lookup types, or None for no terminal."""
+    if hex_program == "-":
+        return None
+    chars = {code: char for char, code in reversed(gen_trie.KEY_TAPS.items())}
+    return "".join(chars.get(byte, "?") for byte in bytes.fromhex(hex_program))
+
+@unittest.skipUnless(HOST_CC, "no host C compiler")
+class HostBuildTest(unittest.TestCase):
+    def assert_firmware_lookups_match(self, expansions):
+        alphabet = sorted({c for short_code in expansions for c in short_code})
+        probes = gen_trie.backend_probes(sorted(expansions), alphabet)
+        prefixes = {short_code[:end] for short_code in expansions for end in range(1, len(short_code) + 1)}
+        expected = [(expansions[key]["text"] if key in expansions else None, key in prefixes) for key in probes]
+        for backend in BACKENDS:
+            with self.subTest(backend=backend), tempfile.TemporaryDirectory() as build_dir:
+                try:
+                    program = build_host_lookup(expansions, backend, build_dir)
+                except subprocess.CalledProcessError as e:
+                    self.fail(f"Building src/trie.c for the {backend} backend failed:\n{e.stderr}")
+                run = subprocess.run([str(program)], input="".join(f"{key}\n" for key in probes),
+                                     check=True, capture_output=True, text=True)
+                self.assertEqual(run.stderr, "")
+                for key, line, (text, is_prefix) in zip(probes, run.stdout.splitlines(), expected):
+                    found, node, cursor = line.split(" ")
+                    self.assertEqual((decode_program(found), node == "1", decode_program(cursor)),
+                                     (text, is_prefix, text), f"{backend} backend, key '{key}'")
+                self.assertEqual(len(run.stdout.splitlines()), len(probes))
+
+    def test_small_dictionary(self):
+        self.assert_firmware_lookups_match({short_code: {"text": short_code.upper(), "preserve_trigger": False}
+                                            for short_code in ["a", "ab", "abc", "abd", "b", "brb", "btw", "zz9"]})
+
+    def test_random_dictionary(self):
+        self.assert_firmware_lookups_match(sample_dictionary(3, 600))
+
+if __name__ == "__main__":
+    unittest.main()
@@ -1,14 +1,12 @@
 #include <zephyr/kernel.h>
-#include <string.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <ctype.h>
+#include <zephyr/sys/byteorder.h>
 #include <zephyr/logging/log.h>
 #include <zmk/hid.h>
-#include <zmk/endpoints.h>
 #include <zmk/expansion_engine.h>
 #include <zmk/hid_utils.h>
 #include <zmk/text_expander.h>
+#include <zmk/trie.h>
+#include <zmk/typing_pace.h>
 
 LOG_MODULE_REGISTER(expansion_engine, LOG_LEVEL_DBG);
 
@@ -18,7 +16,6 @@ static void handle_backspace_press(struct expansion_work *exp_work);
 static void handle_backspace_release(struct expansion_work *exp_work);
 static void handle_start_typing(struct expansion_work *exp_work);
 static void handle_type_char_start(struct expansion_work *exp_work);
-static void handle_type_literal_char(struct expansion_work *exp_work);
 static void handle_type_char_key_press(struct expansion_work *exp_work);
 static void handle_type_char_key_release(struct expansion_work *exp_work);
 static void handle_finish(struct expansion_work *exp_work);
@@ -27,63 +24,268 @@ static void handle_replay_key_release(struct expansion_work *exp_work);
 
 // Unicode state handlers
 static void win_start_unicode_typing(struct expansion_work *exp_work);
-static void handle_win_uni_press_alt(struct expansion_work *exp_work);
+static uint32_t win_discard_unicode_key(const struct expansion_work *exp_work);
 static void handle_win_uni_type_numpad_press(struct expansion_work *exp_work);
 static void handle_win_uni_type_numpad_release(struct expansion_work *exp_work);
-static void handle_win_uni_release_alt(struct expansion_work *exp_work);
 
 static void macos_start_unicode_typing(struct expansion_work *exp_work);
-static void handle_mac_uni_press_option(struct expansion_work *exp_work);
+static uint32_t macos_discard_unicode_key(const struct expansion_work *exp_work);
 static void handle_mac_uni_type_hex_press(struct expansion_work *exp_work);
 static void handle_mac_uni_type_hex_release(struct expansion_work *exp_work);
-static void handle_mac_uni_release_option(struct expansion_work *exp_work);
 
 static void linux_start_unicode_typing(struct expansion_work *exp_work);
-static void handle_linux_uni_press_ctrl_shift(struct expansion_work *exp_work);
+static uint32_t linux_discard_unicode_key(const struct expansion_work *exp_work);
 static void handle_linux_uni_press_u(struct expansion_work *exp_work);
 static void handle_linux_uni_release_u(struct expansion_work *exp_work);
-static void handle_linux_uni_release_ctrl_shift(struct expansion_work *exp_work);
 static void handle_linux_uni_type_hex_press(struct expansion_work *exp_work);
 static void handle_linux_uni_type_hex_release(struct expansion_work *exp_work);
 static void handle_linux_uni_press_terminator(struct expansion_work *exp_work);
 static void handle_linux_uni_release_terminator(struct expansion_work *exp_work);
 
 
-static uint32_t get_numpad_keycode(char digit);
-static uint32_t get_hex_keycode(char hex_digit);
+static uint32_t get_numpad_keycode(uint8_t digit);
+static uint32_t get_hex_keycode(uint8_t digit);
+
+// Queues the work handler to run after `delay_us`, or right away if a
+// preemption is waiting.
+static void schedule_work(struct expansion_work *exp_work, uint32_t delay_us) {
+    if (exp_work->preemption != EXPANSION_PREEMPT_NONE && !exp_work->preempted) {
+        delay_us = 0;
+    }
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_LATENESS_STATS
+    exp_work->due_ticks = k_uptime_ticks() + k_us_to_ticks_ceil64(delay_us);
+#endif
+    k_work_reschedule_for_queue(EXPANSION_WORK_Q, &exp_work->work, K_USEC(delay_us));
+}
+
+// Runs the next state after `delay_us`. A step with no delay runs in the same
+// invocation of the work handler instead of going back through the workqueue.
+static void schedule_step(struct expansion_work *exp_work, uint32_t delay_us) {
+    if (delay_us == 0) {
+        exp_work->step_now = true;
+    } else {
+        schedule_work(exp_work, delay_us);
+    }
+}
+
+// Runs the next state after the wait for a report of `phase`.
+static void schedule_phase(struct expansion_work *exp_work, enum typing_phase phase) {
+    schedule_step(exp_work, typing_pace_phase_us(phase));
+}
 
 // OS Driver Implementations
-const struct os_typing_driver win_driver = { .start_unicode_typing = win_start_unicode_typing };
-const struct os_typing_driver mac_driver = { .start_unicode_typing = macos_start_unicode_typing };
-const struct os_typing_driver linux_driver = { .start_unicode_typing = linux_start_unicode_typing };
+const struct os_typing_driver win_driver = { .start_unicode_typing = win_start_unicode_typing,
+                                             .discard_unicode_key = win_discard_unicode_key,
+                                             .word_delete_mods = MOD_LCTL };
+const struct os_typing_driver mac_driver = { .start_unicode_typing = macos_start_unicode_typing,
+                                             .discard_unicode_key = macos_discard_unicode_key,
+                                             .word_delete_mods = MOD_LALT };
+const struct os_typing_driver linux_driver = { .start_unicode_typing = linux_start_unicode_typing,
+                                               .discard_unicode_key = linux_discard_unicode_key,
+                                               .word_delete_mods = MOD_LCTL };
+
+enum char_class {
+    CHAR_CLASS_OTHER,
+    CHAR_CLASS_SPACE,
+    CHAR_CLASS_WORD,
+};
+
+// Word-delete chords agree across systems on letters, digits and single
+// spaces, so anything else ends the words that can be deleted with them.
+static enum char_class tap_class(uint32_t usage, bool shift) {
+    if (usage >= HID_USAGE_KEY_KEYBOARD_A && usage <= HID_USAGE_KEY_KEYBOARD_Z) {
+        return CHAR_CLASS_WORD;
+    }
+    if (shift) {
+        return CHAR_CLASS_OTHER;
+    }
+    if (usage >= HID_USAGE_KEY_KEYBOARD_1_AND_EXCLAMATION && usage <= HID_USAGE_KEY_KEYBOARD_0_AND_RIGHT_PARENTHESIS) {
+        return CHAR_CLASS_WORD;
+    }
+    return usage == HID_USAGE_KEY_KEYBOARD_SPACEBAR ? CHAR_CLASS_SPACE : CHAR_CLASS_OTHER;
+}
+
+// Takes the next character the expansion types into account. A backspace
+// in the expansion is a character of no class, which keeps this conservative.
+static void track_words(struct expansion_work *exp_work, enum char_class class) {
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_WORD_DELETE
+    struct expansion_words *words = &exp_work->typed_words;
+    switch (class) {
+    case CHAR_CLASS_WORD:
+        if (words->prev_class == CHAR_CLASS_SPACE) {
+            // The word before, if it counts, is whole now.
+            if (words->last_chars > 0 && words->last_spaces == 1) {
+                words->count++;
+                words->chars += words->last_chars;
+            } else {
+                words->count = 0;
+                words->chars = 0;
+            }
+            words->last_chars = 1;
+            words->last_spaces = 0;
+        } else if (words->last_chars > 0) {
+            words->last_chars++;
+        }
+        break;
+    case CHAR_CLASS_SPACE:
+        if (words->last_chars > 0) {
+            words->last_chars++;
+            words->last_spaces = MIN(words->last_spaces + 1, 2);
+        }
+        break;
+    default:
+        *words = (struct expansion_words){0};
+        break;
+    }
+    words->prev_class = class;
+#endif
+}
 
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_WORD_DELETE
+// Whole words at the end of what the expansion typed, and their characters in `chars`.
+static uint16_t typed_tail_words(const struct expansion_work *exp_work, uint16_t *chars) {
+    const struct expansion_words *words = &exp_work->typed_words;
+    if (words->last_chars == 0 || words->last_spaces > 1) {
+        *chars = 0;
+        return 0;
+    }
+    *chars = words->chars + words->last_chars;
+    return words->count + 1;
+}
+#endif
 
-static void clear_shift_if_active(struct expansion_work *exp_work) {
-    if (exp_work->shift_mod_active) {
-        LOG_DBG("Clearing active shift modifier.");
-        zmk_hid_unregister_mods(MOD_LSFT);
-        zmk_endpoints_send_report(HID_USAGE_KEY);
-        exp_work->shift_mod_active = false;
+
+// Stages pressing or releasing `mods` in the current report transaction.
+static void stage_mods(struct expansion_work *exp_work, uint8_t mods, bool pressed) {
+    hid_report_stage_mods(mods, pressed);
+    exp_work->held_mods = pressed ? (exp_work->held_mods | mods) : (exp_work->held_mods & ~mods);
+}
+
+static bool shift_held(const struct expansion_work *exp_work) {
+    return exp_work->held_mods & MOD_LSFT;
+}
+
+// Stages holding or releasing Shift in the current report transaction.
+static void stage_shift(struct expansion_work *exp_work, bool shift) {
+    if (shift != shift_held(exp_work)) {
+        stage_mods(exp_work, MOD_LSFT, shift);
+    }
+}
+
+// Stages releasing the taps of the last burst.
+static void release_held_keys(struct expansion_work *exp_work) {
+    for (uint8_t i = 0; i < exp_work->num_held_keys; i++) {
+        hid_report_stage_key(exp_work->held_keys[i], false);
     }
+    exp_work->num_held_keys = 0;
+}
+
+// Releases every key and modifier the expansion holds down, in one report. If
+// the endpoint turns it down, the next report sent carries the release.
+static void release_all(struct expansion_work *exp_work) {
+    hid_report_begin();
+    if (exp_work->current_keycode > 0) {
+        LOG_DBG("Releasing potentially stuck keycode: 0x%04X", exp_work->current_keycode);
+        hid_report_stage_key(exp_work->current_keycode, false);
+        exp_work->current_keycode = 0;
+    }
+    release_held_keys(exp_work);
+    if (exp_work->held_mods) {
+        stage_mods(exp_work, exp_work->held_mods, false);
+    }
+    hid_report_commit();
+}
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_LATENESS_STATS
+// Counts how long after its scheduled time the work handler ran.
+static void record_lateness(struct expansion_work *exp_work) {
+    struct expansion_lateness *stats = &exp_work->lateness;
+    int64_t late_ticks = k_uptime_ticks() - exp_work->due_ticks;
+    uint32_t late_us = late_ticks > 0 ? (uint32_t)k_ticks_to_us_floor64(late_ticks) : 0;
+    stats->steps++;
+    stats->total_us += late_us;
+    stats->max_us = MAX(stats->max_us, late_us);
+}
+#endif
+
+static void end_expansion(struct expansion_work *exp_work) {
+    exp_work->reports_sent = hid_report_count() - exp_work->first_report;
+    exp_work->state = EXPANSION_STATE_IDLE;
+    LOG_INF("Expansion finished: %u reports in %lld ms", exp_work->reports_sent,
+            k_uptime_get() - exp_work->start_time_ms);
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_LATENESS_STATS
+    const struct expansion_lateness *stats = &exp_work->lateness;
+    LOG_INF("Step lateness: %u steps, mean %u us, max %u us", stats->steps,
+            stats->steps ? (uint32_t)(stats->total_us / stats->steps) : 0, stats->max_us);
+#endif
+    text_expander_resume();
+}
+
+// Ends the expansion once its last report has gone out. If the endpoint turned
+// it down, the work handler sends it again first, so no key stays held.
+static void end_after_last_report(struct expansion_work *exp_work) {
+    if (!hid_report_pending()) {
+        end_expansion(exp_work);
+        return;
+    }
+    exp_work->state = EXPANSION_STATE_END;
+    schedule_work(exp_work, typing_pace_delay_us());
 }
 
 void cancel_current_expansion(struct expansion_work *work_item) {
     if (k_work_cancel_delayable(&work_item->work) >= 0) {
         LOG_INF("Cancelling current expansion work.");
-        if (work_item->current_keycode > 0) {
-            LOG_DBG("Releasing potentially stuck keycode: 0x%04X", work_item->current_keycode);
-            send_and_flush_key_action(work_item->current_keycode, false);
-        }
-        clear_shift_if_active(work_item);
+        release_all(work_item);
         work_item->state = EXPANSION_STATE_IDLE;
-        work_item->current_keycode = 0;
+        if (hid_report_pending()) {
+            work_item->state = EXPANSION_STATE_END;
+            schedule_work(work_item, typing_pace_delay_us());
+        }
     }
 }
 
-void expansion_work_handler(struct k_work *work) {
-    struct k_work_delayable *delayable_work = k_work_delayable_from_work(work);
-    struct expansion_work *exp_work = CONTAINER_OF(delayable_work, struct expansion_work, work);
+void preempt_current_expansion(struct expansion_work *work_item, enum expansion_preemption reason) {
+    if (work_item->state == EXPANSION_STATE_IDLE || work_item->state == EXPANSION_STATE_END ||
+        work_item->preemption != EXPANSION_PREEMPT_NONE) {
+        return;
+    }
+    work_item->preemption_ticks = k_uptime_ticks();
+    work_item->preemption = reason;
+    k_work_reschedule_for_queue(EXPANSION_WORK_Q, &work_item->work, K_NO_WAIT);
+}
+
+static const char *const preemption_names[] = {
+    [EXPANSION_PREEMPT_KEY_PRESS] = "a key press",
+    [EXPANSION_PREEMPT_ABORT_KEY] = "the abort key",
+    [EXPANSION_PREEMPT_LAYER_CHANGE] = "a layer change",
+    [EXPANSION_PREEMPT_REPORT_FAILED] = "the endpoint turning down reports",
+};
+
+// Stops the expansion where it is. A Unicode sequence stopped halfway may
+// leave the input method waiting, or type a wrong character once its
+// modifier goes up; the replay states then tap the key that discards it.
+static void stop_preempted_expansion(struct expansion_work *exp_work) {
+    uint32_t discard_key = 0;
+    if (exp_work->state > EXPANSION_STATE_UNICODE_START) {
+        discard_key = expander_data.os_driver->discard_unicode_key(exp_work);
+    }
+    release_all(exp_work);
+    exp_work->preempted = true;
+    LOG_INF("Expansion stopped by %s after %u us: %u of %u backspaces and %u characters typed",
+            preemption_names[exp_work->preemption],
+            (uint32_t)k_ticks_to_us_floor64(k_uptime_ticks() - exp_work->preemption_ticks),
+            exp_work->backspaces_sent, exp_work->backspaces_sent + exp_work->backspace_count,
+            exp_work->chars_typed);
+    if (discard_key) {
+        exp_work->trigger_keycode_to_replay = discard_key;
+        exp_work->state = EXPANSION_STATE_REPLAY_KEY_PRESS;
+        schedule_work(exp_work, typing_pace_phase_us(TYPING_PHASE_MODIFIER));
+    } else {
+        end_after_last_report(exp_work);
+    }
+}
 
+static void run_state(struct expansion_work *exp_work) {
     LOG_DBG("Expansion engine state: %d", exp_work->state);
 
     switch (exp_work->state) {
@@ -92,32 +294,26 @@ void expansion_work_handler(struct k_work *work) {
         case EXPANSION_STATE_BACKSPACE_RELEASE:     handle_backspace_release(exp_work);    break;
         case EXPANSION_STATE_START_TYPING:          handle_start_typing(exp_work);         break;
         case EXPANSION_STATE_TYPE_CHAR_START:       handle_type_char_start(exp_work);      break;
-        case EXPANSION_STATE_TYPE_LITERAL_CHAR:     handle_type_literal_char(exp_work);    break;
         case EXPANSION_STATE_TYPE_CHAR_KEY_PRESS:   handle_type_char_key_press(exp_work);  break;
         case EXPANSION_STATE_TYPE_CHAR_KEY_RELEASE: handle_type_char_key_release(exp_work);break;
         case EXPANSION_STATE_FINISH:                handle_finish(exp_work);               break;
         case EXPANSION_STATE_REPLAY_KEY_PRESS:      handle_replay_key_press(exp_work);     break;
         case EXPANSION_STATE_REPLAY_KEY_RELEASE:    handle_replay_key_release(exp_work);   break;
+        case EXPANSION_STATE_END:                   end_expansion(exp_work);               break;
 
         case EXPANSION_STATE_UNICODE_START:         expander_data.os_driver->start_unicode_typing(exp_work); break;
 
         // Windows
-        case EXPANSION_STATE_WIN_UNI_PRESS_ALT:          handle_win_uni_press_alt(exp_work); break;
         case EXPANSION_STATE_WIN_UNI_TYPE_NUMPAD_PRESS:  handle_win_uni_type_numpad_press(exp_work); break;
         case EXPANSION_STATE_WIN_UNI_TYPE_NUMPAD_RELEASE:handle_win_uni_type_numpad_release(exp_work); break;
-        case EXPANSION_STATE_WIN_UNI_RELEASE_ALT:        handle_win_uni_release_alt(exp_work); break;
 
         // macOS
-        case EXPANSION_STATE_MAC_UNI_PRESS_OPTION:        handle_mac_uni_press_option(exp_work); break;
         case EXPANSION_STATE_MAC_UNI_TYPE_HEX_PRESS:      handle_mac_uni_type_hex_press(exp_work); break;
         case EXPANSION_STATE_MAC_UNI_TYPE_HEX_RELEASE:    handle_mac_uni_type_hex_release(exp_work); break;
-        case EXPANSION_STATE_MAC_UNI_RELEASE_OPTION:      handle_mac_uni_release_option(exp_work); break;
 
         // Linux
-        case EXPANSION_STATE_LINUX_UNI_PRESS_CTRL_SHIFT:    handle_linux_uni_press_ctrl_shift(exp_work); break;
         case EXPANSION_STATE_LINUX_UNI_PRESS_U:             handle_linux_uni_press_u(exp_work); break;
         case EXPANSION_STATE_LINUX_UNI_RELEASE_U:           handle_linux_uni_release_u(exp_work); break;
-        case EXPANSION_STATE_LINUX_UNI_RELEASE_CTRL_SHIFT:  handle_linux_uni_release_ctrl_shift(exp_work); break;
         case EXPANSION_STATE_LINUX_UNI_TYPE_HEX_PRESS:      handle_linux_uni_type_hex_press(exp_work); break;
         case EXPANSION_STATE_LINUX_UNI_TYPE_HEX_RELEASE:    handle_linux_uni_type_hex_release(exp_work); break;
         case EXPANSION_STATE_LINUX_UNI_PRESS_TERMINATOR:    handle_linux_uni_press_terminator(exp_work); break;
@@ -130,31 +326,109 @@ void expansion_work_handler(struct k_work *work) {
     }
 }
 
+void expansion_work_handler(struct k_work *work) {
+    struct k_work_delayable *delayable_work = k_work_delayable_from_work(work);
+    struct expansion_work *exp_work = CONTAINER_OF(delayable_work, struct expansion_work, work);
+
+    // A preemption can be requested just as the expansion ends.
+    if (exp_work->state == EXPANSION_STATE_IDLE) {
+        return;
+    }
+    if (exp_work->preemption != EXPANSION_PREEMPT_NONE && !exp_work->preempted) {
+        stop_preempted_expansion(exp_work);
+        return;
+    }
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_LATENESS_STATS
+    record_lateness(exp_work);
+#endif
+
+    // A report the endpoint turned down goes out again before the next step,
+    // waiting longer after each attempt. If the endpoint keeps turning it down,
+    // the expansion is stopped rather than typed with a character missing.
+    if (hid_report_pending()) {
+        if (hid_report_commit() == 0) {
+            exp_work->report_retries = 0;
+            schedule_work(exp_work, typing_pace_delay_us());
+        } else if (exp_work->report_retries < EXPANSION_MAX_REPORT_RETRIES) {
+            exp_work->report_retries++;
+            schedule_work(exp_work, typing_pace_retry_us(exp_work->report_retries));
+        } else if (!exp_work->preempted) {
+            LOG_WRN("Endpoint turned down a report %d retries in a row, stopping the expansion.", exp_work->report_retries);
+            exp_work->report_retries = 0;
+            exp_work->preemption_ticks = k_uptime_ticks();
+            exp_work->preemption = EXPANSION_PREEMPT_REPORT_FAILED;
+            stop_preempted_expansion(exp_work);
+        } else {
+            // Already stopping and still turned down. The report stays pending
+            // and goes out with the next one sent, whoever sends it.
+            release_all(exp_work);
+            end_expansion(exp_work);
+        }
+        return;
+    }
+
+    // Steps that send nothing, and steps after which the profile has no wait,
+    // run back to back here. A report the endpoint turned down stops them, so
+    // the next step cannot overwrite it; it goes out again first.
+    for (uint8_t steps = 0; steps < EXPANSION_MAX_INLINE_STEPS; steps++) {
+        exp_work->step_now = false;
+        run_state(exp_work);
+        if (!exp_work->step_now) {
+            return;
+        }
+        if (hid_report_pending()) {
+            schedule_work(exp_work, typing_pace_delay_us());
+            return;
+        }
+        if (exp_work->preemption != EXPANSION_PREEMPT_NONE && !exp_work->preempted) {
+            stop_preempted_expansion(exp_work);
+            return;
+        }
+    }
+    // Lets the rest of the workqueue run before going on.
+    schedule_work(exp_work, 0);
+}
+
 static void handle_start_backspace(struct expansion_work *exp_work) {
     if (exp_work->backspace_count > 0) {
         LOG_DBG("Starting backspace sequence, %d to go.", exp_work->backspace_count);
         exp_work->state = EXPANSION_STATE_BACKSPACE_PRESS;
-        k_work_reschedule(&exp_work->work, K_NO_WAIT);
     } else {
         LOG_DBG("No backspaces needed, starting typing.");
         exp_work->state = EXPANSION_STATE_START_TYPING;
-        k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
     }
+    schedule_step(exp_work, 0);
 }
 
+// A word-delete chord presses the driver's modifiers with Backspace.
 static void handle_backspace_press(struct expansion_work *exp_work) {
     LOG_DBG("Pressing backspace");
-    send_and_flush_key_action(HID_USAGE_KEY_KEYBOARD_DELETE_BACKSPACE, true);
+    hid_report_begin();
+    if (exp_work->word_deletes > 0) {
+        stage_mods(exp_work, expander_data.os_driver->word_delete_mods, true);
+    }
+    exp_work->current_keycode = HID_USAGE_KEY_KEYBOARD_DELETE_BACKSPACE;
+    hid_report_stage_key(exp_work->current_keycode, true);
+    hid_report_commit();
     exp_work->state = EXPANSION_STATE_BACKSPACE_RELEASE;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY / 2));
+    schedule_phase(exp_work, TYPING_PHASE_KEY_PRESS);
 }
 
 static void handle_backspace_release(struct expansion_work *exp_work) {
     LOG_DBG("Releasing backspace");
-    send_and_flush_key_action(HID_USAGE_KEY_KEYBOARD_DELETE_BACKSPACE, false);
+    hid_report_begin();
+    hid_report_stage_key(HID_USAGE_KEY_KEYBOARD_DELETE_BACKSPACE, false);
+    if (exp_work->word_deletes > 0) {
+        stage_mods(exp_work, expander_data.os_driver->word_delete_mods, false);
+        exp_work->word_deletes--;
+    }
+    hid_report_commit();
+    exp_work->current_keycode = 0;
     exp_work->backspace_count--;
+    exp_work->backspaces_sent++;
     exp_work->state = EXPANSION_STATE_START_BACKSPACE;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY / 2));
+    schedule_phase(exp_work, exp_work->backspace_count > 0 ? TYPING_PHASE_KEY_RELEASE : TYPING_PHASE_GAP);
 }
 
 static void handle_start_typing(struct expansion_work *exp_work) {
@@ -162,352 +436,449 @@ static void handle_start_typing(struct expansion_work *exp_work) {
     handle_type_char_start(exp_work);
 }
 
-static void handle_type_char_start(struct expansion_work *exp_work) {
-    const char *text = exp_work->expanded_text;
-    size_t len = strlen(text);
-
-    if (exp_work->text_index >= len) {
-        LOG_DBG("End of expansion string reached.");
-        exp_work->state = EXPANSION_STATE_FINISH;
-        k_work_reschedule(&exp_work->work, K_NO_WAIT);
+// Starts typing fragment `index`, resuming the current program when it is done.
+static void enter_fragment(struct expansion_work *exp_work, uint16_t index) {
+    const uint8_t *fragment = trie_get_fragment(index);
+    if (!fragment) {
+        return;
+    }
+    if (exp_work->ref_depth >= EXPANSION_MAX_REF_DEPTH) {
+        LOG_WRN("Fragment references nested deeper than %d, skipping fragment %u.", EXPANSION_MAX_REF_DEPTH, index);
         return;
     }
+    exp_work->ref_stack[exp_work->ref_depth++] = exp_work->keys;
+    exp_work->keys = fragment;
+}
 
-    if (strncmp(&text[exp_work->text_index], "{{{", 3) == 0) {
-        const char *end = strstr(&text[exp_work->text_index + 3], "}}}");
-        if (end) {
-            exp_work->text_index += 3;
-            exp_work->literal_end_index = end - text;
-            exp_work->state = EXPANSION_STATE_TYPE_LITERAL_CHAR;
-            k_work_reschedule(&exp_work->work, K_NO_WAIT);
-            return;
+// Returns the next opcode to run, or NULL at the end of the expansion. It is in
+// the rest of the phrase being typed, or in the program, entering the phrase
+// when the program continues with a phrase token. A finished fragment returns
+// to the program that referenced it.
+static const uint8_t *current_keys(struct expansion_work *exp_work) {
+    if (exp_work->phrase_left > 0) {
+        return exp_work->phrase;
+    }
+    while (*exp_work->keys == TRIE_OP_END && exp_work->ref_depth > 0) {
+        exp_work->keys = exp_work->ref_stack[--exp_work->ref_depth];
+    }
+    if (trie_is_phrase_token(exp_work->keys)) {
+        uint8_t len;
+        const uint8_t *phrase = trie_get_phrase(exp_work->keys, &len);
+        if (!phrase || len == 0) {
+            return NULL;
         }
+        exp_work->keys += TRIE_PHRASE_TOKEN_LEN;
+        exp_work->phrase = phrase;
+        exp_work->phrase_left = len;
+        return phrase;
     }
+    return *exp_work->keys == TRIE_OP_END ? NULL : exp_work->keys;
+}
 
-    if (strncmp(&text[exp_work->text_index], "{{", 2) == 0) {
-        const char *end = strstr(&text[exp_work->text_index + 2], "}}");
-        if (end) {
-            size_t cmd_len = end - (text + exp_work->text_index + 2);
-            char cmd_buf[16];
-            if (cmd_len >= sizeof(cmd_buf)) { cmd_len = sizeof(cmd_buf) - 1; }
-            
-            strncpy(cmd_buf, &text[exp_work->text_index + 2], cmd_len);
-            cmd_buf[cmd_len] = '\0';
-            exp_work->text_index += cmd_len + 4;
-
-            LOG_DBG("Parsed command: \"%s\"", cmd_buf);
-            
-            // --- MODIFIED --- The logic for {{u:XXXX}} is now removed from the C code.
-            if (strncmp(cmd_buf, "cmd:", 4) == 0) {
-                if (strcmp(&cmd_buf[4], "win") == 0) expander_data.os_driver = &win_driver;
-                else if (strcmp(&cmd_buf[4], "mac") == 0) expander_data.os_driver = &mac_driver;
-                else if (strcmp(&cmd_buf[4], "linux") == 0) expander_data.os_driver = &linux_driver;
-                LOG_INF("Set OS-specific typing driver.");
-                exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
-            } else {
-                LOG_WRN("Unknown command: %s", cmd_buf);
-                exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
-            }
-            k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
-            return;
+// Consumes the opcode returned by current_keys() and its `count` - 1 operand bytes.
+static void advance_keys(struct expansion_work *exp_work, uint8_t count) {
+    if (exp_work->phrase_left > 0) {
+        count = MIN(count, exp_work->phrase_left);
+        exp_work->phrase += count;
+        exp_work->phrase_left -= count;
+    } else {
+        exp_work->keys += count;
+    }
+}
+
+// Runs the next opcode. The generator resolved commands and codepoints when it
+// compiled the program, so this is a constant amount of work per key.
+static void handle_type_char_start(struct expansion_work *exp_work) {
+    const uint8_t *op = current_keys(exp_work);
+
+    // The last burst is still down: more taps release it in the report that
+    // presses them, anything else waits for a report that only releases it.
+    if (exp_work->num_held_keys > 0) {
+        if (op && TRIE_OP_IS_KEY(*op)) {
+            handle_type_char_key_press(exp_work);
+        } else {
+            handle_type_char_key_release(exp_work);
         }
+        return;
+    }
+
+    if (!op) {
+        LOG_DBG("End of expansion reached.");
+        exp_work->state = EXPANSION_STATE_FINISH;
+        schedule_step(exp_work, 0);
+        return;
     }
-    
-    uint8_t first_byte = text[exp_work->text_index];
 
-    if (first_byte < 0x80) { // Standard ASCII
-        exp_work->current_keycode = char_to_keycode(first_byte, &exp_work->current_char_needs_shift);
+    if (TRIE_OP_IS_KEY(*op)) {
         exp_work->state = EXPANSION_STATE_TYPE_CHAR_KEY_PRESS;
-        k_work_reschedule(&exp_work->work, K_MSEC(1));
+        schedule_step(exp_work, 0);
         return;
-    } else { // Multi-byte UTF-8 sequence
-        uint32_t codepoint = 0;
-        int utf8_len = 0;
-
-        if ((first_byte & 0xE0) == 0xC0) { // 2-byte
-            utf8_len = 2;
-            codepoint = (first_byte & 0x1F) << 6;
-        } else if ((first_byte & 0xF0) == 0xE0) { // 3-byte
-            utf8_len = 3;
-            codepoint = (first_byte & 0x0F) << 12;
-        } else if ((first_byte & 0xF8) == 0xF0) { // 4-byte
-            utf8_len = 4;
-            codepoint = (first_byte & 0x07) << 18;
-        }
+    }
 
-        if (utf8_len > 0 && (exp_work->text_index + utf8_len) <= len) {
-            for (int i = 1; i < utf8_len; i++) {
-                uint8_t cont_byte = text[exp_work->text_index + i];
-                if ((cont_byte & 0xC0) == 0x80) {
-                    codepoint |= (cont_byte & 0x3F) << (6 * (utf8_len - 1 - i));
-                } else {
-                    codepoint = 0; // Invalid sequence
-                    break;
-                }
-            }
-            if (codepoint != 0) {
-                LOG_DBG("Decoded UTF-8 codepoint: U+%04X", codepoint);
-                exp_work->unicode_codepoint = codepoint;
-                exp_work->text_index += utf8_len; // Consume all bytes of the char
-                exp_work->state = EXPANSION_STATE_UNICODE_START;
-                k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
-                return;
-            }
-        }
-        
-        // Invalid or incomplete UTF-8 sequence, skip and continue
-        LOG_WRN("Invalid UTF-8 sequence at index %d", exp_work->text_index);
-        exp_work->text_index++;
+    switch (*op) {
+    case TRIE_OP_UNICODE:
+        exp_work->unicode_codepoint = sys_get_le24(&op[1]);
+        advance_keys(exp_work, TRIE_OP_UNICODE_LEN);
+        track_words(exp_work, CHAR_CLASS_OTHER);
+        LOG_DBG("Typing codepoint U+%04X", exp_work->unicode_codepoint);
+        exp_work->state = EXPANSION_STATE_UNICODE_START;
+        schedule_step(exp_work, 0);
+        return;
+    case TRIE_OP_OS_WINDOWS:
+    case TRIE_OP_OS_MACOS:
+    case TRIE_OP_OS_LINUX:
+        expander_data.os_driver = *op == TRIE_OP_OS_WINDOWS ? &win_driver
+                                  : *op == TRIE_OP_OS_MACOS ? &mac_driver
+                                                            : &linux_driver;
+        advance_keys(exp_work, 1);
+        LOG_INF("Set OS-specific typing driver.");
         exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
-        k_work_reschedule(&exp_work->work, K_NO_WAIT);
+        schedule_step(exp_work, 0);
+        return;
+    case TRIE_OP_REF: {
+        uint16_t index = sys_get_le16(&op[1]);
+        advance_keys(exp_work, TRIE_OP_REF_LEN);
+        enter_fragment(exp_work, index);
+        exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
+        schedule_step(exp_work, 0);
+        return;
+    }
+    default:
+        // The operands of an unknown opcode cannot be skipped, so nothing after it can be typed.
+        LOG_WRN("Unknown opcode 0x%02X, ending the expansion.", *op);
+        exp_work->state = EXPANSION_STATE_FINISH;
+        schedule_step(exp_work, 0);
         return;
     }
 }
 
-static void handle_type_literal_char(struct expansion_work *exp_work) {
-    if (exp_work->text_index >= exp_work->literal_end_index) {
-        exp_work->text_index += 3; // Skip the closing "}}}"
-        exp_work->literal_end_index = 0;
-        exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
-        k_work_reschedule(&exp_work->work, K_NO_WAIT);
-        return;
+// Letters only differ in case by Shift, so casing the expansion is a matter of holding it.
+static bool tap_needs_shift(const struct expansion_work *exp_work, uint8_t op) {
+    uint8_t usage = op & TRIE_KEY_USAGE_MASK;
+    if (exp_work->letter_case != EXPANSION_CASE_AS_IS && usage >= HID_USAGE_KEY_KEYBOARD_A &&
+        usage <= HID_USAGE_KEY_KEYBOARD_Z) {
+        return true;
+    }
+    return op & TRIE_KEY_SHIFT;
+}
+
+static bool is_held(const struct expansion_work *exp_work, uint8_t usage) {
+    for (uint8_t i = 0; i < exp_work->num_held_keys; i++) {
+        if (exp_work->held_keys[i] == usage) {
+            return true;
+        }
     }
-    
-    char char_to_type = exp_work->expanded_text[exp_work->text_index];
-    exp_work->current_keycode = char_to_keycode(char_to_type, &exp_work->current_char_needs_shift);
-    exp_work->state = EXPANSION_STATE_TYPE_CHAR_KEY_PRESS;
-    k_work_reschedule(&exp_work->work, K_MSEC(1));
+    return false;
 }
 
+// Presses the next taps of the program in one report, releasing the last burst
+// in the same report. A burst is a run of taps with the same Shift state and
+// ascending usages: hosts read the keys a report adds in usage order (NKRO) or
+// slot order (6KRO, filled in press order), so both read the run in order. A
+// key that is still down, or a Shift change, needs a release report first.
 static void handle_type_char_key_press(struct expansion_work *exp_work) {
-    if (exp_work->current_char_needs_shift && !exp_work->shift_mod_active) {
-        zmk_hid_register_mods(MOD_LSFT);
-        exp_work->shift_mod_active = true;
-    } else if (!exp_work->current_char_needs_shift && exp_work->shift_mod_active) {
-        zmk_hid_unregister_mods(MOD_LSFT);
-        exp_work->shift_mod_active = false;
-    }
-    
-    if (exp_work->current_keycode > 0) {
-        send_and_flush_key_action(exp_work->current_keycode, true);
+    const uint8_t *op = current_keys(exp_work);
+    bool shift = tap_needs_shift(exp_work, *op);
+    if (exp_work->num_held_keys > 0 &&
+        (shift != shift_held(exp_work) || is_held(exp_work, *op & TRIE_KEY_USAGE_MASK))) {
+        handle_type_char_key_release(exp_work);
+        return;
+    }
+
+    uint8_t burst[EXPANSION_BURST_MAX_KEYS];
+    uint8_t burst_len = 0;
+    while (op && TRIE_OP_IS_KEY(*op) && burst_len < EXPANSION_BURST_MAX_KEYS) {
+        uint8_t usage = *op & TRIE_KEY_USAGE_MASK;
+        if ((burst_len > 0 && usage <= burst[burst_len - 1]) || is_held(exp_work, usage) ||
+            tap_needs_shift(exp_work, *op) != shift) {
+            break;
+        }
+        if (exp_work->letter_case == EXPANSION_CASE_CAPITALIZE && usage >= HID_USAGE_KEY_KEYBOARD_A &&
+            usage <= HID_USAGE_KEY_KEYBOARD_Z) {
+            exp_work->letter_case = EXPANSION_CASE_AS_IS;
+        }
+        burst[burst_len++] = usage;
+        track_words(exp_work, tap_class(usage, shift));
+        advance_keys(exp_work, 1);
+        op = current_keys(exp_work);
+    }
+
+    hid_report_begin();
+    release_held_keys(exp_work);
+    stage_shift(exp_work, shift);
+    for (uint8_t i = 0; i < burst_len; i++) {
+        hid_report_stage_key(burst[i], true);
+        exp_work->held_keys[exp_work->num_held_keys++] = burst[i];
     }
+    hid_report_commit();
+    exp_work->chars_typed += burst_len;
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_BURST_TYPING
+    // The next report releases the burst, together with pressing the next one if it can.
+    exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
+#else
     exp_work->state = EXPANSION_STATE_TYPE_CHAR_KEY_RELEASE;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY / 2));
+#endif
+    schedule_phase(exp_work, TYPING_PHASE_KEY_PRESS);
 }
 
+// Releases the last burst, and Shift with it unless the next tap needs it, so
+// a run of capitals holds Shift once.
 static void handle_type_char_key_release(struct expansion_work *exp_work) {
-    if (exp_work->current_keycode > 0) {
-        send_and_flush_key_action(exp_work->current_keycode, false);
-        exp_work->current_keycode = 0;
-    }
-    if (exp_work->state != EXPANSION_STATE_UNICODE_START) {
-       exp_work->text_index++;
+    const uint8_t *op = current_keys(exp_work);
+    hid_report_begin();
+    release_held_keys(exp_work);
+    if (!op || !TRIE_OP_IS_KEY(*op) || !tap_needs_shift(exp_work, *op)) {
+        stage_shift(exp_work, false);
     }
-
-    exp_work->state = (exp_work->literal_end_index > 0) ? EXPANSION_STATE_TYPE_LITERAL_CHAR : EXPANSION_STATE_TYPE_CHAR_START;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY / 2));
+    hid_report_commit();
+    exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
+    schedule_phase(exp_work, TYPING_PHASE_KEY_RELEASE);
 }
 
 static void handle_finish(struct expansion_work *exp_work) {
-    clear_shift_if_active(exp_work);
+    uint32_t reports = hid_report_count();
+    hid_report_begin();
+    stage_shift(exp_work, false);
+    hid_report_commit();
     if (exp_work->trigger_keycode_to_replay > 0) {
+        // The last report already waited for its release unless Shift went up just now.
         exp_work->state = EXPANSION_STATE_REPLAY_KEY_PRESS;
-        k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY / 2));
+        if (hid_report_count() != reports) {
+            schedule_phase(exp_work, TYPING_PHASE_KEY_RELEASE);
+        } else {
+            schedule_step(exp_work, 0);
+        }
     } else {
-        exp_work->state = EXPANSION_STATE_IDLE;
+        end_after_last_report(exp_work);
     }
 }
 
 static void handle_replay_key_press(struct expansion_work *exp_work) {
-    send_and_flush_key_action(exp_work->trigger_keycode_to_replay, true);
+    exp_work->current_keycode = exp_work->trigger_keycode_to_replay;
+    send_and_flush_key_action(exp_work->current_keycode, true);
+    track_words(exp_work, tap_class(exp_work->current_keycode, false));
     exp_work->state = EXPANSION_STATE_REPLAY_KEY_RELEASE;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY / 2));
+    schedule_phase(exp_work, TYPING_PHASE_KEY_PRESS);
 }
 
 static void handle_replay_key_release(struct expansion_work *exp_work) {
     send_and_flush_key_action(exp_work->trigger_keycode_to_replay, false);
-    exp_work->state = EXPANSION_STATE_IDLE;
+    exp_work->current_keycode = 0;
+    end_after_last_report(exp_work);
+}
+
+// Sets the digits of the codepoint in `base`, at least `min_digits` of them.
+static void set_unicode_digits(struct expansion_work *exp_work, uint8_t base, uint8_t min_digits) {
+    uint8_t reversed[sizeof(exp_work->unicode_digits)];
+    uint8_t count = 0;
+    uint32_t value = exp_work->unicode_codepoint;
+    do {
+        reversed[count++] = value % base;
+        value /= base;
+    } while ((value > 0 || count < min_digits) && count < sizeof(reversed));
+    for (uint8_t i = 0; i < count; i++) {
+        exp_work->unicode_digits[i] = reversed[count - 1 - i];
+    }
+    exp_work->unicode_num_digits = count;
+    exp_work->unicode_digit_index = 0;
 }
 
+// The input method's modifiers go down with the first key of the sequence and
+// up with its last, in the same reports.
+
 // Windows Unicode Handlers
 static void win_start_unicode_typing(struct expansion_work *exp_work) {
-    snprintf(exp_work->unicode_hex_buffer, sizeof(exp_work->unicode_hex_buffer), "%u", exp_work->unicode_codepoint);
-    exp_work->unicode_hex_index = 0;
-    exp_work->state = EXPANSION_STATE_WIN_UNI_PRESS_ALT;
-    k_work_reschedule(&exp_work->work, K_NO_WAIT);
-}
-static void handle_win_uni_press_alt(struct expansion_work *exp_work) {
-    zmk_hid_register_mods(MOD_LALT);
-    zmk_endpoints_send_report(HID_USAGE_KEY);
+    set_unicode_digits(exp_work, 10, 1);
     exp_work->state = EXPANSION_STATE_WIN_UNI_TYPE_NUMPAD_PRESS;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
+    schedule_step(exp_work, 0);
+}
+// Alt going up types the character of the digits so far.
+static uint32_t win_discard_unicode_key(const struct expansion_work *exp_work) {
+    return (exp_work->held_mods & MOD_LALT) ? HID_USAGE_KEY_KEYBOARD_DELETE_BACKSPACE : 0;
 }
 static void handle_win_uni_type_numpad_press(struct expansion_work *exp_work) {
-    char digit = exp_work->unicode_hex_buffer[exp_work->unicode_hex_index];
-    if (digit == '\0') {
-        exp_work->state = EXPANSION_STATE_WIN_UNI_RELEASE_ALT;
-    } else {
-        exp_work->current_keycode = get_numpad_keycode(digit);
-        send_and_flush_key_action(exp_work->current_keycode, true);
-        exp_work->state = EXPANSION_STATE_WIN_UNI_TYPE_NUMPAD_RELEASE;
+    hid_report_begin();
+    if (exp_work->unicode_digit_index == 0) {
+        stage_mods(exp_work, MOD_LALT, true);
     }
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
+    exp_work->current_keycode = get_numpad_keycode(exp_work->unicode_digits[exp_work->unicode_digit_index]);
+    hid_report_stage_key(exp_work->current_keycode, true);
+    hid_report_commit();
+    exp_work->state = EXPANSION_STATE_WIN_UNI_TYPE_NUMPAD_RELEASE;
+    schedule_phase(exp_work, exp_work->unicode_digit_index == 0 ? TYPING_PHASE_MODIFIER : TYPING_PHASE_UNICODE_DIGIT);
 }
 static void handle_win_uni_type_numpad_release(struct expansion_work *exp_work) {
-    send_and_flush_key_action(exp_work->current_keycode, false);
+    hid_report_begin();
+    hid_report_stage_key(exp_work->current_keycode, false);
     exp_work->current_keycode = 0;
-    exp_work->unicode_hex_index++;
-    exp_work->state = EXPANSION_STATE_WIN_UNI_TYPE_NUMPAD_PRESS;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
-}
-static void handle_win_uni_release_alt(struct expansion_work *exp_work) {
-    zmk_hid_unregister_mods(MOD_LALT);
-    zmk_endpoints_send_report(HID_USAGE_KEY);
-    exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
+    exp_work->unicode_digit_index++;
+    if (exp_work->unicode_digit_index >= exp_work->unicode_num_digits) {
+        stage_mods(exp_work, MOD_LALT, false);
+        exp_work->chars_typed++;
+        exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
+    } else {
+        exp_work->state = EXPANSION_STATE_WIN_UNI_TYPE_NUMPAD_PRESS;
+    }
+    hid_report_commit();
+    schedule_phase(exp_work, exp_work->state == EXPANSION_STATE_TYPE_CHAR_START ? TYPING_PHASE_MODIFIER
+                                                                                : TYPING_PHASE_UNICODE_DIGIT);
 }
 
 // macOS Unicode Handlers
 static void macos_start_unicode_typing(struct expansion_work *exp_work) {
-    snprintf(exp_work->unicode_hex_buffer, sizeof(exp_work->unicode_hex_buffer), "%04x", exp_work->unicode_codepoint);
-    exp_work->unicode_hex_index = 0;
-    exp_work->state = EXPANSION_STATE_MAC_UNI_PRESS_OPTION;
-    k_work_reschedule(&exp_work->work, K_NO_WAIT);
-}
-static void handle_mac_uni_press_option(struct expansion_work *exp_work) {
-    zmk_hid_register_mods(MOD_LALT);
-    zmk_endpoints_send_report(HID_USAGE_KEY);
+    set_unicode_digits(exp_work, 16, 4);
     exp_work->state = EXPANSION_STATE_MAC_UNI_TYPE_HEX_PRESS;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
+    schedule_step(exp_work, 0);
+}
+// Option going up before the last digit types nothing.
+static uint32_t macos_discard_unicode_key(const struct expansion_work *exp_work) {
+    return 0;
 }
 static void handle_mac_uni_type_hex_press(struct expansion_work *exp_work) {
-    char hex_digit = exp_work->unicode_hex_buffer[exp_work->unicode_hex_index];
-    if (hex_digit == '\0') {
-        exp_work->state = EXPANSION_STATE_MAC_UNI_RELEASE_OPTION;
-    } else {
-        exp_work->current_keycode = get_hex_keycode(hex_digit);
-        send_and_flush_key_action(exp_work->current_keycode, true);
-        exp_work->state = EXPANSION_STATE_MAC_UNI_TYPE_HEX_RELEASE;
+    hid_report_begin();
+    if (exp_work->unicode_digit_index == 0) {
+        stage_mods(exp_work, MOD_LALT, true);
     }
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
+    exp_work->current_keycode = get_hex_keycode(exp_work->unicode_digits[exp_work->unicode_digit_index]);
+    hid_report_stage_key(exp_work->current_keycode, true);
+    hid_report_commit();
+    exp_work->state = EXPANSION_STATE_MAC_UNI_TYPE_HEX_RELEASE;
+    schedule_phase(exp_work, exp_work->unicode_digit_index == 0 ? TYPING_PHASE_MODIFIER : TYPING_PHASE_UNICODE_DIGIT);
 }
 static void handle_mac_uni_type_hex_release(struct expansion_work *exp_work) {
-    send_and_flush_key_action(exp_work->current_keycode, false);
+    hid_report_begin();
+    hid_report_stage_key(exp_work->current_keycode, false);
     exp_work->current_keycode = 0;
-    exp_work->unicode_hex_index++;
-    exp_work->state = EXPANSION_STATE_MAC_UNI_TYPE_HEX_PRESS;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
-}
-static void handle_mac_uni_release_option(struct expansion_work *exp_work) {
-    zmk_hid_unregister_mods(MOD_LALT);
-    zmk_endpoints_send_report(HID_USAGE_KEY);
-    exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
+    exp_work->unicode_digit_index++;
+    if (exp_work->unicode_digit_index >= exp_work->unicode_num_digits) {
+        stage_mods(exp_work, MOD_LALT, false);
+        exp_work->chars_typed++;
+        exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
+    } else {
+        exp_work->state = EXPANSION_STATE_MAC_UNI_TYPE_HEX_PRESS;
+    }
+    hid_report_commit();
+    schedule_phase(exp_work, exp_work->state == EXPANSION_STATE_TYPE_CHAR_START ? TYPING_PHASE_MODIFIER
+                                                                                : TYPING_PHASE_UNICODE_DIGIT);
 }
 
 // Linux Unicode Handlers
 static void linux_start_unicode_typing(struct expansion_work *exp_work) {
-    snprintf(exp_work->unicode_hex_buffer, sizeof(exp_work->unicode_hex_buffer), "%x", exp_work->unicode_codepoint);
-    exp_work->unicode_hex_index = 0;
-    exp_work->state = EXPANSION_STATE_LINUX_UNI_PRESS_CTRL_SHIFT;
-    k_work_reschedule(&exp_work->work, K_NO_WAIT);
-}
-static void handle_linux_uni_press_ctrl_shift(struct expansion_work *exp_work) {
-    zmk_hid_register_mods(MOD_LCTL | MOD_LSFT);
-    zmk_endpoints_send_report(HID_USAGE_KEY);
+    set_unicode_digits(exp_work, 16, 1);
     exp_work->state = EXPANSION_STATE_LINUX_UNI_PRESS_U;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
+    schedule_step(exp_work, 0);
+}
+// Once Ctrl+Shift+U is down the input method waits for the terminator.
+static uint32_t linux_discard_unicode_key(const struct expansion_work *exp_work) {
+    return exp_work->state > EXPANSION_STATE_LINUX_UNI_PRESS_U && exp_work->state < EXPANSION_STATE_LINUX_UNI_RELEASE_TERMINATOR
+               ? HID_USAGE_KEY_KEYBOARD_ESCAPE
+               : 0;
 }
 static void handle_linux_uni_press_u(struct expansion_work *exp_work) {
-    send_and_flush_key_action(HID_USAGE_KEY_KEYBOARD_U, true);
+    hid_report_begin();
+    stage_mods(exp_work, MOD_LCTL | MOD_LSFT, true);
+    exp_work->current_keycode = HID_USAGE_KEY_KEYBOARD_U;
+    hid_report_stage_key(exp_work->current_keycode, true);
+    hid_report_commit();
     exp_work->state = EXPANSION_STATE_LINUX_UNI_RELEASE_U;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
+    schedule_phase(exp_work, TYPING_PHASE_MODIFIER);
 }
 static void handle_linux_uni_release_u(struct expansion_work *exp_work) {
-    send_and_flush_key_action(HID_USAGE_KEY_KEYBOARD_U, false);
-    exp_work->state = EXPANSION_STATE_LINUX_UNI_RELEASE_CTRL_SHIFT;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
-}
-static void handle_linux_uni_release_ctrl_shift(struct expansion_work *exp_work) {
-    zmk_hid_unregister_mods(MOD_LCTL | MOD_LSFT);
-    zmk_endpoints_send_report(HID_USAGE_KEY);
+    hid_report_begin();
+    hid_report_stage_key(HID_USAGE_KEY_KEYBOARD_U, false);
+    stage_mods(exp_work, MOD_LCTL | MOD_LSFT, false);
+    hid_report_commit();
+    exp_work->current_keycode = 0;
     exp_work->state = EXPANSION_STATE_LINUX_UNI_TYPE_HEX_PRESS;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
+    schedule_phase(exp_work, TYPING_PHASE_MODIFIER);
 }
 static void handle_linux_uni_type_hex_press(struct expansion_work *exp_work) {
-    char hex_digit = exp_work->unicode_hex_buffer[exp_work->unicode_hex_index];
-    if (hex_digit == '\0') {
+    if (exp_work->unicode_digit_index >= exp_work->unicode_num_digits) {
         exp_work->state = EXPANSION_STATE_LINUX_UNI_PRESS_TERMINATOR;
+        schedule_step(exp_work, 0);
     } else {
-        exp_work->current_keycode = get_hex_keycode(hex_digit);
+        exp_work->current_keycode = get_hex_keycode(exp_work->unicode_digits[exp_work->unicode_digit_index]);
         send_and_flush_key_action(exp_work->current_keycode, true);
         exp_work->state = EXPANSION_STATE_LINUX_UNI_TYPE_HEX_RELEASE;
+        schedule_phase(exp_work, TYPING_PHASE_UNICODE_DIGIT);
     }
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
 }
 static void handle_linux_uni_type_hex_release(struct expansion_work *exp_work) {
     send_and_flush_key_action(exp_work->current_keycode, false);
     exp_work->current_keycode = 0;
-    exp_work->unicode_hex_index++;
+    exp_work->unicode_digit_index++;
     exp_work->state = EXPANSION_STATE_LINUX_UNI_TYPE_HEX_PRESS;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
+    schedule_phase(exp_work, TYPING_PHASE_UNICODE_DIGIT);
 }
 static void handle_linux_uni_press_terminator(struct expansion_work *exp_work) {
-    send_and_flush_key_action(HID_USAGE_KEY_KEYBOARD_RETURN_ENTER, true);
+    exp_work->current_keycode = HID_USAGE_KEY_KEYBOARD_RETURN_ENTER;
+    send_and_flush_key_action(exp_work->current_keycode, true);
+    exp_work->chars_typed++;
     exp_work->state = EXPANSION_STATE_LINUX_UNI_RELEASE_TERMINATOR;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
+    schedule_phase(exp_work, TYPING_PHASE_KEY_PRESS);
 }
 static void handle_linux_uni_release_terminator(struct expansion_work *exp_work) {
     send_and_flush_key_action(HID_USAGE_KEY_KEYBOARD_RETURN_ENTER, false);
+    exp_work->current_keycode = 0;
     exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
-    k_work_reschedule(&exp_work->work, K_MSEC(TYPING_DELAY));
+    schedule_phase(exp_work, TYPING_PHASE_KEY_RELEASE);
 }
 
 // Keycode Helpers
-static uint32_t get_numpad_keycode(char digit) {
-    switch (digit) {
-        case '0': return HID_USAGE_KEY_KEYPAD_0_AND_INSERT;
-        case '1': return HID_USAGE_KEY_KEYPAD_1_AND_END;
-        case '2': return HID_USAGE_KEY_KEYPAD_2_AND_DOWN_ARROW;
-        case '3': return HID_USAGE_KEY_KEYPAD_3_AND_PAGEDN;
-        case '4': return HID_USAGE_KEY_KEYPAD_4_AND_LEFT_ARROW;
-        case '5': return HID_USAGE_KEY_KEYPAD_5;
-        case '6': return HID_USAGE_KEY_KEYPAD_6_AND_RIGHT_ARROW;
-        case '7': return HID_USAGE_KEY_KEYPAD_7_AND_HOME;
-        case '8': return HID_USAGE_KEY_KEYPAD_8_AND_UP_ARROW;
-        case '9': return HID_USAGE_KEY_KEYPAD_9_AND_PAGEUP;
-        default:  return 0;
-    }
-}
-
-static uint32_t get_hex_keycode(char hex_digit) {
-    char d = tolower(hex_digit);
-    if (d >= '0' && d <= '9') {
-        if (d == '0') return HID_USAGE_KEY_KEYBOARD_0_AND_RIGHT_PARENTHESIS;
-        return HID_USAGE_KEY_KEYBOARD_1_AND_EXCLAMATION + (d - '1');
-    }
-    if (d >= 'a' && d <= 'f') {
-        return HID_USAGE_KEY_KEYBOARD_A + (d - 'a');
+static uint32_t get_numpad_keycode(uint8_t digit) {
+    return digit == 0 ? HID_USAGE_KEY_KEYPAD_0_AND_INSERT : HID_USAGE_KEY_KEYPAD_1_AND_END + (digit - 1);
+}
+
+static uint32_t get_hex_keycode(uint8_t digit) {
+    if (digit < 10) {
+        return digit == 0 ? HID_USAGE_KEY_KEYBOARD_0_AND_RIGHT_PARENTHESIS : HID_USAGE_KEY_KEYBOARD_1_AND_EXCLAMATION + (digit - 1);
     }
-    return 0;
+    return HID_USAGE_KEY_KEYBOARD_A + (digit - 10);
 }
 
-int start_expansion(struct expansion_work *work_item, const char *expanded_text, uint8_t len_to_delete, uint16_t trigger_keycode) {
-    LOG_INF("Starting expansion: text='%s', backspaces=%d, replay_keycode=0x%04X", expanded_text, len_to_delete, trigger_keycode);
+int start_expansion(struct expansion_work *work_item, const uint8_t *keys, uint16_t len_to_delete, bool by_words,
+                    uint16_t trigger_keycode, enum expansion_case letter_case) {
+    LOG_INF("Starting expansion: backspaces=%d, replay_keycode=0x%04X", len_to_delete, trigger_keycode);
     cancel_current_expansion(work_item);
 
-    work_item->expanded_text = expanded_text;
+    work_item->word_deletes = 0;
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_WORD_DELETE
+    // A chord per whole word replaces the backspaces for its characters.
+    uint16_t word_chars;
+    uint16_t words = by_words ? typed_tail_words(work_item, &word_chars) : 0;
+    if (words > 0 && word_chars <= len_to_delete) {
+        LOG_DBG("Deleting %u characters as %u words", word_chars, words);
+        work_item->word_deletes = words;
+        len_to_delete = len_to_delete - word_chars + words;
+    }
+    work_item->typed_words = (struct expansion_words){0};
+#endif
+
+    work_item->keys = keys;
+    work_item->phrase_left = 0;
+    work_item->ref_depth = 0;
     work_item->trigger_keycode_to_replay = trigger_keycode;
+    work_item->letter_case = letter_case;
     work_item->backspace_count = len_to_delete;
-    work_item->text_index = 0;
-    work_item->literal_end_index = 0;
+    work_item->backspaces_sent = 0;
+    work_item->chars_typed = 0;
+    work_item->preemption = EXPANSION_PREEMPT_NONE;
+    work_item->preempted = false;
     work_item->start_time_ms = k_uptime_get();
-    work_item->shift_mod_active = false;
+    work_item->first_report = hid_report_count();
+    work_item->report_retries = 0;
+    typing_pace_start();
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_LATENESS_STATS
+    work_item->lateness = (struct expansion_lateness){0};
+#endif
+    work_item->held_mods = 0;
     work_item->current_keycode = 0;
+    work_item->num_held_keys = 0;
 
     work_item->state = (work_item->backspace_count > 0) ? EXPANSION_STATE_START_BACKSPACE : EXPANSION_STATE_START_TYPING;
 
     LOG_DBG("Scheduling expansion work, initial state: %d", work_item->state);
-    k_work_reschedule(&work_item->work, K_MSEC(10));
+    schedule_work(work_item, typing_pace_phase_us(TYPING_PHASE_GAP));
     return 0;
 }
@@ -1,20 +1,95 @@
+#include <zephyr/kernel.h>
 #include <zmk/hid_utils.h>
 #include <zmk/endpoints.h>
 #include <zephyr/logging/log.h>
+#include <zmk/typing_pace.h>
 
 LOG_MODULE_REGISTER(hid_utils, LOG_LEVEL_DBG);
 
-int send_and_flush_key_action(uint32_t keycode, bool pressed) {
-    LOG_DBG("Sending key action: keycode=0x%04X, pressed=%s", keycode, pressed ? "true" : "false");
+static bool report_changed;
+static uint32_t reports_sent;
+
+// Staged changes are applied to the HID state right away, so a report the
+// endpoint turned down is still in it; only a successful commit clears it.
+void hid_report_begin(void) {
+    if (report_changed) {
+        LOG_DBG("Starting a report with a turned-down one still pending");
+    }
+}
+
+void hid_report_stage_key(uint32_t keycode, bool pressed) {
+    if (zmk_hid_keyboard_is_pressed(keycode) == pressed) {
+        return;
+    }
     int ret = send_key_action(keycode, pressed);
     if (ret < 0) {
-        LOG_ERR("Failed to send key action: %d", ret);
-        return ret;
+        LOG_ERR("Failed to stage key action: %d", ret);
+        return;
     }
-    
-    LOG_DBG("Flushing HID report for usage page 0x%02X", HID_USAGE_KEY);
+    report_changed = true;
+}
+
+// Explicit modifiers are counted per press, so they are always passed on; the
+// report only changes when a modifier's first press or last release does.
+void hid_report_stage_mods(zmk_mod_flags_t mods, bool pressed) {
+    zmk_mod_flags_t before = zmk_hid_get_explicit_mods();
+    if (pressed) {
+        zmk_hid_register_mods(mods);
+    } else {
+        zmk_hid_unregister_mods(mods);
+    }
+    if (zmk_hid_get_explicit_mods() != before) {
+        report_changed = true;
+    }
+}
+
+#if defined(CONFIG_ZMK_TEXT_EXPANDER_SIMULATED_ENDPOINT_CAPACITY) && CONFIG_ZMK_TEXT_EXPANDER_SIMULATED_ENDPOINT_CAPACITY > 0
+// Turns down reports sent faster than the configured capacity, as a busy endpoint would.
+static int send_report(void) {
+    static int64_t next_free_us;
+    int64_t now_us = k_ticks_to_us_floor64(k_uptime_ticks());
+    if (now_us < next_free_us) {
+        return -EAGAIN;
+    }
+    next_free_us = now_us + USEC_PER_SEC / CONFIG_ZMK_TEXT_EXPANDER_SIMULATED_ENDPOINT_CAPACITY;
     return zmk_endpoints_send_report(HID_USAGE_KEY);
 }
+#else
+static int send_report(void) {
+    return zmk_endpoints_send_report(HID_USAGE_KEY);
+}
+#endif
+
+int hid_report_commit(void) {
+    if (!report_changed) {
+        return 0;
+    }
+    LOG_DBG("Flushing HID report for usage page 0x%02X", HID_USAGE_KEY);
+    int ret = send_report();
+    typing_pace_update(ret);
+    if (ret < 0) {
+        LOG_DBG("Endpoint did not take the report: %d", ret);
+        return ret;
+    }
+    report_changed = false;
+    reports_sent++;
+    return 0;
+}
+
+bool hid_report_pending(void) {
+    return report_changed;
+}
+
+uint32_t hid_report_count(void) {
+    return reports_sent;
+}
+
+int send_and_flush_key_action(uint32_t keycode, bool pressed) {
+    LOG_DBG("Sending key action: keycode=0x%04X, pressed=%s", keycode, pressed ? "true" : "false");
+    hid_report_begin();
+    hid_report_stage_key(keycode, pressed);
+    return hid_report_commit();
+}
 
 uint32_t char_to_keycode(char c, bool *needs_shift) {
     *needs_shift = false;
@@ -9,16 +9,19 @@
 #include <zmk/behavior.h>
 #include <zmk/event_manager.h>
 #include <zmk/events/keycode_state_changed.h>
+#include <zmk/events/layer_state_changed.h>
 #include <zmk/hid.h>
+#include <zmk/hid_utils.h>
 #include <zmk/keymap.h>
 #include <zmk/text_expander.h>
 #include <zmk/trie.h>
 #include <zmk/expansion_engine.h>
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_DICTIONARY_PARTITION
+#include <zmk/trie_image.h>
+#endif
 
 LOG_MODULE_REGISTER(text_expander, LOG_LEVEL_DBG);
 
-#define EXPANDER_INST DT_DRV_INST(0)
-
 #define NO_REPLAY_KEY 0
 #define ZMK_HID_USAGE_ID_MASK 0xFFFF
 
@@ -26,13 +29,39 @@ static uint16_t extract_hid_usage(uint32_t zmk_hid_usage) {
     return (uint16_t)(zmk_hid_usage & ZMK_HID_USAGE_ID_MASK);
 }
 
-static const uint32_t reset_keycodes[] = DT_INST_PROP_OR(0, reset_keycodes, {});
-static const uint32_t auto_expand_keycodes[] = DT_INST_PROP_OR(0, auto_expand_keycodes, {});
+// Lists the devicetree may leave empty end with a sentinel that is not counted,
+// as C has no empty initializers.
+#define SENTINEL_LIST_LEN(list) (ARRAY_SIZE(list) - 1)
+
+// The keycode lists of all instances are merged: a key listed by any instance
+// acts on the short code, whichever dictionaries are active.
+#define INST_KEYCODES(n, prop)                                                                     \
+    COND_CODE_1(DT_INST_NODE_HAS_PROP(n, prop), (DT_INST_FOREACH_PROP_ELEM_SEP(n, prop, DT_PROP_BY_IDX, (,)),), ())
+#define MERGED_KEYCODES(prop) {DT_INST_FOREACH_STATUS_OKAY_VARGS(INST_KEYCODES, prop) 0}
 
-#if DT_INST_NODE_HAS_PROP(0, undo_keycodes)
-static const uint32_t undo_keycodes[] = DT_INST_PROP_OR(0, undo_keycodes, {});
+static const uint32_t reset_keycodes[] = MERGED_KEYCODES(reset_keycodes);
+static const uint32_t auto_expand_keycodes[] = MERGED_KEYCODES(auto_expand_keycodes);
+
+#if TEXT_EXPANDER_HAS_UNDO
+static const uint32_t undo_keycodes[] = MERGED_KEYCODES(undo_keycodes);
 #endif
 
+// Every instance is a dictionary in the shared trie. The typing state is shared
+// too; an instance only selects which terminals count as short codes.
+struct text_expander_config {
+    const char *path;      // Devicetree path, matched against the generated instance paths.
+    const uint8_t *layers; // Layers the dictionary is active on; all layers if there are none.
+    size_t num_layers;
+};
+
+struct text_expander_instance {
+    trie_instance_mask_t instance_bit; // Bit of this dictionary in the trie's instance masks.
+};
+
+#define INST_DEVICE(n) DEVICE_DT_INST_GET(n),
+static const struct device *const instances[] = {DT_INST_FOREACH_STATUS_OKAY(INST_DEVICE)};
+static const char *const instance_paths[] = {ZMK_TEXT_EXPANDER_GENERATED_INSTANCE_PATHS NULL};
+
 struct text_expander_data expander_data;
 
 static void process_key_event(struct text_expander_key_event *ev);
@@ -42,10 +71,26 @@ static void handle_backspace();
 static void handle_auto_expand(uint16_t keycode);
 static void handle_reset_key();
 static void handle_other_key();
+static void handle_manual_trigger(trie_instance_mask_t instance_bit);
 
 void text_expander_processor_work_handler(struct k_work *work);
 K_WORK_DEFINE(text_expander_processor_work, text_expander_processor_work_handler);
 
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_DEDICATED_WORK_QUEUE
+// Keeps typing from waiting behind the BLE and USB work on the system workqueue.
+K_THREAD_STACK_DEFINE(text_expander_work_q_stack, CONFIG_ZMK_TEXT_EXPANDER_WORK_QUEUE_STACK_SIZE);
+struct k_work_q text_expander_work_q;
+#endif
+
+#if defined(CONFIG_ZMK_TEXT_EXPANDER_SIMULATED_LOAD_US) && CONFIG_ZMK_TEXT_EXPANDER_SIMULATED_LOAD_US > 0
+// Keeps the system workqueue busy for part of every millisecond, as radio load would.
+static void simulated_load_work_handler(struct k_work *work) {
+    k_busy_wait(CONFIG_ZMK_TEXT_EXPANDER_SIMULATED_LOAD_US);
+    k_work_schedule(k_work_delayable_from_work(work), K_MSEC(1));
+}
+K_WORK_DELAYABLE_DEFINE(simulated_load_work, simulated_load_work_handler);
+#endif
+
 static bool keycode_in_array(uint16_t keycode, const uint32_t* arr, size_t len) {
     for (int i = 0; i < len; i++) {
         uint16_t array_keycode = extract_hid_usage(arr[i]);
@@ -80,117 +125,359 @@ static char keycode_to_short_code_char(uint16_t keycode) {
     }
 }
 
+// Short codes are stored in lower case; current_short keeps the case they were typed in.
+static char fold_case(char c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_STREAMING_MATCH
+static void reset_current_short(void) {
+    LOG_DBG("Resetting current short code. Was: '%s'", expander_data.current_short);
+    expander_data.current_short[0] = '\0';
+    expander_data.current_short_len = 0;
+    expander_data.stream_state = 0;
+    expander_data.stream_len = 0;
+}
+
+// Returns the longest short code that ends at the cursor and sets *short_len.
+// It is always a suffix of current_short.
+static const struct trie_node *find_short_code(const char **short_code, size_t *short_len) {
+    const struct trie_node *node = trie_stream_match(expander_data.stream_state);
+    *short_len = node ? node->depth : 0;
+    *short_code = &expander_data.current_short[expander_data.current_short_len - *short_len];
+    return node;
+}
+#else
 static void reset_current_short(void) {
     LOG_DBG("Resetting current short code. Was: '%s'", expander_data.current_short);
     memset(expander_data.current_short, 0, MAX_SHORT_LEN);
     expander_data.current_short_len = 0;
+    trie_cursor_reset(&expander_data.cursor);
+}
+
+static const struct trie_node *find_short_code(const char **short_code, size_t *short_len) {
+    *short_code = expander_data.current_short;
+    *short_len = expander_data.current_short_len;
+    return trie_cursor_terminal(&expander_data.cursor);
+}
+#endif
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_EAGER_EXPANSION
+// Returns the node for the typed characters, or NULL if they left the trie.
+static const struct trie_node *current_node(void) {
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_STREAMING_MATCH
+    return trie_stream_node(expander_data.stream_state);
+#else
+    return trie_cursor_node(&expander_data.cursor);
+#endif
 }
 
-static bool trigger_expansion(const char *short_code, enum expansion_context context, uint16_t trigger_keycode) {
-    LOG_DBG("Attempting to trigger expansion for '%s'", short_code);
+// Returns the only short code the typed characters can still become, or NULL.
+// All of current_short is the (possibly partial) short code to replace.
+static const struct trie_node *find_unique_completion(const char **short_code, size_t *short_len) {
+    *short_code = expander_data.current_short;
+    *short_len = expander_data.current_short_len;
+    return *short_len > 0 ? trie_unique_completion(current_node()) : NULL;
+}
+#endif
 
-    const struct trie_node *node = trie_search(short_code);
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_CASE_IGNORE
+static enum expansion_case expansion_case_for(const char *short_code, size_t short_len, bool completion) {
+    return EXPANSION_CASE_AS_IS;
+}
+#else
+// A short code typed with a capital first letter capitalizes the expansion. With
+// CONFIG_ZMK_TEXT_EXPANDER_CASE_ALL, one typed in capitals upper-cases all of it.
+static enum expansion_case expansion_case_for(const char *short_code, size_t short_len, bool completion) {
+    size_t letters = 0, capitals = 0;
+    for (size_t i = 0; i < short_len; i++) {
+        if (short_code[i] >= 'A' && short_code[i] <= 'Z') {
+            letters++;
+            capitals++;
+        } else if (short_code[i] >= 'a' && short_code[i] <= 'z') {
+            letters++;
+        }
+    }
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_CASE_ALL
+    if (letters >= 2 && capitals == letters) {
+        return EXPANSION_CASE_UPPER;
+    }
+#endif
+    // A completion keeps the short code as typed, so its first letter is already cased.
+    if (!completion && short_len > 0 && short_code[0] >= 'A' && short_code[0] <= 'Z') {
+        return EXPANSION_CASE_CAPITALIZE;
+    }
+    return EXPANSION_CASE_AS_IS;
+}
+#endif
+
+static bool trigger_expansion(enum expansion_context context, uint16_t trigger_keycode) {
+    LOG_DBG("Attempting to trigger expansion for '%s'", expander_data.current_short);
+
+    const char *short_code;
+    size_t short_len;
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_EAGER_EXPANSION
+    const struct trie_node *node = (context == EXPAND_EAGERLY) ? find_unique_completion(&short_code, &short_len)
+                                                               : find_short_code(&short_code, &short_len);
+#else
+    const struct trie_node *node = find_short_code(&short_code, &short_len);
+#endif
     if (!node) {
-        LOG_DBG("No expansion found for '%s' in trie.", short_code);
+        LOG_DBG("No expansion found for '%s' in trie.", expander_data.current_short);
         return false;
     }
 
-    const char *expanded_ptr = zmk_text_expander_get_string(node->expanded_text_offset);
-    if (!expanded_ptr) {
-        LOG_ERR("Trie node found but expanded text offset %u is invalid.", node->expanded_text_offset);
+    struct trie_expansion expansion;
+    if (!trie_get_expansion(node, &expansion)) {
         return false;
     }
 
-    size_t short_len = strlen(short_code);
-    uint8_t len_to_delete = short_len + (context == EXPAND_FROM_AUTO_TRIGGER ? 1 : 0);
-    const char *text_for_engine = expanded_ptr;
+    uint16_t len_to_delete = short_len + (context == EXPAND_FROM_AUTO_TRIGGER ? 1 : 0);
+    const uint8_t *keys = expansion.keys;
 
-    if (strncmp(expanded_ptr, short_code, short_len) == 0) {
-        text_for_engine = expanded_ptr + short_len;
+    // A completion's program starts with one tap per short code character, which are already typed.
+    if (expansion.completion) {
+        keys += short_len;
         len_to_delete = (context == EXPAND_FROM_AUTO_TRIGGER ? 1 : 0);
-        LOG_INF("Found completion: '%s' -> '%s'", short_code, expanded_ptr);
+        LOG_INF("Found completion for '%s'", short_code);
     } else {
-        LOG_INF("Found replacement: '%s' -> '%s'", short_code, expanded_ptr);
+        LOG_INF("Found replacement for '%s'", short_code);
     }
 
-    uint16_t keycode_to_replay = node->preserve_trigger ? trigger_keycode : NO_REPLAY_KEY;
+    uint16_t keycode_to_replay = expansion.preserve_trigger ? trigger_keycode : NO_REPLAY_KEY;
 
-#if DT_INST_NODE_HAS_PROP(0, undo_keycodes)
+#if TEXT_EXPANDER_HAS_UNDO
     strncpy(expander_data.last_short_code, short_code, MAX_SHORT_LEN - 1);
-    expander_data.last_expanded_text = expanded_ptr;
+    expander_data.last_typed_len = expansion.typed_len;
     expander_data.last_trigger_keycode = keycode_to_replay;
     expander_data.just_expanded = true;
     LOG_DBG("Saved undo state. Last short: '%s', trigger: 0x%04X", expander_data.last_short_code, keycode_to_replay);
 #endif
 
     reset_current_short();
-    LOG_INF("Passing text to engine. Text: \"%s\", backspaces: %d, replay_keycode: 0x%04X", text_for_engine, len_to_delete, keycode_to_replay);
-    start_expansion(&expander_data.expansion_work_item, text_for_engine, len_to_delete, keycode_to_replay);
+    LOG_INF("Passing program to engine. Backspaces: %d, replay_keycode: 0x%04X", len_to_delete, keycode_to_replay);
+    start_expansion(&expander_data.expansion_work_item, keys, len_to_delete, false, keycode_to_replay,
+                    expansion_case_for(short_code, short_len, expansion.completion));
 
     return true;
 }
 
-static void add_to_current_short(char c) {
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_STREAMING_MATCH
+// current_short always holds the path of the streaming state: the longest suffix
+// of everything typed that is still a prefix of some short code. That is never
+// longer than the longest short code, so it is always among the last
+// MAX_SHORT_LEN characters typed.
+static uint8_t stream_depth(trie_node_offset_t state) {
+    const struct trie_node *node = trie_stream_node(state);
+    return node ? node->depth : 0;
+}
+
+// Copies the last depth characters typed into current_short.
+static void copy_stream_path(uint8_t depth) {
+    uint8_t slot = (expander_data.stream_head + MAX_SHORT_LEN + 1 - depth) % MAX_SHORT_LEN;
+    for (uint8_t i = 0; i < depth; i++) {
+        expander_data.current_short[i] = expander_data.stream_chars[slot];
+        slot = (slot + 1) % MAX_SHORT_LEN;
+    }
+    expander_data.current_short_len = depth;
+    expander_data.current_short[depth] = '\0';
+}
+
+static bool add_to_current_short(char c) {
+    expander_data.stream_state = trie_stream_advance(expander_data.stream_state, fold_case(c));
+    expander_data.stream_head = (expander_data.stream_head + 1) % MAX_SHORT_LEN;
+    expander_data.stream_chars[expander_data.stream_head] = c;
+    expander_data.stream_states[expander_data.stream_head] = expander_data.stream_state;
+    if (expander_data.stream_len < MAX_SHORT_LEN) {
+        expander_data.stream_len++;
+    }
+    uint8_t depth = stream_depth(expander_data.stream_state);
+    copy_stream_path(depth);
+    LOG_DBG("Added '%c' to stream, matching suffix now: '%s' (len: %d)", c, expander_data.current_short, depth);
+    return depth > 0;
+}
+
+// Steps back to the state before the last character typed. After more
+// Backspaces in a row than the ring holds, the matching starts over.
+static void retreat_current_short(void) {
+    if (expander_data.stream_len == 0) {
+        return;
+    }
+    expander_data.stream_head = (expander_data.stream_head + MAX_SHORT_LEN - 1) % MAX_SHORT_LEN;
+    expander_data.stream_len--;
+    expander_data.stream_state = expander_data.stream_len > 0 ? expander_data.stream_states[expander_data.stream_head] : 0;
+    uint8_t depth = stream_depth(expander_data.stream_state);
+    if (depth > expander_data.stream_len) {
+        LOG_DBG("Backspaced past the remembered characters, restarting the stream.");
+        reset_current_short();
+        return;
+    }
+    copy_stream_path(depth);
+}
+#else
+static bool add_to_current_short(char c) {
     if (expander_data.current_short_len < MAX_SHORT_LEN - 1) {
         expander_data.current_short[expander_data.current_short_len++] = c;
         expander_data.current_short[expander_data.current_short_len] = '\0';
         LOG_DBG("Added '%c' to short code, now: '%s' (len: %d)", c, expander_data.current_short, expander_data.current_short_len);
-    } else {
-        LOG_WRN("Short code buffer full at length %d. Ignoring character '%c'.", expander_data.current_short_len, c);
+        return trie_cursor_advance(&expander_data.cursor, fold_case(c));
+    }
+    LOG_WRN("Short code buffer full at length %d. Ignoring character '%c'.", expander_data.current_short_len, c);
+    return true;
+}
+
+static void retreat_current_short(void) {
+    if (expander_data.current_short_len == 0) {
+        return;
     }
+    expander_data.current_short_len--;
+    expander_data.current_short[expander_data.current_short_len] = '\0';
+    trie_cursor_retreat(&expander_data.cursor);
 }
+#endif
 
 
+static bool is_capturable(const struct zmk_keycode_state_changed *ev) {
+    return ev->usage_page == HID_USAGE_KEY && ev->keycode < CAPTURE_KEYCODES;
+}
+
+static void queue_key_event(struct text_expander_key_event *key_event) {
+    if (k_msgq_put(&expander_data.key_event_msgq, key_event, K_NO_WAIT) != 0) {
+        LOG_WRN("Failed to queue key event for keycode 0x%04X", key_event->keycode);
+        return;
+    }
+    k_work_submit_to_queue(EXPANSION_WORK_Q, &text_expander_processor_work);
+}
+
+// Stops the running expansion if the key pressed is one the preemption
+// options name. The key is then held back like any other, so it follows the
+// release of the expansion's keys.
+static void check_preemption(const struct zmk_keycode_state_changed *ev) {
+    if (CONFIG_ZMK_TEXT_EXPANDER_PREEMPT_KEYCODE != 0 && ev->keycode == CONFIG_ZMK_TEXT_EXPANDER_PREEMPT_KEYCODE) {
+        preempt_current_expansion(&expander_data.expansion_work_item, EXPANSION_PREEMPT_ABORT_KEY);
+    } else if (IS_ENABLED(CONFIG_ZMK_TEXT_EXPANDER_PREEMPT_ON_KEY_PRESS) &&
+               (ev->keycode < HID_USAGE_KEY_KEYBOARD_LEFTCONTROL || ev->keycode > HID_USAGE_KEY_KEYBOARD_RIGHT_GUI)) {
+        preempt_current_expansion(&expander_data.expansion_work_item, EXPANSION_PREEMPT_KEY_PRESS);
+    }
+}
+
+// Keys pressed during an expansion, or while the keys before them still wait to
+// be processed, are held back and reach the host in order once the expansion
+// is done, so the short codes among them expand too. A release is only held
+// back after a press that was, so a key held into an expansion is not stuck
+// down while it types. Each held press keeps a queue slot free for its release.
 static int text_expander_keycode_state_changed_listener(const zmk_event_t *eh) {
     struct zmk_keycode_state_changed *ev = as_zmk_keycode_state_changed(eh);
     if (ev == NULL) {
         return ZMK_EV_EVENT_BUBBLE;
     }
 
-    if (expander_data.expansion_work_item.state != EXPANSION_STATE_IDLE) {
-        LOG_DBG("Expansion in progress, bubbling event for keycode 0x%04X", ev->keycode);
-        return ZMK_EV_EVENT_BUBBLE;
+    bool is_shift = false;
+#ifndef CONFIG_ZMK_TEXT_EXPANDER_CASE_IGNORE
+    // Shift only decides the case of the keys that follow, so it never resets the
+    // short code. It is tracked even during an expansion, which may hide its release.
+    if (ev->keycode == HID_USAGE_KEY_KEYBOARD_LEFTSHIFT || ev->keycode == HID_USAGE_KEY_KEYBOARD_RIGHTSHIFT) {
+        WRITE_BIT(expander_data.held_shift_keys, ev->keycode == HID_USAGE_KEY_KEYBOARD_RIGHTSHIFT, ev->state);
+        is_shift = true;
     }
+#endif
 
     struct text_expander_key_event key_event = { .keycode = ev->keycode, .pressed = ev->state };
-    if (k_msgq_put(&expander_data.key_event_msgq, &key_event, K_NO_WAIT) != 0) {
-        LOG_WRN("Failed to queue key event for keycode 0x%04X", ev->keycode);
-    } else {
-        k_work_submit(&text_expander_processor_work);
+#ifndef CONFIG_ZMK_TEXT_EXPANDER_CASE_IGNORE
+    key_event.shifted = expander_data.held_shift_keys || (ev->implicit_modifiers & (MOD_LSFT | MOD_RSFT));
+#endif
+
+    if (!ev->state) {
+        if (!is_capturable(ev) || !atomic_test_and_clear_bit(expander_data.captured_keys, ev->keycode)) {
+            return ZMK_EV_EVENT_BUBBLE;
+        }
+        expander_data.num_captured_keys--;
+        key_event.captured = true;
+    } else if (expander_data.expansion_work_item.state != EXPANSION_STATE_IDLE ||
+               k_msgq_num_used_get(&expander_data.key_event_msgq) > 0) {
+        if (ev->usage_page == HID_USAGE_KEY) {
+            check_preemption(ev);
+        }
+        if (is_capturable(ev) && k_msgq_num_free_get(&expander_data.key_event_msgq) > expander_data.num_captured_keys + 1) {
+            atomic_set_bit(expander_data.captured_keys, ev->keycode);
+            expander_data.num_captured_keys++;
+            key_event.captured = true;
+        } else {
+            LOG_WRN("Key event queue full, keycode 0x%04X goes to the host during the expansion", ev->keycode);
+            return ZMK_EV_EVENT_BUBBLE;
+        }
     }
 
-    return ZMK_EV_EVENT_BUBBLE;
+    if (!key_event.captured && is_shift) {
+        return ZMK_EV_EVENT_BUBBLE;
+    }
+    if (key_event.captured) {
+        key_event.event = copy_raised_zmk_keycode_state_changed(ev);
+    }
+    queue_key_event(&key_event);
+    return key_event.captured ? ZMK_EV_EVENT_CAPTURED : ZMK_EV_EVENT_BUBBLE;
 }
 
+// An event stays in the queue while it is processed, so keys pressed meanwhile
+// are held back behind it. Processing stops while an expansion types and
+// text_expander_resume() picks it up again.
 void text_expander_processor_work_handler(struct k_work *work) {
     struct text_expander_key_event ev;
-    while (k_msgq_get(&expander_data.key_event_msgq, &ev, K_NO_WAIT) == 0) {
+    while (k_msgq_peek(&expander_data.key_event_msgq, &ev) == 0) {
+        if (expander_data.expansion_work_item.state != EXPANSION_STATE_IDLE) {
+            return;
+        }
+        if (ev.captured) {
+            ZMK_EVENT_RELEASE(ev.event);
+        }
         process_key_event(&ev);
+        k_msgq_get(&expander_data.key_event_msgq, &ev, K_NO_WAIT);
     }
 }
 
+void text_expander_resume(void) {
+    k_work_submit_to_queue(EXPANSION_WORK_Q, &text_expander_processor_work);
+}
+
 static void process_key_event(struct text_expander_key_event *ev) {
     if (!ev->pressed) {
         return;
     }
+#ifndef CONFIG_ZMK_TEXT_EXPANDER_CASE_IGNORE
+    if (ev->keycode == HID_USAGE_KEY_KEYBOARD_LEFTSHIFT || ev->keycode == HID_USAGE_KEY_KEYBOARD_RIGHTSHIFT) {
+        return;
+    }
+#endif
     LOG_DBG("Processing key press event, keycode: 0x%04X", ev->keycode);
 
     k_mutex_lock(&expander_data.mutex, K_FOREVER);
 
+    if (ev->trigger_instance) {
+        handle_manual_trigger(ev->trigger_instance);
+        k_mutex_unlock(&expander_data.mutex);
+        return;
+    }
+
     if (handle_undo(ev->keycode)) {
         k_mutex_unlock(&expander_data.mutex);
         return;
     }
 
     char next_char = keycode_to_short_code_char(ev->keycode);
+#ifndef CONFIG_ZMK_TEXT_EXPANDER_CASE_IGNORE
+    if (ev->shifted && next_char != '\0') {
+        // Shift makes letters capitals, but turns the other keys into symbols that are not in short codes.
+        next_char = (next_char >= 'a' && next_char <= 'z') ? next_char - 'a' + 'A' : '\0';
+    }
+#endif
 
     if (next_char != '\0') {
         handle_alphanumeric(next_char);
     } else if (ev->keycode == HID_USAGE_KEY_KEYBOARD_DELETE_BACKSPACE) {
         handle_backspace();
-    } else if (keycode_in_array(ev->keycode, auto_expand_keycodes, ARRAY_SIZE(auto_expand_keycodes))) {
+    } else if (keycode_in_array(ev->keycode, auto_expand_keycodes, SENTINEL_LIST_LEN(auto_expand_keycodes))) {
         handle_auto_expand(ev->keycode);
-    } else if (keycode_in_array(ev->keycode, reset_keycodes, ARRAY_SIZE(reset_keycodes))) {
+    } else if (keycode_in_array(ev->keycode, reset_keycodes, SENTINEL_LIST_LEN(reset_keycodes))) {
         handle_reset_key();
     } else {
         handle_other_key();
@@ -199,19 +486,39 @@ static void process_key_event(struct text_expander_key_event *ev) {
     k_mutex_unlock(&expander_data.mutex);
 }
 
-#if DT_INST_NODE_HAS_PROP(0, undo_keycodes)
+#if TEXT_EXPANDER_HAS_UNDO
+// The generator keeps typed lengths below UINT16_MAX, so one more for the trigger still fits.
+BUILD_ASSERT(sizeof(trie_typed_len_t) <= sizeof(uint16_t), "Typed lengths must fit the undo backspace count.");
+
+// Compiles last_short_code into a program of key taps that retypes it as it was typed.
+static const uint8_t *compile_last_short_code(void) {
+    uint8_t len = 0;
+    for (const char *c = expander_data.last_short_code; *c != '\0'; c++) {
+        bool needs_shift;
+        uint32_t keycode = char_to_keycode(*c, &needs_shift);
+        if (keycode > 0 && keycode <= TRIE_KEY_USAGE_MASK) {
+            expander_data.undo_keys[len++] = keycode | (needs_shift ? TRIE_KEY_SHIFT : 0);
+        }
+    }
+    expander_data.undo_keys[len] = TRIE_OP_END;
+    return expander_data.undo_keys;
+}
+
 static bool handle_undo(uint16_t keycode) {
     if (expander_data.just_expanded) {
         LOG_DBG("Expansion just happened. Checking for undo keycode 0x%04X.", keycode);
         expander_data.just_expanded = false;
-        if (keycode_in_array(keycode, undo_keycodes, ARRAY_SIZE(undo_keycodes))) {
+        // Only a finished expansion typed the text undo takes back.
+        if (!expander_data.expansion_work_item.preempted &&
+            keycode_in_array(keycode, undo_keycodes, SENTINEL_LIST_LEN(undo_keycodes))) {
             LOG_INF("Undo triggered. Restoring '%s'", expander_data.last_short_code);
-            uint8_t undo_backspaces = strlen(expander_data.last_expanded_text);
+            uint16_t undo_backspaces = expander_data.last_typed_len;
             if (expander_data.last_trigger_keycode != 0) {
                 undo_backspaces++;
             }
             reset_current_short();
-            start_expansion(&expander_data.expansion_work_item, expander_data.last_short_code, undo_backspaces, NO_REPLAY_KEY);
+            start_expansion(&expander_data.expansion_work_item, compile_last_short_code(), undo_backspaces, true, NO_REPLAY_KEY,
+                            EXPANSION_CASE_AS_IS);
             return true;
         }
     }
@@ -223,36 +530,40 @@ static bool handle_undo(uint16_t keycode) { return false; }
 
 static void handle_alphanumeric(char next_char) {
     LOG_DBG("Handling alphanumeric char '%c'", next_char);
-    add_to_current_short(next_char);
+    bool is_prefix = add_to_current_short(next_char);
 
     #ifdef CONFIG_ZMK_TEXT_EXPANDER_AGGRESSIVE_RESET_MODE
-    if (expander_data.current_short_len > 0) {
-        if (trie_get_node_for_key(expander_data.current_short) == NULL) {
-            LOG_DBG("Aggressive reset triggered by '%c'. No such prefix.", next_char);
-            reset_current_short();
+    if (!is_prefix) {
+        LOG_DBG("Aggressive reset triggered by '%c'. No such prefix.", next_char);
+        reset_current_short();
 
-            #ifdef CONFIG_ZMK_TEXT_EXPANDER_RESTART_AFTER_RESET_WITH_TRIGGER_CHAR
-            LOG_DBG("Restarting new short code with '%c'", next_char);
-            add_to_current_short(next_char);
-            #endif
-        }
+        #ifdef CONFIG_ZMK_TEXT_EXPANDER_RESTART_AFTER_RESET_WITH_TRIGGER_CHAR
+        LOG_DBG("Restarting new short code with '%c'", next_char);
+        add_to_current_short(next_char);
+        #endif
+    }
+    #else
+    ARG_UNUSED(is_prefix);
+    #endif
+
+    #ifdef CONFIG_ZMK_TEXT_EXPANDER_EAGER_EXPANSION
+    if (expander_data.current_short_len > 0 && trie_unique_completion(current_node())) {
+        LOG_DBG("'%s' can only complete one short code, expanding now.", expander_data.current_short);
+        trigger_expansion(EXPAND_EAGERLY, NO_REPLAY_KEY);
     }
     #endif
 }
 
 static void handle_backspace() {
     LOG_DBG("Handling backspace. Current short: '%s'", expander_data.current_short);
-    if (expander_data.current_short_len > 0) {
-        expander_data.current_short_len--;
-        expander_data.current_short[expander_data.current_short_len] = '\0';
-        LOG_DBG("After backspace, short is now: '%s'", expander_data.current_short);
-    }
+    retreat_current_short();
+    LOG_DBG("After backspace, short is now: '%s'", expander_data.current_short);
 }
 
 static void handle_auto_expand(uint16_t keycode) {
     LOG_DBG("Handling auto-expand trigger for keycode 0x%04X", keycode);
     if (expander_data.current_short_len > 0) {
-        if (!trigger_expansion(expander_data.current_short, EXPAND_FROM_AUTO_TRIGGER, keycode)) {
+        if (!trigger_expansion(EXPAND_FROM_AUTO_TRIGGER, keycode)) {
             LOG_DBG("Auto-expand failed for '%s', resetting buffer.", expander_data.current_short);
             reset_current_short();
         }
@@ -273,20 +584,69 @@ static void handle_other_key() {
     }
 }
 
-static int text_expander_keymap_binding_pressed(struct zmk_behavior_binding *binding, struct zmk_behavior_binding_event binding_event) {
-    LOG_DBG("Manual trigger key pressed.");
+static bool instance_is_active(const struct device *dev) {
+    const struct text_expander_config *config = dev->config;
+    if (config->num_layers == 0) {
+        return true;
+    }
+    for (size_t i = 0; i < config->num_layers; i++) {
+        if (zmk_keymap_layer_active(config->layers[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Selects the dictionaries of the active layers. The trie is shared, so the
+// short code typed so far carries over and nothing is walked again.
+static void update_active_instances(void) {
+    trie_instance_mask_t active = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(instances); i++) {
+        const struct text_expander_instance *instance = instances[i]->data;
+        if (instance_is_active(instances[i])) {
+            active |= instance->instance_bit;
+        }
+    }
+    LOG_DBG("Active dictionaries: 0x%x", (unsigned int)active);
+    trie_set_active_instances(active);
+}
+
+static int text_expander_layer_state_changed_listener(const zmk_event_t *eh) {
+    if (as_zmk_layer_state_changed(eh) == NULL) {
+        return ZMK_EV_EVENT_BUBBLE;
+    }
+    if (IS_ENABLED(CONFIG_ZMK_TEXT_EXPANDER_PREEMPT_ON_LAYER_CHANGE)) {
+        preempt_current_expansion(&expander_data.expansion_work_item, EXPANSION_PREEMPT_LAYER_CHANGE);
+    }
     k_mutex_lock(&expander_data.mutex, K_FOREVER);
+    update_active_instances();
+    k_mutex_unlock(&expander_data.mutex);
+    return ZMK_EV_EVENT_BUBBLE;
+}
 
+static void handle_manual_trigger(trie_instance_mask_t instance_bit) {
     if (expander_data.current_short_len > 0) {
-        if (!trigger_expansion(expander_data.current_short, EXPAND_FROM_MANUAL_TRIGGER, NO_REPLAY_KEY)) {
+        // A trigger key expands from its own dictionary, whichever layers are active.
+        trie_instance_mask_t active = trie_get_active_instances();
+        trie_set_active_instances(instance_bit);
+        if (!trigger_expansion(EXPAND_FROM_MANUAL_TRIGGER, NO_REPLAY_KEY)) {
             LOG_INF("No expansion found for '%s', resetting.", expander_data.current_short);
             reset_current_short();
         }
+        trie_set_active_instances(active);
     } else {
         LOG_DBG("Manual trigger pressed but no short code entered.");
     }
+}
 
-    k_mutex_unlock(&expander_data.mutex);
+// The trigger is queued behind the keys typed before it, which may not have
+// been processed yet.
+static int text_expander_keymap_binding_pressed(struct zmk_behavior_binding *binding, struct zmk_behavior_binding_event binding_event) {
+    LOG_DBG("Manual trigger key pressed.");
+    const struct device *dev = zmk_behavior_get_binding(binding->behavior_dev);
+    const struct text_expander_instance *instance = dev->data;
+    struct text_expander_key_event key_event = { .pressed = true, .trigger_instance = instance->instance_bit };
+    queue_key_event(&key_event);
     return ZMK_BEHAVIOR_OPAQUE;
 }
 
@@ -296,6 +656,32 @@ static int text_expander_keymap_binding_released(struct zmk_behavior_binding *bi
 
 ZMK_LISTENER(text_expander_listener_interface, text_expander_keycode_state_changed_listener);
 ZMK_SUBSCRIPTION(text_expander_listener_interface, zmk_keycode_state_changed);
+ZMK_LISTENER(text_expander_layer_listener, text_expander_layer_state_changed_listener);
+ZMK_SUBSCRIPTION(text_expander_layer_listener, zmk_layer_state_changed);
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_DICTIONARY_PARTITION
+int text_expander_commit_dictionary(void) {
+    struct k_work_sync sync;
+    k_mutex_lock(&expander_data.mutex, K_FOREVER);
+    // Nothing may read the old tables while they are swapped out.
+    k_work_cancel_delayable_sync(&expander_data.expansion_work_item.work, &sync);
+    cancel_current_expansion(&expander_data.expansion_work_item);
+
+    int err = trie_image_commit();
+    if (!err) {
+        reset_current_short();
+        expander_data.root = trie_get_root();
+#if TEXT_EXPANDER_HAS_UNDO
+        expander_data.just_expanded = false;
+        expander_data.last_typed_len = 0;
+#endif
+    }
+
+    k_mutex_unlock(&expander_data.mutex);
+    text_expander_resume();
+    return err;
+}
+#endif
 
 static const struct behavior_driver_api text_expander_driver_api = {
     .binding_pressed = text_expander_keymap_binding_pressed,
@@ -308,9 +694,32 @@ static int text_expander_init(const struct device *dev) {
     extern const struct os_typing_driver win_driver;
     extern const struct os_typing_driver mac_driver;
     extern const struct os_typing_driver linux_driver;
-    if (initialized) { return 0; }
+
+    const struct text_expander_config *config = dev->config;
+    struct text_expander_instance *instance = dev->data;
+    for (size_t i = 0; i < SENTINEL_LIST_LEN(instance_paths); i++) {
+        if (strcmp(config->path, instance_paths[i]) == 0) {
+            instance->instance_bit = (trie_instance_mask_t)BIT(i);
+        }
+    }
+    if (!instance->instance_bit) {
+        LOG_WRN("No dictionary was generated for %s.", config->path);
+    }
+    if (initialized) {
+        update_active_instances();
+        return 0;
+    }
 
     LOG_INF("Initializing ZMK Text Expander module");
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_DEDICATED_WORK_QUEUE
+    k_work_queue_start(&text_expander_work_q, text_expander_work_q_stack,
+                       K_THREAD_STACK_SIZEOF(text_expander_work_q_stack),
+                       CONFIG_ZMK_TEXT_EXPANDER_WORK_QUEUE_PRIORITY,
+                       &(struct k_work_queue_config){.name = "text_expander"});
+#endif
+#if defined(CONFIG_ZMK_TEXT_EXPANDER_SIMULATED_LOAD_US) && CONFIG_ZMK_TEXT_EXPANDER_SIMULATED_LOAD_US > 0
+    k_work_schedule(&simulated_load_work, K_MSEC(1));
+#endif
     k_mutex_init(&expander_data.mutex);
     k_msgq_init(&expander_data.key_event_msgq, expander_data.key_event_msgq_buffer, sizeof(struct text_expander_key_event), KEY_EVENT_QUEUE_SIZE);
 
@@ -328,23 +737,43 @@ static int text_expander_init(const struct device *dev) {
         LOG_DBG("Default OS typing driver set to Windows.");
     #endif
 
-#if DT_INST_NODE_HAS_PROP(0, undo_keycodes)
+#if TEXT_EXPANDER_HAS_UNDO
     expander_data.just_expanded = false;
-    expander_data.last_expanded_text = NULL;
+    expander_data.last_typed_len = 0;
     expander_data.last_trigger_keycode = 0;
     memset(expander_data.last_short_code, 0, MAX_SHORT_LEN);
 #endif
 
-    if (zmk_text_expander_trie_num_nodes > 0) {
-         expander_data.root = &zmk_text_expander_trie_nodes[0];
-    } else {
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_DICTIONARY_PARTITION
+    trie_image_load();
+#endif
+    expander_data.root = trie_get_root();
+    if (!expander_data.root) {
          LOG_WRN("Text expander trie is empty. No expansions defined.");
     }
 
     k_work_init_delayable(&expander_data.expansion_work_item.work, expansion_work_handler);
+    update_active_instances();
     initialized = true;
 
     return 0;
 }
 
-BEHAVIOR_DT_INST_DEFINE(0, text_expander_init, NULL, &expander_data, NULL, POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT, &text_expander_driver_api);
+// An instance without a layers property gets no array, which would be empty.
+#define INST_LAYERS(n)                                                                             \
+    COND_CODE_1(DT_INST_NODE_HAS_PROP(n, layers), (text_expander_layers_##n), (NULL))
+
+#define TEXT_EXPANDER_INST(n)                                                                      \
+    COND_CODE_1(DT_INST_NODE_HAS_PROP(n, layers),                                                  \
+                (static const uint8_t text_expander_layers_##n[] = DT_INST_PROP(n, layers);), ())   \
+    static struct text_expander_instance text_expander_instance_##n;                               \
+    static const struct text_expander_config text_expander_config_##n = {                          \
+        .path = DT_NODE_PATH(DT_DRV_INST(n)),                                                       \
+        .layers = INST_LAYERS(n),                                                                   \
+        .num_layers = DT_INST_PROP_LEN_OR(n, layers, 0),                                            \
+    };                                                                                              \
+    BEHAVIOR_DT_INST_DEFINE(n, text_expander_init, NULL, &text_expander_instance_##n,               \
+                            &text_expander_config_##n, POST_KERNEL,                                 \
+                            CONFIG_KERNEL_INIT_PRIORITY_DEFAULT, &text_expander_driver_api);
+
+DT_INST_FOREACH_STATUS_OKAY(TEXT_EXPANDER_INST)
@@ -1,81 +1,346 @@
 #include <zephyr/logging/log.h>
 #include <zmk/trie.h>
 #include <stddef.h>
+#include <string.h>
 
 LOG_MODULE_REGISTER(trie, LOG_LEVEL_DBG);
 
-static const struct trie_node *get_node(uint16_t index) {
-    if (index >= zmk_text_expander_trie_num_nodes) {
-        LOG_WRN("Node index %u out of bounds.", index);
-        return NULL;
+static const struct trie_tables *tables = &zmk_text_expander_compiled_tables;
+static trie_instance_mask_t active_instances = (trie_instance_mask_t)-1;
+
+void trie_set_tables(const struct trie_tables *new_tables) {
+    tables = new_tables ? new_tables : &zmk_text_expander_compiled_tables;
+}
+
+void trie_set_active_instances(trie_instance_mask_t mask) {
+    active_instances = mask;
+}
+
+trie_instance_mask_t trie_get_active_instances(void) {
+    return active_instances;
+}
+
+// True if the node completes a short code that an active instance defines.
+static bool is_active_terminal(const struct trie_node *node) {
+    if (!(node->flags & TRIE_NODE_FLAG_TERMINAL)) {
+        return false;
     }
-    return &zmk_text_expander_trie_nodes[index];
+#if ZMK_TEXT_EXPANDER_GENERATED_NUM_INSTANCES > 1
+    return (node->instance_mask & active_instances) != 0;
+#else
+    return active_instances != 0;
+#endif
 }
 
-const struct trie_node *trie_get_node_for_key(const char *key) {
-    LOG_DBG("Searching for key: \"%s\"", key);
+// Node offsets count in units of TRIE_NODE_ALIGN bytes.
+static inline const struct trie_node *node_at(trie_node_offset_t offset) {
+    return (const struct trie_node *)&tables->trie[(size_t)offset * TRIE_NODE_ALIGN];
+}
 
-    if (!key || zmk_text_expander_trie_num_nodes == 0) {
-        LOG_DBG("Key is null or trie is empty, returning NULL.");
+static const struct trie_node *get_node(trie_node_offset_t offset) {
+    if (offset >= tables->trie_size) {
+        LOG_WRN("Node offset %u out of bounds.", (unsigned int)offset);
         return NULL;
     }
+    return node_at(offset);
+}
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_TRIE_BACKEND_DOUBLE_ARRAY
+// Looks up the child of a node for a single character. Returns the child's offset or TRIE_NODE_OFFSET_NULL.
+static trie_node_offset_t get_child_offset(trie_node_offset_t node_offset, char current_char) {
+    const struct trie_node *node = node_at(node_offset);
+    uint8_t code = (uint8_t)current_char - tables->da_first_char;
+    if (!(node->flags & TRIE_NODE_FLAG_HAS_CHILDREN) || code >= tables->da_alphabet_size) {
+        LOG_DBG("No child found for character '%c'.", current_char);
+        return TRIE_NODE_OFFSET_NULL;
+    }
 
-    const struct trie_node *current_node = get_node(0);
-    if (!current_node) {
-        LOG_ERR("Root node (index 0) is invalid.");
-        return NULL;
+    uint32_t slot = (uint32_t)node->da_base + code;
+    if (slot >= tables->da_num_slots || tables->da_slots[slot].check != node_offset) {
+        LOG_DBG("No child found for character '%c'.", current_char);
+        return TRIE_NODE_OFFSET_NULL;
+    }
+    return tables->da_slots[slot].child_node_offset;
+}
+#else
+// Looks up the child of a node for a single character. Returns the child's offset or TRIE_NODE_OFFSET_NULL.
+static trie_node_offset_t get_child_offset(trie_node_offset_t node_offset, char current_char) {
+    const struct trie_node *node = node_at(node_offset);
+    if (!(node->flags & TRIE_NODE_FLAG_HAS_CHILDREN)) {
+        LOG_DBG("Node has no children, stopping search.");
+        return TRIE_NODE_OFFSET_NULL;
     }
 
-    for (int i = 0; key[i] != '\0'; i++) {
-        char current_char = key[i];
-        LOG_DBG("Processing char '%c' at index %d", current_char, i);
+    uint8_t slot;
+    if (node_offset == 0) {
+        // The root's table is dense, indexed directly by character.
+        slot = (uint8_t)current_char - tables->root_first_char;
+        if (slot > node->mask) {
+            LOG_DBG("No root child for character '%c'.", current_char);
+            return TRIE_NODE_OFFSET_NULL;
+        }
+    } else {
+        slot = TRIE_CHILD_SLOT(current_char, node->seed, node->mask);
+    }
 
-        if (current_node->hash_table_index == NULL_INDEX) {
-            LOG_DBG("Node has no children (hash_table_index is NULL), stopping search.");
+    // The child table is stored inline, right after the node header.
+    const struct trie_hash_entry *entry = &((const struct trie_hash_entry *)(node + 1))[slot];
+    LOG_DBG("Hashed '%c' to slot %u holding key '%c'", current_char, slot, entry->key);
+
+    if (entry->key != current_char || entry->child_node_offset == TRIE_NODE_OFFSET_NULL) {
+        LOG_DBG("No child found for character '%c'.", current_char);
+        return TRIE_NODE_OFFSET_NULL;
+    }
+    return entry->child_node_offset;
+}
+#endif
+
+// Follows `key` from the root. Sets *on_edge when the key ends partway along a compressed edge.
+static const struct trie_node *walk_key(const char *key, bool *on_edge) {
+    *on_edge = false;
+    trie_node_offset_t current_offset = 0;
+    size_t i = 0;
+    while (key[i] != '\0') {
+        current_offset = get_child_offset(current_offset, key[i]);
+        if (current_offset == TRIE_NODE_OFFSET_NULL) {
+            LOG_DBG("No child found for character '%c'. Key not in trie.", key[i]);
             return NULL;
         }
+        i++;
 
-        const struct trie_hash_table *ht = &zmk_text_expander_hash_tables[current_node->hash_table_index];
-        if (ht->num_buckets == 0) {
-            LOG_DBG("Node's hash table has zero buckets, stopping search.");
+        const struct trie_node *node = get_node(current_offset);
+        if (!node) {
             return NULL;
         }
+        if (node->label_len > 0) {
+            const char *label = &tables->string_pool[node->label_offset];
+            size_t remaining = strnlen(&key[i], node->label_len);
+            if (memcmp(&key[i], label, remaining) != 0) {
+                LOG_DBG("Key diverges from edge label \"%.*s\".", node->label_len, label);
+                return NULL;
+            }
+            i += remaining;
+            if (remaining < node->label_len) {
+                *on_edge = true;
+                return node;
+            }
+        }
+    }
+    return get_node(current_offset);
+}
 
-        uint8_t bucket_index = (uint8_t)current_char % ht->num_buckets;
-        LOG_DBG("Hashed '%c' to bucket_index: %u", current_char, bucket_index);
-
-        uint16_t entry_index = zmk_text_expander_hash_buckets[ht->buckets_start_index + bucket_index];
+const char *trie_get_string(trie_string_offset_t offset) {
+    if (offset >= tables->string_pool_size) {
+        return NULL;
+    }
+    return &tables->string_pool[offset];
+}
 
-        bool found_child = false;
-        while (entry_index != NULL_INDEX) {
-            const struct trie_hash_entry *entry = &zmk_text_expander_hash_entries[entry_index];
-            LOG_DBG("Checking entry at index %u with key '%c'", entry_index, entry->key);
-            if (entry->key == current_char) {
-                LOG_DBG("Match found for '%c'. Moving to child node at index %u.", current_char, entry->child_node_index);
-                current_node = get_node(entry->child_node_index);
-                found_child = true;
+bool trie_get_expansion(const struct trie_node *node, struct trie_expansion *expansion) {
+    if (!is_active_terminal(node)) {
+        return false;
+    }
+    trie_string_offset_t text_offset = node->expanded_text_offset;
+    uint8_t flags = node->flags;
+    expansion->typed_len = node->typed_len;
+#if ZMK_TEXT_EXPANDER_GENERATED_NUM_INSTANCES > 1
+    if (node->flags & TRIE_NODE_FLAG_VARIANTS) {
+        // Of the active instances defining the short code, the first by path decides.
+        trie_instance_mask_t defining = node->instance_mask & active_instances;
+        trie_instance_mask_t first = (trie_instance_mask_t)(defining & -defining);
+        const struct trie_variant *variant = NULL;
+        for (trie_string_offset_t i = node->expanded_text_offset; i < tables->num_variants; i++) {
+            if (tables->variants[i].instance_mask & first) {
+                variant = &tables->variants[i];
+                break;
+            }
+            if (tables->variants[i].flags & TRIE_VARIANT_FLAG_LAST) {
                 break;
             }
-            entry_index = entry->next_entry_index;
         }
-
-        if (!found_child) {
-            LOG_DBG("No child found for character '%c'. Key not in trie.", current_char);
-            return NULL;
+        if (!variant) {
+            LOG_WRN("No variant of the terminal at %u for the active instances.", (unsigned int)text_offset);
+            return false;
         }
+        text_offset = variant->text_offset;
+        flags = variant->flags;
+        expansion->typed_len = variant->typed_len;
+    }
+#endif
+    expansion->preserve_trigger = flags & TRIE_NODE_FLAG_PRESERVE_TRIGGER;
+    expansion->completion = flags & TRIE_NODE_FLAG_COMPLETION;
+    expansion->keys = (const uint8_t *)trie_get_string(text_offset);
+    if (!expansion->keys) {
+        LOG_ERR("Keystroke program offset %u is invalid.", (unsigned int)text_offset);
+        return false;
     }
+    return true;
+}
 
-    LOG_DBG("Finished processing key. Returning final node.");
-    return current_node;
+const uint8_t *trie_get_phrase(const uint8_t *token, uint8_t *len) {
+    uint16_t number = ((token[0] - TRIE_PHRASE_TOKEN_LEAD) << 7) | (token[1] & 0x7F);
+    if (token[1] == TRIE_OP_END || number >= tables->num_phrases) {
+        LOG_WRN("Phrase token %u out of bounds.", number);
+        return NULL;
+    }
+    *len = tables->phrases[number].len;
+    return (const uint8_t *)&tables->string_pool[tables->phrases[number].offset];
+}
+
+const uint8_t *trie_get_fragment(uint32_t index) {
+    if (index >= tables->num_fragments) {
+        LOG_WRN("Fragment %u out of bounds.", index);
+        return NULL;
+    }
+    return (const uint8_t *)&tables->string_pool[tables->fragments[index]];
+}
+
+const struct trie_node *trie_get_root(void) {
+    return tables->trie_size > 0 ? node_at(0) : NULL;
+}
+
+const struct trie_node *trie_get_node_for_key(const char *key) {
+    LOG_DBG("Searching for key: \"%s\"", key);
+
+    if (!key || tables->trie_size == 0) {
+        LOG_DBG("Key is null or trie is empty, returning NULL.");
+        return NULL;
+    }
+
+    bool on_edge;
+    return walk_key(key, &on_edge);
 }
 
 const struct trie_node *trie_search(const char *key) {
     LOG_DBG("trie_search called for key: \"%s\"", key);
-    const struct trie_node *node = trie_get_node_for_key(key);
-    if (node && node->is_terminal) {
+
+    if (!key || tables->trie_size == 0) {
+        return NULL;
+    }
+
+    bool on_edge;
+    const struct trie_node *node = walk_key(key, &on_edge);
+    if (node && !on_edge && is_active_terminal(node)) {
         LOG_DBG("Node found for key and it is a terminal node. Search successful.");
         return node;
     }
     LOG_DBG("Node not found or not a terminal node. Search failed.");
     return NULL;
 }
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_STREAMING_MATCH
+trie_node_offset_t trie_stream_advance(trie_node_offset_t state, char c) {
+    if (tables->trie_size == 0) {
+        return 0;
+    }
+    while (true) {
+        trie_node_offset_t child = get_child_offset(state, c);
+        if (child != TRIE_NODE_OFFSET_NULL) {
+            return child;
+        }
+        if (state == 0) {
+            return 0;
+        }
+        state = node_at(state)->fail_offset;
+    }
+}
+
+const struct trie_node *trie_stream_node(trie_node_offset_t state) {
+    return tables->trie_size > 0 ? get_node(state) : NULL;
+}
+
+const struct trie_node *trie_stream_match(trie_node_offset_t state) {
+    const struct trie_node *node = trie_stream_node(state);
+    // Terminals on the match chain get shorter, so the first active one is the longest.
+    while (node && node->match_offset != TRIE_NODE_OFFSET_NULL) {
+        const struct trie_node *match = get_node(node->match_offset);
+        if (!match || is_active_terminal(match)) {
+            return match;
+        }
+        node = get_node(match->fail_offset);
+    }
+    return NULL;
+}
+#endif
+
+const struct trie_node *trie_unique_completion(const struct trie_node *node) {
+    if (!node || !(node->flags & TRIE_NODE_FLAG_UNIQUE_COMPLETION)) {
+        return NULL;
+    }
+    // A node's first child directly follows its header and inline child table.
+    while (!(node->flags & TRIE_NODE_FLAG_TERMINAL)) {
+        size_t node_size = sizeof(struct trie_node);
+#ifndef CONFIG_ZMK_TEXT_EXPANDER_TRIE_BACKEND_DOUBLE_ARRAY
+        node_size += ((size_t)node->mask + 1) * sizeof(struct trie_hash_entry);
+#endif
+        node = (const struct trie_node *)((const uint8_t *)node + ROUND_UP(node_size, TRIE_NODE_ALIGN));
+    }
+    return is_active_terminal(node) ? node : NULL;
+}
+
+void trie_cursor_reset(struct trie_cursor *cursor) {
+    cursor->path[0] = 0;
+    cursor->depth = 0;
+    cursor->label_pos = 0;
+    cursor->miss_depth = (tables->trie_size == 0) ? 1 : 0;
+}
+
+bool trie_cursor_advance(struct trie_cursor *cursor, char c) {
+    if (cursor->miss_depth > 0) {
+        cursor->miss_depth++;
+        return false;
+    }
+
+    const struct trie_node *node = node_at(cursor->path[cursor->depth]);
+    if (cursor->label_pos < node->label_len) {
+        if (tables->string_pool[node->label_offset + cursor->label_pos] != c) {
+            cursor->miss_depth++;
+            return false;
+        }
+        cursor->label_pos++;
+        return true;
+    }
+
+    trie_node_offset_t child_offset = (cursor->depth < TRIE_CURSOR_MAX_DEPTH)
+                                          ? get_child_offset(cursor->path[cursor->depth], c)
+                                          : TRIE_NODE_OFFSET_NULL;
+    if (child_offset == TRIE_NODE_OFFSET_NULL || child_offset >= tables->trie_size) {
+        cursor->miss_depth++;
+        return false;
+    }
+
+    cursor->path[++cursor->depth] = child_offset;
+    cursor->label_pos = 0;
+    return true;
+}
+
+void trie_cursor_retreat(struct trie_cursor *cursor) {
+    if (cursor->miss_depth > 0) {
+        // An empty trie keeps a permanent miss so the cursor never reads node 0.
+        if (cursor->miss_depth > 1 || tables->trie_size > 0) {
+            cursor->miss_depth--;
+        }
+        return;
+    }
+    if (cursor->label_pos > 0) {
+        cursor->label_pos--;
+    } else if (cursor->depth > 0) {
+        cursor->depth--;
+        cursor->label_pos = node_at(cursor->path[cursor->depth])->label_len;
+    }
+}
+
+const struct trie_node *trie_cursor_node(const struct trie_cursor *cursor) {
+    if (cursor->miss_depth > 0) {
+        return NULL;
+    }
+    return node_at(cursor->path[cursor->depth]);
+}
+
+const struct trie_node *trie_cursor_terminal(const struct trie_cursor *cursor) {
+    const struct trie_node *node = trie_cursor_node(cursor);
+    if (!node || cursor->label_pos < node->label_len) {
+        return NULL;
+    }
+    return is_active_terminal(node) ? node : NULL;
+}
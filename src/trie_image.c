@@ -0,0 +1,244 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/crc.h>
+#include <errno.h>
+#include <stddef.h>
+#include <zmk/trie.h>
+#include <zmk/trie_image.h>
+
+#ifdef CONFIG_FLASH_SIMULATOR
+#include <zephyr/drivers/flash/flash_simulator.h>
+#endif
+
+LOG_MODULE_REGISTER(trie_image, LOG_LEVEL_DBG);
+
+BUILD_ASSERT(FIXED_PARTITION_EXISTS(text_expander_partition),
+             "CONFIG_ZMK_TEXT_EXPANDER_DICTIONARY_PARTITION needs a text_expander_partition flash partition.");
+BUILD_ASSERT(sizeof(struct trie_image_header) == 80, "trie_image_header does not match the generated layout.");
+BUILD_ASSERT(TRIE_NODE_ALIGN <= TRIE_IMAGE_SECTION_ALIGN, "Image sections are not aligned enough for the trie.");
+
+#define TRIE_IMAGE_LAYOUT_FLAGS                                                                    \
+    ((IS_ENABLED(CONFIG_ZMK_TEXT_EXPANDER_TRIE_BACKEND_DOUBLE_ARRAY) ? TRIE_IMAGE_FLAG_DOUBLE_ARRAY : 0) | \
+     (IS_ENABLED(CONFIG_ZMK_TEXT_EXPANDER_STREAMING_MATCH) ? TRIE_IMAGE_FLAG_STREAMING : 0))
+
+#define NO_SLOT -1
+
+static const struct flash_area *partition;
+static struct trie_tables slot_tables[2];
+static int active_slot = NO_SLOT;
+static uint32_t active_version;
+static int pending_slot = NO_SLOT;
+
+static size_t slot_size(void) {
+    return partition->fa_size / 2;
+}
+
+static off_t slot_offset(int slot) {
+    return (off_t)slot * slot_size();
+}
+
+// The slot as it appears in memory. Images are read in place, never copied.
+static const uint8_t *slot_memory(int slot) {
+#ifdef CONFIG_FLASH_SIMULATOR
+    size_t memory_size;
+    const uint8_t *memory = flash_simulator_get_memory(flash_area_get_device(partition), &memory_size);
+#else
+    const uint8_t *memory = (const uint8_t *)CONFIG_FLASH_BASE_ADDRESS;
+#endif
+    return memory + partition->fa_off + slot_offset(slot);
+}
+
+static bool section_fits(const struct trie_image_header *header, enum trie_image_section_id id, size_t entry_size) {
+    const struct trie_image_section *section = &header->sections[id];
+    return section->offset % TRIE_IMAGE_SECTION_ALIGN == 0 && section->offset >= header->header_size &&
+           section->offset <= header->image_size && section->size <= header->image_size - section->offset &&
+           section->size % entry_size == 0;
+}
+
+// Phrases are read by length rather than up to a terminator, so each must end
+// inside the string pool.
+static bool phrases_fit(const struct trie_tables *tables) {
+    for (uint16_t i = 0; i < tables->num_phrases; i++) {
+        if ((uint32_t)tables->phrases[i].offset + tables->phrases[i].len > tables->string_pool_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Checks the image at `image` against this firmware and, if it is usable,
+// fills in `tables` to read it in place.
+static int validate_image(const uint8_t *image, size_t capacity, struct trie_tables *tables, uint32_t *version) {
+    const struct trie_image_header *header = (const struct trie_image_header *)image;
+    if (header->magic != TRIE_IMAGE_MAGIC) {
+        return -ENOENT;
+    }
+    if (header->format_version != TRIE_IMAGE_FORMAT_VERSION || header->header_size != sizeof(*header) ||
+        header->image_size < sizeof(*header) || header->image_size > capacity) {
+        LOG_WRN("Dictionary image has an unsupported format.");
+        return -EINVAL;
+    }
+    if (header->node_offset_size != sizeof(trie_node_offset_t) ||
+        header->string_offset_size != sizeof(trie_string_offset_t) ||
+        header->slot_index_size != sizeof(trie_slot_index_t) ||
+        header->typed_len_size != sizeof(trie_typed_len_t) || header->node_align != TRIE_NODE_ALIGN ||
+        header->layout_flags != TRIE_IMAGE_LAYOUT_FLAGS ||
+        header->max_short_len > ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN ||
+        header->max_ref_depth > ZMK_TEXT_EXPANDER_GENERATED_MAX_REF_DEPTH ||
+        header->num_instances != ZMK_TEXT_EXPANDER_GENERATED_NUM_INSTANCES) {
+        LOG_WRN("Dictionary image version %u was built for a different firmware configuration.",
+                header->dictionary_version);
+        return -ENOTSUP;
+    }
+
+    const struct trie_image_section *sections = header->sections;
+    if (!section_fits(header, TRIE_IMAGE_SECTION_TRIE, TRIE_NODE_ALIGN) ||
+        !section_fits(header, TRIE_IMAGE_SECTION_DA_SLOTS, sizeof(struct trie_da_slot)) ||
+        !section_fits(header, TRIE_IMAGE_SECTION_STRING_POOL, 1) ||
+        !section_fits(header, TRIE_IMAGE_SECTION_PHRASES, sizeof(struct trie_phrase)) ||
+        !section_fits(header, TRIE_IMAGE_SECTION_FRAGMENTS, sizeof(trie_string_offset_t)) ||
+        !section_fits(header, TRIE_IMAGE_SECTION_VARIANTS, sizeof(struct trie_variant)) ||
+        sections[TRIE_IMAGE_SECTION_TRIE].size / TRIE_NODE_ALIGN >= TRIE_NODE_OFFSET_NULL ||
+        sections[TRIE_IMAGE_SECTION_DA_SLOTS].size / sizeof(struct trie_da_slot) >= TRIE_SLOT_INDEX_NULL ||
+        sections[TRIE_IMAGE_SECTION_PHRASES].size / sizeof(struct trie_phrase) > UINT16_MAX ||
+        sections[TRIE_IMAGE_SECTION_FRAGMENTS].size / sizeof(trie_string_offset_t) > UINT16_MAX ||
+        sections[TRIE_IMAGE_SECTION_VARIANTS].size / sizeof(struct trie_variant) >= TRIE_STRING_OFFSET_NULL ||
+        sections[TRIE_IMAGE_SECTION_STRING_POOL].size == 0 ||
+        image[sections[TRIE_IMAGE_SECTION_STRING_POOL].offset + sections[TRIE_IMAGE_SECTION_STRING_POOL].size - 1] != '\0') {
+        LOG_WRN("Dictionary image version %u has malformed sections.", header->dictionary_version);
+        return -EINVAL;
+    }
+
+    uint32_t crc = crc32_ieee(image, offsetof(struct trie_image_header, crc32));
+    crc = crc32_ieee_update(crc, image + header->header_size, header->image_size - header->header_size);
+    if (crc != header->crc32) {
+        LOG_WRN("Dictionary image version %u failed its checksum.", header->dictionary_version);
+        return -EBADMSG;
+    }
+
+    *tables = (struct trie_tables){
+        .trie = image + sections[TRIE_IMAGE_SECTION_TRIE].offset,
+        .trie_size = sections[TRIE_IMAGE_SECTION_TRIE].size / TRIE_NODE_ALIGN,
+        .root_first_char = header->root_first_char,
+        .da_first_char = header->da_first_char,
+        .da_alphabet_size = header->da_alphabet_size,
+        .da_num_slots = sections[TRIE_IMAGE_SECTION_DA_SLOTS].size / sizeof(struct trie_da_slot),
+        .da_slots = (const struct trie_da_slot *)(image + sections[TRIE_IMAGE_SECTION_DA_SLOTS].offset),
+        .string_pool = (const char *)(image + sections[TRIE_IMAGE_SECTION_STRING_POOL].offset),
+        .string_pool_size = sections[TRIE_IMAGE_SECTION_STRING_POOL].size,
+        .num_phrases = sections[TRIE_IMAGE_SECTION_PHRASES].size / sizeof(struct trie_phrase),
+        .phrases = (const struct trie_phrase *)(image + sections[TRIE_IMAGE_SECTION_PHRASES].offset),
+        .num_fragments = sections[TRIE_IMAGE_SECTION_FRAGMENTS].size / sizeof(trie_string_offset_t),
+        .fragments = (const trie_string_offset_t *)(image + sections[TRIE_IMAGE_SECTION_FRAGMENTS].offset),
+        .num_variants = sections[TRIE_IMAGE_SECTION_VARIANTS].size / sizeof(struct trie_variant),
+        .variants = (const struct trie_variant *)(image + sections[TRIE_IMAGE_SECTION_VARIANTS].offset),
+    };
+    if (!phrases_fit(tables)) {
+        LOG_WRN("Dictionary image version %u has a phrase outside its string pool.", header->dictionary_version);
+        return -EINVAL;
+    }
+    *version = header->dictionary_version;
+    return 0;
+}
+
+int trie_image_load(void) {
+    int err = flash_area_open(FIXED_PARTITION_ID(text_expander_partition), &partition);
+    if (err) {
+        LOG_ERR("Failed to open the dictionary partition (err %d).", err);
+        partition = NULL;
+        return err;
+    }
+
+    // Loading again, as after a reboot, starts over from the flash contents.
+    active_slot = NO_SLOT;
+    pending_slot = NO_SLOT;
+    uint32_t versions[2];
+    bool valid[2];
+    for (int slot = 0; slot < 2; slot++) {
+        valid[slot] = validate_image(slot_memory(slot), slot_size(), &slot_tables[slot], &versions[slot]) == 0;
+    }
+    // A write that was interrupted before the old image was erased leaves both
+    // valid; the newer one was committed last.
+    if (valid[1] && (!valid[0] || versions[1] > versions[0])) {
+        active_slot = 1;
+    } else if (valid[0]) {
+        active_slot = 0;
+    } else {
+        LOG_INF("No dictionary image in flash, using the compiled-in expansions.");
+        trie_set_tables(NULL);
+        return 0;
+    }
+
+    active_version = versions[active_slot];
+    trie_set_tables(&slot_tables[active_slot]);
+    LOG_INF("Using dictionary image version %u from flash.", active_version);
+    return 0;
+}
+
+int trie_image_begin(size_t image_size) {
+    if (!partition) {
+        return -ENODEV;
+    }
+    if (image_size < sizeof(struct trie_image_header) || image_size > slot_size()) {
+        LOG_WRN("Dictionary image of %u bytes does not fit a %u byte slot.", (unsigned int)image_size,
+                (unsigned int)slot_size());
+        return -EFBIG;
+    }
+
+    int slot = active_slot == 0 ? 1 : 0;
+    int err = flash_area_erase(partition, slot_offset(slot), slot_size());
+    if (err) {
+        LOG_ERR("Failed to erase the dictionary slot (err %d).", err);
+        pending_slot = NO_SLOT;
+        return err;
+    }
+    pending_slot = slot;
+    return 0;
+}
+
+int trie_image_write(size_t offset, const void *data, size_t len) {
+    if (pending_slot == NO_SLOT) {
+        return -EINVAL;
+    }
+    if (offset > slot_size() || len > slot_size() - offset) {
+        return -EFBIG;
+    }
+    return flash_area_write(partition, slot_offset(pending_slot) + offset, data, len);
+}
+
+int trie_image_commit(void) {
+    if (pending_slot == NO_SLOT) {
+        return -EINVAL;
+    }
+
+    int slot = pending_slot;
+    pending_slot = NO_SLOT;
+    struct trie_tables tables;
+    uint32_t version;
+    int err = validate_image(slot_memory(slot), slot_size(), &tables, &version);
+    if (err) {
+        return err;
+    }
+    if (active_slot != NO_SLOT && version <= active_version) {
+        LOG_WRN("Dictionary image version %u is not newer than version %u in use.", version, active_version);
+        return -EALREADY;
+    }
+
+    slot_tables[slot] = tables;
+    trie_set_tables(&slot_tables[slot]);
+    int old_slot = active_slot;
+    active_slot = slot;
+    active_version = version;
+    LOG_INF("Switched to dictionary image version %u.", version);
+
+    // If this fails, the old image loses to the newer one at the next boot.
+    if (old_slot != NO_SLOT && (err = flash_area_erase(partition, slot_offset(old_slot), slot_size())) != 0) {
+        LOG_WRN("Failed to erase the previous dictionary image (err %d).", err);
+    }
+    return 0;
+}
+
+uint32_t trie_image_active_version(void) {
+    return active_slot == NO_SLOT ? 0 : active_version;
+}
@@ -0,0 +1,74 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zmk/endpoints.h>
+#include <zmk/typing_pace.h>
+
+#ifdef CONFIG_ZMK_BLE
+#include <zephyr/bluetooth/conn.h>
+#include <zmk/ble.h>
+#endif
+
+LOG_MODULE_REGISTER(typing_pace, LOG_LEVEL_DBG);
+
+// An accepted report takes this fraction off the delay; a rejected one doubles it.
+#define PACE_SPEEDUP_DIVISOR 16
+
+struct pace_profile {
+    const char *name;
+    uint32_t delay_us;
+    uint32_t floor_us;
+};
+
+enum pace_profile_id {
+    PACE_USB,
+    PACE_BLE,
+};
+
+// Both start at the fixed pace and keep what they learned between expansions.
+static struct pace_profile profiles[] = {
+    [PACE_USB] = {"USB", CONFIG_ZMK_TEXT_EXPANDER_TYPING_DELAY * 1000 / 2, CONFIG_ZMK_TEXT_EXPANDER_PACING_USB_MIN_US},
+    [PACE_BLE] = {"BLE", CONFIG_ZMK_TEXT_EXPANDER_TYPING_DELAY * 1000 / 2, CONFIG_ZMK_TEXT_EXPANDER_PACING_BLE_MIN_US},
+};
+static struct pace_profile *active = &profiles[PACE_USB];
+
+#ifdef CONFIG_ZMK_BLE
+// Connection interval of the active BLE profile in microseconds, or 0 if it is not connected.
+static uint32_t ble_interval_us(void) {
+    struct bt_conn *conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, zmk_ble_active_profile_addr());
+    if (!conn) {
+        return 0;
+    }
+    struct bt_conn_info info;
+    int err = bt_conn_get_info(conn, &info);
+    bt_conn_unref(conn);
+    return err ? 0 : info.le.interval * 1250; // In units of 1.25 ms.
+}
+#endif
+
+void typing_pace_start(void) {
+    bool ble = zmk_endpoints_selected().transport == ZMK_TRANSPORT_BLE;
+    active = &profiles[ble ? PACE_BLE : PACE_USB];
+#ifdef CONFIG_ZMK_BLE
+    // The link carries a few reports per connection event; sending faster only fills the queue.
+    if (ble) {
+        active->floor_us = MAX(CONFIG_ZMK_TEXT_EXPANDER_PACING_BLE_MIN_US,
+                               ble_interval_us() / CONFIG_ZMK_TEXT_EXPANDER_PACING_BLE_REPORTS_PER_EVENT);
+    }
+#endif
+    active->delay_us = CLAMP(active->delay_us, active->floor_us, CONFIG_ZMK_TEXT_EXPANDER_PACING_MAX_US);
+    LOG_DBG("Pacing %s reports every %u us (floor %u us)", active->name, active->delay_us, active->floor_us);
+}
+
+uint32_t typing_pace_delay_us(void) {
+    return active->delay_us;
+}
+
+void typing_pace_update(int err) {
+    if (err == 0) {
+        active->delay_us = MAX(active->delay_us - active->delay_us / PACE_SPEEDUP_DIVISOR, active->floor_us);
+    } else {
+        active->delay_us = MIN(MAX(active->delay_us * 2, TYPING_PACE_MIN_RETRY_US), CONFIG_ZMK_TEXT_EXPANDER_PACING_MAX_US);
+        LOG_DBG("%s endpoint turned down a report (err %d), backing off to %u us", active->name, err,
+                active->delay_us);
+    }
+}
@@ -0,0 +1,256 @@
+#include <zephyr/drivers/flash/flash_simulator.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/ztest.h>
+#include <errno.h>
+#include <string.h>
+#include <zmk/trie.h>
+#include <zmk/trie_image.h>
+
+// The image gen_trie.py wrote for the dictionary in the board overlay.
+static const uint8_t dictionary_image[] = {
+#include <text_expander_dictionary.inc>
+};
+
+static const char *const short_codes[] = {"brb", "btw", "ex", "kr", "krt", "omw", "sig", "ty"};
+static const char *const misses[] = {"b", "br", "brbx", "k", "krtx", "team", "x", "sigh"};
+
+#define MAX_PROGRAM_LEN 128
+
+static const struct flash_area *partition;
+static uint8_t compiled_programs[ARRAY_SIZE(short_codes)][MAX_PROGRAM_LEN];
+static uint8_t image[sizeof(dictionary_image)];
+
+static size_t slot_size(void) {
+    return partition->fa_size / 2;
+}
+
+static struct trie_image_header *image_header(void) {
+    return (struct trie_image_header *)image;
+}
+
+// Copies the generated image and gives it `version`; seal_image() then fixes
+// the checksum, so a test can change more first.
+static void make_image(uint32_t version) {
+    memcpy(image, dictionary_image, sizeof(image));
+    image_header()->dictionary_version = version;
+}
+
+static void seal_image(void) {
+    struct trie_image_header *header = image_header();
+    uint32_t crc = crc32_ieee(image, offsetof(struct trie_image_header, crc32));
+    header->crc32 = crc32_ieee_update(crc, image + header->header_size, header->image_size - header->header_size);
+}
+
+// Writes the first `len` bytes of the image straight into `slot`, as an earlier boot left it.
+static void put_slot(int slot, size_t len) {
+    zassert_ok(flash_area_erase(partition, slot * slot_size(), slot_size()));
+    zassert_ok(flash_area_write(partition, slot * slot_size(), image, len));
+}
+
+// Writes the image through the update API, as text_expander_commit_dictionary() does.
+static int update(void) {
+    int err = trie_image_begin(sizeof(image));
+    if (err) {
+        return err;
+    }
+    zassert_ok(trie_image_write(0, image, sizeof(image)));
+    return trie_image_commit();
+}
+
+// True if the lookups read the tables in place from `slot` of the partition.
+static bool reads_from_slot(int slot) {
+    size_t memory_size;
+    const uint8_t *memory = flash_simulator_get_memory(flash_area_get_device(partition), &memory_size);
+    const uint8_t *start = memory + partition->fa_off + slot * slot_size();
+    const uint8_t *root = (const uint8_t *)trie_get_root();
+    return root >= start && root < start + slot_size();
+}
+
+// Length of a keystroke program up to and including TRIE_OP_END.
+static size_t program_len(const uint8_t *keys) {
+    size_t len = 0;
+    while (keys[len] != TRIE_OP_END) {
+        if (trie_is_phrase_token(keys + len)) {
+            len += TRIE_PHRASE_TOKEN_LEN;
+        } else if (keys[len] == TRIE_OP_UNICODE) {
+            len += TRIE_OP_UNICODE_LEN;
+        } else if (keys[len] == TRIE_OP_REF) {
+            len += TRIE_OP_REF_LEN;
+        } else {
+            len++;
+        }
+    }
+    return len + 1;
+}
+
+static const uint8_t *program_of(const char *short_code) {
+    struct trie_expansion expansion;
+    const struct trie_node *node = trie_search(short_code);
+    zassert_not_null(node, "'%s' not found", short_code);
+    zassert_true(trie_get_expansion(node, &expansion), "'%s' has no expansion", short_code);
+    zassert_true(program_len(expansion.keys) <= MAX_PROGRAM_LEN);
+    return expansion.keys;
+}
+
+// The tables in use find what the compiled-in ones find, for the same dictionary.
+static void assert_same_lookups(void) {
+    for (size_t i = 0; i < ARRAY_SIZE(short_codes); i++) {
+        const uint8_t *keys = program_of(short_codes[i]);
+        zassert_mem_equal(keys, compiled_programs[i], program_len(keys), "'%s' expands differently",
+                          short_codes[i]);
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(misses); i++) {
+        zassert_is_null(trie_search(misses[i]), "'%s' matched", misses[i]);
+    }
+}
+
+static void assert_using(uint32_t version, int slot) {
+    zassert_equal(trie_image_active_version(), version);
+    zassert_true(reads_from_slot(slot), "not reading slot %d in place", slot);
+    assert_same_lookups();
+}
+
+static void assert_using_compiled(void) {
+    zassert_equal(trie_image_active_version(), 0);
+    zassert_false(reads_from_slot(0) || reads_from_slot(1));
+    assert_same_lookups();
+}
+
+static void *trie_image_setup(void) {
+    zassert_ok(flash_area_open(FIXED_PARTITION_ID(text_expander_partition), &partition));
+    zassert_true(sizeof(dictionary_image) <= slot_size());
+    trie_set_tables(NULL);
+    for (size_t i = 0; i < ARRAY_SIZE(short_codes); i++) {
+        const uint8_t *keys = program_of(short_codes[i]);
+        memcpy(compiled_programs[i], keys, program_len(keys));
+    }
+    return NULL;
+}
+
+static void trie_image_before(void *fixture) {
+    zassert_ok(flash_area_erase(partition, 0, partition->fa_size));
+}
+
+ZTEST_SUITE(trie_image, NULL, trie_image_setup, trie_image_before, NULL, NULL);
+
+ZTEST(trie_image, test_empty_partition) {
+    zassert_ok(trie_image_load());
+    assert_using_compiled();
+}
+
+ZTEST(trie_image, test_good_image) {
+    make_image(2);
+    seal_image();
+    put_slot(0, sizeof(image));
+    zassert_ok(trie_image_load());
+    assert_using(2, 0);
+}
+
+ZTEST(trie_image, test_bad_checksum) {
+    struct trie_image_header *header = image_header();
+    make_image(2);
+    seal_image();
+    image[header->sections[TRIE_IMAGE_SECTION_STRING_POOL].offset] ^= 1;
+    put_slot(0, sizeof(image));
+    zassert_ok(trie_image_load());
+    assert_using_compiled();
+
+    // A corrupt update leaves the image in use alone.
+    make_image(2);
+    seal_image();
+    put_slot(0, sizeof(image));
+    zassert_ok(trie_image_load());
+    make_image(3);
+    seal_image();
+    image[header->sections[TRIE_IMAGE_SECTION_TRIE].offset] ^= 1;
+    zassert_equal(update(), -EBADMSG);
+    assert_using(2, 0);
+}
+
+ZTEST(trie_image, test_phrase_outside_string_pool) {
+    struct trie_image_header *header = image_header();
+    make_image(3);
+    zassert_true(header->sections[TRIE_IMAGE_SECTION_PHRASES].size > 0, "the test dictionary has no phrases");
+    struct trie_phrase *phrase = (struct trie_phrase *)(image + header->sections[TRIE_IMAGE_SECTION_PHRASES].offset);
+    phrase->offset = header->sections[TRIE_IMAGE_SECTION_STRING_POOL].size - 1;
+    phrase->len = 4;
+    // The checksum is right, so only the bounds check can catch it.
+    seal_image();
+    put_slot(1, sizeof(image));
+    zassert_ok(trie_image_load());
+    assert_using_compiled();
+
+    make_image(2);
+    seal_image();
+    put_slot(0, sizeof(image));
+    zassert_ok(trie_image_load());
+    make_image(3);
+    phrase->offset = header->sections[TRIE_IMAGE_SECTION_STRING_POOL].size - 1;
+    phrase->len = 4;
+    seal_image();
+    zassert_equal(update(), -EINVAL);
+    assert_using(2, 0);
+}
+
+ZTEST(trie_image, test_update_must_be_newer) {
+    make_image(2);
+    seal_image();
+    put_slot(0, sizeof(image));
+    zassert_ok(trie_image_load());
+
+    zassert_equal(update(), -EALREADY);
+    assert_using(2, 0);
+    make_image(1);
+    seal_image();
+    zassert_equal(update(), -EALREADY);
+    assert_using(2, 0);
+
+    make_image(3);
+    seal_image();
+    zassert_ok(update());
+    assert_using(3, 1);
+    // The old image is erased once the new one is in use, and a reboot keeps the new one.
+    uint32_t magic;
+    zassert_ok(flash_area_read(partition, 0, &magic, sizeof(magic)));
+    zassert_equal(magic, 0xFFFFFFFF);
+    zassert_ok(trie_image_load());
+    assert_using(3, 1);
+}
+
+ZTEST(trie_image, test_interrupted_swap) {
+    // Power lost after the new image was written but before the old one was
+    // erased: both are valid, and the newer one wins in either slot.
+    make_image(2);
+    seal_image();
+    put_slot(0, sizeof(image));
+    make_image(3);
+    seal_image();
+    put_slot(1, sizeof(image));
+    zassert_ok(trie_image_load());
+    assert_using(3, 1);
+
+    put_slot(0, sizeof(image));
+    make_image(2);
+    seal_image();
+    put_slot(1, sizeof(image));
+    zassert_ok(trie_image_load());
+    assert_using(3, 0);
+
+    // Power lost halfway through writing the new image: the old one stays.
+    make_image(2);
+    seal_image();
+    put_slot(0, sizeof(image));
+    make_image(3);
+    seal_image();
+    put_slot(1, sizeof(image) / 2);
+    zassert_ok(trie_image_load());
+    assert_using(2, 0);
+
+    // The same through the update API, with a reboot instead of the commit.
+    zassert_ok(trie_image_begin(sizeof(image)));
+    zassert_ok(trie_image_write(0, image, sizeof(image) / 2));
+    zassert_ok(trie_image_load());
+    assert_using(2, 0);
+    zassert_equal(trie_image_commit(), -EINVAL);
+}